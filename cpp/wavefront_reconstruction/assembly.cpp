@@ -0,0 +1,430 @@
+#include "pch.h"
+#include "framework.h"
+#include "assembly.h"
+#include "stencils.h"
+#include "parallel.h"
+#include "wfr_ordering.h"
+
+
+CWFRAssembly::CWFRAssembly(const MatrixViewd& Sx, const MatrixViewd& Sy, CWFR::WFR_ORDERING ordering)
+	: m_rows(Sx.rows())
+	, m_cols(Sx.cols())
+	, m_ids(Sx.rows(), Sx.cols())
+	, m_class_x(MatrixXXb::Zero(Sx.rows(), Sx.cols()))
+	, m_class_y(MatrixXXb::Zero(Sx.rows(), Sx.cols()))
+	, m_num_unknowns(0)
+	, m_num_fifth_order(0)
+	, m_ordering(ordering)
+{
+	scan(Sx, Sy);
+}
+
+CWFRAssembly::CWFRAssembly(const MatrixViewf& Sx, const MatrixViewf& Sy, CWFR::WFR_ORDERING ordering)
+	: m_rows(Sx.rows())
+	, m_cols(Sx.cols())
+	, m_ids(Sx.rows(), Sx.cols())
+	, m_class_x(MatrixXXb::Zero(Sx.rows(), Sx.cols()))
+	, m_class_y(MatrixXXb::Zero(Sx.rows(), Sx.cols()))
+	, m_num_unknowns(0)
+	, m_num_fifth_order(0)
+	, m_ordering(ordering)
+{
+	scan(Sx, Sy);
+}
+
+CWFRAssembly::~CWFRAssembly()
+{
+}
+
+template <class SlopeView>
+void CWFRAssembly::scan(const SlopeView& Sx, const SlopeView& Sy)
+{
+	// the finite slopes and the valid ids as 0/1 bytes
+	ArrayXXb Fx = Sx.array().isFinite().template cast<uint8_t>();
+	ArrayXXb Fy = Sy.array().isFinite().template cast<uint8_t>();
+	ArrayXXb V = Fx * Fy;
+
+	// index the valid ids in the row-major scan order
+	int32_t current_id = 0;
+	for (int_t id = 0; id < m_ids.size(); id++) {
+		m_ids.data()[id] = V.data()[id] ? current_id++ : -1;
+	}
+	m_num_unknowns = current_id;
+
+	// the x pass
+	if (m_cols >= 2) {
+		auto n = m_cols - 1;
+		m_class_x.leftCols(n).array() = Fx.leftCols(n) * Fx.rightCols(n) * V.leftCols(n) * V.rightCols(n);
+		if (m_cols >= 4) {
+			auto n5 = m_cols - 3;
+			m_class_x.middleCols(1, n5).array() += m_class_x.middleCols(1, n5).array() * Fx.leftCols(n5) * Fx.rightCols(n5);
+		}
+	}
+
+	// the y pass
+	if (m_rows >= 2) {
+		auto n = m_rows - 1;
+		m_class_y.topRows(n).array() = Fy.topRows(n) * Fy.bottomRows(n) * V.topRows(n) * V.bottomRows(n);
+		if (m_rows >= 4) {
+			auto n5 = m_rows - 3;
+			m_class_y.middleRows(1, n5).array() += m_class_y.middleRows(1, n5).array() * Fy.topRows(n5) * Fy.bottomRows(n5);
+		}
+	}
+
+	// count the equations of every row, and take the prefix sum
+	m_row_offsets.assign(num_pass_rows() + 1, 0);
+	for (int_t i = 0; i < m_rows; i++) {
+		m_row_offsets[i + 1] = m_row_offsets[i] + (m_class_x.row(i).array() != NONE).count();
+	}
+	for (int_t i = 0; i < m_rows; i++) {
+		m_row_offsets[m_rows + i + 1] = m_row_offsets[m_rows + i] + (m_class_y.row(i).array() != NONE).count();
+	}
+	m_num_fifth_order = (m_class_x.array() == FIFTH).count() + (m_class_y.array() == FIFTH).count();
+
+	// renumber the unknowns, except for a fully valid rectangle whose
+	// natural order is already banded and is assumed by the DCT backend
+	if (is_full_rectangle()) m_ordering = CWFR::WFR_ORDERING::NATURAL;
+	if (m_ordering != CWFR::WFR_ORDERING::NATURAL) {
+		auto permutation = order_unknowns(m_ids, m_num_unknowns, m_ordering);
+		for (int_t id = 0; id < m_ids.size(); id++) {
+			auto& k = m_ids.data()[id];
+			if (k >= 0) k = static_cast<int32_t>(permutation[k]);
+		}
+	}
+
+	label_components();
+}
+
+void CWFRAssembly::label_components()
+{
+	// union-find over the unknowns linked by a segment
+	std_veci parent(m_num_unknowns);
+	for (int_t k = 0; k < m_num_unknowns; k++) parent[k] = k;
+	auto find = [&parent](int_t k) {
+		while (parent[k] != k) k = parent[k] = parent[parent[k]];
+		return k;
+	};
+	auto unite = [&](int_t a, int_t b) {
+		a = find(a);
+		b = find(b);
+		if (a != b) parent[std::max(a, b)] = std::min(a, b);
+	};
+
+	for (int_t i = 0; i < m_rows; i++) {
+		for (int_t j = 0; j < m_cols; j++) {
+			if (m_class_x(i, j) != NONE) unite(m_ids(i, j), m_ids(i, j + 1));
+			if (m_class_y(i, j) != NONE) unite(m_ids(i, j), m_ids(i + 1, j));
+		}
+	}
+
+	// number the roots in the order of their first unknowns
+	m_components.assign(m_num_unknowns, -1);
+	m_pins.clear();
+	for (int_t k = 0; k < m_num_unknowns; k++) {
+		auto root = find(k);
+		if (root == k) {
+			m_components[k] = static_cast<int_t>(m_pins.size());
+			m_pins.push_back(k);
+		}
+		else {
+			m_components[k] = m_components[root];
+		}
+	}
+}
+
+void CWFRAssembly::fill_D(TripletListd& D_trps, int num_threads) const
+{
+	D_trps.resize(2 * num_equations());
+
+	parallel_for(0, num_pass_rows(), num_threads, 16, [&](int_t begin, int_t end) {
+		for (int_t r = begin; r < end; r++) fill_D_row(r, D_trps.data());
+	});
+}
+
+void CWFRAssembly::fill_D_row(int_t r, Tripletd* D_trps) const
+{
+	auto curr_row = m_row_offsets[r];
+	auto* trps = D_trps + 2 * curr_row;
+
+	if (r < m_rows) {
+		// an x row
+		auto i = r;
+		for (int_t j = 0; j <= m_cols - 2; j++) {
+			if (m_class_x(i, j) != NONE) {
+				*trps++ = Tripletd(curr_row, m_ids(i, j), -1);
+				*trps++ = Tripletd(curr_row, m_ids(i, j + 1), 1);
+				++curr_row;
+			}
+		}
+	}
+	else {
+		// a y row
+		auto i = r - m_rows;
+		if (i > m_rows - 2) return;
+		for (int_t j = 0; j <= m_cols - 1; j++) {
+			if (m_class_y(i, j) != NONE) {
+				*trps++ = Tripletd(curr_row, m_ids(i, j), -1);
+				*trps++ = Tripletd(curr_row, m_ids(i + 1, j), 1);
+				++curr_row;
+			}
+		}
+	}
+}
+
+void CWFRAssembly::fill_g(const MatrixViewd& Sx, const MatrixViewd& Sy, const MatrixViewd& X, const MatrixViewd& Y, CWFR::WFR_METHOD method, double* g, int num_threads, CWFR::Workspace* workspace, const GridSpacing* spacing) const
+{
+	fill_g_any(Sx, Sy, X, Y, method, g, num_threads, workspace, spacing);
+}
+
+void CWFRAssembly::fill_g(const MatrixViewf& Sx, const MatrixViewf& Sy, const MatrixViewd& X, const MatrixViewd& Y, CWFR::WFR_METHOD method, double* g, int num_threads, CWFR::Workspace* workspace, const GridSpacing* spacing) const
+{
+	fill_g_any(Sx, Sy, X, Y, method, g, num_threads, workspace, spacing);
+}
+
+CWFRAssembly::GridSpacing CWFRAssembly::detect_spacing(const MatrixViewd& X, const MatrixViewd& Y)
+{
+	GridSpacing spacing;
+	spacing.is_uniform = UniformSpacing::detect(X, spacing.x) && UniformSpacing::detect(Y, spacing.y);
+	return spacing;
+}
+
+template <class F>
+void CWFRAssembly::with_stencils(CWFR::WFR_METHOD method, F&& f)
+{
+	switch (CWFR::base_method(method))
+	{
+	case CWFR::WFR_METHOD::TFLI:
+		f(Stencils<false, false, false>());
+		break;
+	case CWFR::WFR_METHOD::TFLIQ:
+		f(Stencils<false, true, false>());
+		break;
+	case CWFR::WFR_METHOD::SLI:
+		f(Stencils<false, false, true>());
+		break;
+	case CWFR::WFR_METHOD::SLIQ:
+		f(Stencils<true, true, true>());
+		break;
+	case CWFR::WFR_METHOD::HFLIQ:
+		f(Stencils<true, true, false>());
+		break;
+	case CWFR::WFR_METHOD::HFLI:
+	default:
+		f(Stencils<true, false, false>());
+		break;
+	}
+}
+
+template <class SlopeView>
+void CWFRAssembly::fill_g_any(const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const MatrixViewd& Y, CWFR::WFR_METHOD method, double* g, int num_threads, CWFR::Workspace* workspace, const GridSpacing* spacing) const
+{
+	// the spacings of an affine grid are constants, so its kernel does not read X and Y
+	GridSpacing detected;
+	if (!spacing) {
+		detected = detect_spacing(X, Y);
+		spacing = &detected;
+	}
+	with_stencils(method, [&](auto stencils) {
+		using MethodStencils = decltype(stencils);
+		if (spacing->is_uniform) fill_g_kernel<MethodStencils>(Sx, Sy, X, Y, spacing->x, spacing->y, g, num_threads, workspace);
+		else fill_g_kernel<MethodStencils>(Sx, Sy, X, Y, CoordinateSpacing(X), CoordinateSpacing(Y), g, num_threads, workspace);
+	});
+}
+
+template <class Stencils, class Spacing, class SlopeView>
+void CWFRAssembly::fill_g_kernel(const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const MatrixViewd& Y, const Spacing& hx, const Spacing& hy, double* g, int num_threads, CWFR::Workspace* workspace) const
+{
+	// the spline fits of the columns, as a y row needs a whole column, stored as the rows of spline_y
+	MatrixXXd local_spline_y;
+	auto& spline_y = workspace ? workspace->spline_y : local_spline_y;
+	if constexpr (Stencils::is_spline) {
+		spline_y.resize(m_cols, m_rows);
+		parallel_for(0, m_cols, num_threads, 16, [&](int_t begin, int_t end) {
+			// a single thread works in the buffers of the workspace
+			ArrayXd local_work;
+			auto& work = workspace && end - begin == m_cols ? workspace->spline_work : local_work;
+			work.resize(5 * std::max(m_rows, m_cols));
+			for (int_t j = begin; j < end; j++) spline_line(j, false, Sy, Y, work, spline_y.row(j).data());
+		});
+	}
+
+	parallel_for(0, num_pass_rows(), num_threads, 16, [&](int_t begin, int_t end) {
+		// the row buffers of every thread, those of the workspace for a single thread
+		bool is_single = workspace && end - begin == num_pass_rows();
+		ArrayXXd local_buffers;
+		ArrayXd local_work;
+		auto& buffers = is_single ? workspace->row_buffers : local_buffers;
+		auto& work = is_single ? workspace->spline_work : local_work;
+		buffers.resize(m_cols, 5);
+		buffers.setZero();
+		if constexpr (Stencils::is_spline) work.resize(5 * std::max(m_rows, m_cols));
+		for (int_t r = begin; r < end; r++) fill_g_row<Stencils>(r, Sx, Sy, X, hx, hy, spline_y, buffers, work, g);
+	});
+}
+
+template <class Stencils, class Spacing, class SlopeView>
+void CWFRAssembly::fill_g_row(int_t r, const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const Spacing& hx, const Spacing& hy, const MatrixXXd& spline_y, ArrayXXd& buffers, ArrayXd& work, double* g) const
+{
+	auto curr_row = m_row_offsets[r];
+	if (m_row_offsets[r + 1] == curr_row) return;
+
+	// the 3rd- and 5th-order stencils, the cross terms of the quadrilateral
+	// methods, and the spline integrals of the spline methods
+	auto g3 = buffers.col(0);
+	auto g5 = buffers.col(1);
+	auto c3 = buffers.col(2);
+	auto c5 = buffers.col(3);
+	auto sp = buffers.col(4);
+
+	const uint8_t* classes = nullptr;
+	int_t n = 0;
+	if (r < m_rows) {
+		// an x row
+		auto i = r;
+		stencil_3rd_order_x(Sx, hx, i, g3);
+		if constexpr (Stencils::is_fifth_order) stencil_5th_order_x(Sx, hx, i, g5);
+		if constexpr (Stencils::is_quadrilateral) {
+			stencil_3rd_order_x(Sy, hy, i, c3);
+			if constexpr (Stencils::is_fifth_order) stencil_5th_order_x(Sy, hy, i, c5);
+		}
+		if constexpr (Stencils::is_spline) spline_line(i, true, Sx, X, work, sp.data());
+		classes = m_class_x.row(i).data();
+		n = m_cols - 1;
+	}
+	else {
+		// a y row
+		auto i = r - m_rows;
+		stencil_3rd_order_y(Sy, hy, i, g3);
+		if constexpr (Stencils::is_fifth_order) stencil_5th_order_y(Sy, hy, i, g5);
+		if constexpr (Stencils::is_quadrilateral) {
+			stencil_3rd_order_y(Sx, hx, i, c3);
+			if constexpr (Stencils::is_fifth_order) stencil_5th_order_y(Sx, hx, i, c5);
+		}
+		if constexpr (Stencils::is_spline) sp.head(m_cols) = spline_y.col(i).array();
+		classes = m_class_y.row(i).data();
+		n = m_cols;
+	}
+
+	// pick the valid segments by their classes, the spline integrals replace
+	// the stencils of the slopes along the segments where there are any,
+	// from the raw buffers so the loop does not depend on inlining Eigen
+	const double* p3 = g3.data();
+	const double* p5 = g5.data();
+	const double* q3 = c3.data();
+	const double* q5 = c5.data();
+	const double* ps = sp.data();
+	for (int_t j = 0; j < n; j++) {
+		if (classes[j] == NONE) continue;
+		double along, cross = 0;
+		if constexpr (Stencils::is_fifth_order) {
+			bool is_fifth = classes[j] == FIFTH;
+			along = is_fifth ? p5[j] : p3[j];
+			if constexpr (Stencils::is_quadrilateral) cross = is_fifth ? q5[j] : q3[j];
+		}
+		else {
+			along = p3[j];
+			if constexpr (Stencils::is_quadrilateral) cross = q3[j];
+		}
+		if constexpr (Stencils::is_spline) {
+			if (std::isfinite(ps[j])) along = ps[j];
+		}
+		g[curr_row++] = along + cross;
+	}
+}
+
+template <class SlopeView>
+void CWFRAssembly::spline_line(int_t i, bool is_row, const SlopeView& S, const MatrixViewd& P, ArrayXd& work, double* g) const
+{
+	auto n = is_row ? m_cols : m_rows;
+	auto id = [&](int_t k) { return is_row ? m_ids(i, k) : m_ids(k, i); };
+	std::fill(g, g + n, std::numeric_limits<double>::quiet_NaN());
+
+	// gather every run of valid pixels, and fit it
+	double* p = work.data();
+	double* s = p + n;
+	for (int_t begin = 0; begin < n; ) {
+		if (id(begin) < 0) {
+			begin++;
+			continue;
+		}
+		int_t end = begin;
+		while (end < n && id(end) >= 0) end++;
+		auto length = end - begin;
+		if (length >= 4) {
+			for (int_t k = 0; k < length; k++) {
+				p[k] = is_row ? P(i, begin + k) : P(begin + k, i);
+				s[k] = static_cast<double>(is_row ? S(i, begin + k) : S(begin + k, i));
+			}
+			spline_integrals(length, p, s, s + n, g + begin);
+		}
+		begin = end;
+	}
+}
+
+MatrixXXd CWFRAssembly::scatter(const Eigen::Ref<const VectorXd>& z) const
+{
+	MatrixXXd Z(m_rows, m_cols);
+	for (int_t id = 0; id < Z.size(); id++) {
+		auto k = m_ids.data()[id];
+		Z.data()[id] = k >= 0 ? z(k) : NAN;
+	}
+	return Z;
+}
+
+void CWFRAssembly::scatter(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<MatrixXXd> Z) const
+{
+	scatter_any(z, Z);
+}
+
+void CWFRAssembly::scatter(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<MatrixXXf> Z) const
+{
+	scatter_any(z, Z);
+}
+
+template <class Derived>
+void CWFRAssembly::scatter_any(const Eigen::Ref<const VectorXd>& z, Eigen::MatrixBase<Derived>& Z) const
+{
+	using Scalar = typename Derived::Scalar;
+	for (int_t i = 0; i < m_rows; i++) {
+		for (int_t j = 0; j < m_cols; j++) {
+			auto k = m_ids(i, j);
+			Z(i, j) = k >= 0 ? static_cast<Scalar>(z(k)) : std::numeric_limits<Scalar>::quiet_NaN();
+		}
+	}
+}
+
+VectorXd CWFRAssembly::gather(const MatrixXXd& Z) const
+{
+	VectorXd z(m_num_unknowns);
+	gather(Z, z);
+	return z;
+}
+
+void CWFRAssembly::gather(const MatrixXXd& Z, Eigen::Ref<VectorXd> z) const
+{
+	for (int_t id = 0; id < Z.size(); id++) {
+		auto k = m_ids.data()[id];
+		if (k >= 0) z(k) = std::isfinite(Z.data()[id]) ? Z.data()[id] : 0;
+	}
+}
+
+void CWFRAssembly::remove_pistons(Eigen::Ref<VectorXd> z) const
+{
+	VectorXd sums;
+	remove_pistons(z, sums);
+}
+
+void CWFRAssembly::remove_pistons(Eigen::Ref<VectorXd> z, VectorXd& sums) const
+{
+	// the sums of the heights, then the pixel counts, of every aperture
+	sums.resize(2 * num_components());
+	sums.setZero();
+	auto counts = sums.tail(num_components());
+	for (int_t k = 0; k < m_num_unknowns; k++) {
+		sums(m_components[k]) += z(k);
+		counts(m_components[k]) += 1;
+	}
+	for (int_t k = 0; k < m_num_unknowns; k++) {
+		z(k) -= sums(m_components[k]) / counts(m_components[k]);
+	}
+}
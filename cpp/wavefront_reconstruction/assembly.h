@@ -0,0 +1,257 @@
+#ifndef ASSEMBLY_H
+#define ASSEMBLY_H
+
+#include "common.h"
+#include "cwfr.h"
+#include "stencils.h"
+
+//! This is the assembly engine of the matrix D and the rhs vector g
+/*!
+* The mask scan is done once per validity mask and produces
+* 1) a dense index image holding the unknown of each pixel, -1 if invalid,
+*	numbered in the row-major scan order, or reordered for the solve,
+* 2) the stencil class of every segment, row by row, for the x and y passes.
+* The equations are then numbered in the row-major scan order of the x pass
+* followed by the y pass, and g is filled by evaluating the stencils of a
+* whole grid row at once and keeping the segments with a stencil class.
+* The equations of every grid row are counted by the mask scan, so their
+* prefix sum gives the first equation of each row, and the rows can be
+* filled by many threads straight into their slots with the same result
+* as the serial order.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRAssembly {
+public:
+	//! The stencil class of a segment
+	/*
+	* 1) A 3rd-order equation needs both ends of the segment, i.e. for Sx,
+	*			x, NaN, x
+	*	and for Sy,
+	*			 x
+	*			NaN
+	*			 x
+	* 2) A 5th-order equation needs the outer neighbours as well, i.e. for Sx,
+	*			   |
+	*			x, x, NaN, x, so the right boundary needs two pixels at least
+	*	and for Sy,
+	*			 x
+	*			 x <--
+	*			NaN
+	*			 x
+	*	so the bottom boundary needs two pixels at least,
+	* where "x" and "NaN" are the invalid positions. Both ends of a segment
+	* need to be valid ids as well.
+	*/
+	enum STENCIL_CLASS : uint8_t {
+		NONE = 0,
+		THIRD = 1,
+		FIFTH = 2,
+	};
+
+	//! The spacings of the coordinates, detected once per geometry by detect_spacing()
+	struct GridSpacing {
+		bool is_uniform; /*!< true if X and Y are both affine, with the spacings x and y*/
+		UniformSpacing x;
+		UniformSpacing y;
+	};
+
+private:
+	int_t m_rows;
+	int_t m_cols;
+	MatrixXXi m_ids; /*!< the unknown of each pixel, -1 if invalid*/
+	MatrixXXb m_class_x; /*!< the class of the (i, j)-(i, j+1) segment*/
+	MatrixXXb m_class_y; /*!< the class of the (i, j)-(i+1, j) segment*/
+	int_t m_num_unknowns;
+	int_t m_num_fifth_order;
+	CWFR::WFR_ORDERING m_ordering; /*!< the numbering of the unknowns in use*/
+	std_veci m_row_offsets; /*!< the first equation of the x rows, then of the y rows*/
+	std_veci m_components; /*!< the connected aperture of each unknown*/
+	std_veci m_pins; /*!< the first unknown of each connected aperture*/
+
+public:
+	//! Scan the validity masks
+	CWFRAssembly(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		CWFR::WFR_ORDERING ordering = CWFR::WFR_ORDERING::NATURAL /*!< [in] the numbering of the unknowns*/
+	);
+
+	//! Scan the validity masks of float slopes
+	CWFRAssembly(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy,/*!< [in] Slopes in y direction*/
+		CWFR::WFR_ORDERING ordering = CWFR::WFR_ORDERING::NATURAL /*!< [in] the numbering of the unknowns*/
+	);
+	virtual ~CWFRAssembly();
+
+	//! Fill the matrix D
+	void fill_D(
+		TripletListd& D_trps, /*!< [out] the filled matrix D*/
+		int num_threads = 1 /*!< [in] number of threads, 0 for all the hardware threads*/
+	) const;
+
+	//! Fill the rhs vector g
+	void fill_g(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		CWFR::WFR_METHOD method, /*!< [in] method to be used*/
+		double* g, /*!< [out] the filled vector g of num_equations()*/
+		int num_threads = 1, /*!< [in] number of threads, 0 for all the hardware threads*/
+		CWFR::Workspace* workspace = nullptr, /*!< [in,out] the row buffers of a single thread, nullptr for local ones*/
+		const GridSpacing* spacing = nullptr /*!< [in] the spacings of X and Y from detect_spacing(), nullptr to detect them*/
+	) const;
+
+	//! Fill the rhs vector g from float slopes, promoted to double row by row
+	void fill_g(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		CWFR::WFR_METHOD method, /*!< [in] method to be used*/
+		double* g, /*!< [out] the filled vector g of num_equations()*/
+		int num_threads = 1, /*!< [in] number of threads, 0 for all the hardware threads*/
+		CWFR::Workspace* workspace = nullptr, /*!< [in,out] the row buffers of a single thread, nullptr for local ones*/
+		const GridSpacing* spacing = nullptr /*!< [in] the spacings of X and Y from detect_spacing(), nullptr to detect them*/
+	) const;
+
+	//! Detect an affine grid of X and Y, which fill_g() integrates without reading them
+	static GridSpacing detect_spacing(
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y /*!< [in] y coordinates*/
+	);
+
+	//! Put the unknowns back to the grid, NaN for the invalid pixels
+	MatrixXXd scatter(const Eigen::Ref<const VectorXd>& z) const;
+
+	//! Put the unknowns back to a grid of the caller, NaN for the invalid pixels
+	void scatter(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<MatrixXXd> Z) const;
+
+	//! Put the unknowns back to a float grid of the caller, NaN for the invalid pixels
+	void scatter(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<MatrixXXf> Z) const;
+
+	//! Pick the unknowns from a grid of the same size, 0 for its non-finite pixels
+	VectorXd gather(const MatrixXXd& Z) const;
+
+	//! Pick the unknowns into z of num_unknowns(), 0 for the non-finite pixels
+	void gather(const MatrixXXd& Z, Eigen::Ref<VectorXd> z) const;
+
+	//! Shift every connected aperture to a zero mean
+	void remove_pistons(Eigen::Ref<VectorXd> z) const;
+
+	//! Shift every connected aperture to a zero mean, with the sums in the buffer sums
+	void remove_pistons(Eigen::Ref<VectorXd> z, VectorXd& sums) const;
+
+	int_t rows() const { return m_rows; }
+	int_t cols() const { return m_cols; }
+	int_t num_unknowns() const { return m_num_unknowns; }
+	int_t num_equations() const { return m_row_offsets.back(); }
+	int_t num_third_order() const { return num_equations() - m_num_fifth_order; }
+	int_t num_fifth_order() const { return m_num_fifth_order; }
+	CWFR::WFR_ORDERING ordering() const { return m_ordering; }
+	const MatrixXXi& ids() const { return m_ids; }
+	const MatrixXXb& class_x() const { return m_class_x; }
+	const MatrixXXb& class_y() const { return m_class_y; }
+	const std_veci& row_offsets() const { return m_row_offsets; }
+	const std_veci& components() const { return m_components; }
+	const std_veci& pins() const { return m_pins; }
+	int_t num_components() const { return static_cast<int_t>(m_pins.size()); }
+
+	//! Check if every pixel is valid and every segment is linked
+	bool is_full_rectangle() const
+	{
+		return m_num_unknowns == m_rows * m_cols && num_equations() == m_rows * (m_cols - 1) + (m_rows - 1) * m_cols;
+	}
+
+private:
+	//! The stencils of a method, fixed at compile time so every method fills g with a kernel of its own
+	template <bool IsFifthOrder, bool IsQuadrilateral, bool IsSpline>
+	struct Stencils {
+		static constexpr bool is_fifth_order = IsFifthOrder; /*!< the 5th-order stencil where the class allows it, otherwise the 3rd-order one*/
+		static constexpr bool is_quadrilateral = IsQuadrilateral; /*!< add the cross terms of the other slopes*/
+		static constexpr bool is_spline = IsSpline; /*!< the spline integrals of the slopes along the runs of valid pixels, if any*/
+	};
+
+	//! Call f(Stencils<...>()) with the stencils of the method
+	template <class F>
+	static void with_stencils(CWFR::WFR_METHOD method, F&& f);
+
+	//! The number of grid rows of both passes, the x rows first
+	int_t num_pass_rows() const { return 2 * m_rows; }
+
+	//! Scan the validity masks of slopes of any scalar type
+	template <class SlopeView>
+	void scan(const SlopeView& Sx, const SlopeView& Sy);
+
+	//! Fill g with slopes of any scalar type
+	template <class SlopeView>
+	void fill_g_any(
+		const SlopeView& Sx,
+		const SlopeView& Sy,
+		const MatrixViewd& X,
+		const MatrixViewd& Y,
+		CWFR::WFR_METHOD method,
+		double* g,
+		int num_threads,
+		CWFR::Workspace* workspace,
+		const GridSpacing* spacing
+	) const;
+
+	//! Fill g with the kernel of the stencils and of the spacings of X and Y
+	template <class Stencils, class Spacing, class SlopeView>
+	void fill_g_kernel(
+		const SlopeView& Sx,
+		const SlopeView& Sy,
+		const MatrixViewd& X,
+		const MatrixViewd& Y,
+		const Spacing& hx,
+		const Spacing& hy,
+		double* g,
+		int num_threads,
+		CWFR::Workspace* workspace
+	) const;
+
+	//! Put the unknowns back to a grid of any scalar type
+	template <class Derived>
+	void scatter_any(const Eigen::Ref<const VectorXd>& z, Eigen::MatrixBase<Derived>& Z) const;
+
+	//! Label the connected apertures by the segments linking the unknowns
+	void label_components();
+
+	//! Fill the triplets of the pass row r
+	void fill_D_row(int_t r, Tripletd* D_trps) const;
+
+	//! Fill g of the pass row r with the row buffers g3, g5, c3, c5 and the spline
+	template <class Stencils, class Spacing, class SlopeView>
+	void fill_g_row(
+		int_t r,
+		const SlopeView& Sx,
+		const SlopeView& Sy,
+		const MatrixViewd& X,
+		const Spacing& hx,
+		const Spacing& hy,
+		const MatrixXXd& spline_y,
+		ArrayXXd& buffers,
+		ArrayXd& work,
+		double* g
+	) const;
+
+	//! The spline integrals along the runs of valid pixels of a grid line, NaN elsewhere
+	/*!
+	* The line is the row i if is_row, otherwise the column i, and the
+	* integral of the segment k of the line is g(k). The work buffer holds
+	* 5 values per pixel of the line.
+	*/
+	template <class SlopeView>
+	void spline_line(
+		int_t i,
+		bool is_row,
+		const SlopeView& S,
+		const MatrixViewd& P,
+		ArrayXd& work,
+		double* g
+	) const;
+};
+
+
+#endif // !ASSEMBLY_H
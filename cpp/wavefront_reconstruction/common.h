@@ -1,25 +1,52 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#ifdef _WIN32
 #ifdef WAVEFRONTRECONSTRUCTION_EXPORTS
 #define WAVEFRONTRECONSTRUCTION_API __declspec(dllexport)
 #else
 #define WAVEFRONTRECONSTRUCTION_API __declspec(dllimport)
 #endif
+#else
+#define WAVEFRONTRECONSTRUCTION_API __attribute__((visibility("default")))
+#endif
+
+// Aliases of any scalar type
+template <class T> using Triplet = Eigen::Triplet<T>;
+template <class T> using TripletList = std::vector<Triplet<T>>;
+template <class T> using SparseMatrixXX = Eigen::SparseMatrix<T, Eigen::RowMajor>;
+template <class T> using SparseColMatrixXX = Eigen::SparseMatrix<T, Eigen::ColMajor>;
+template <class T> using MatrixXX = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+template <class T> using MatrixView = Eigen::Ref<const MatrixXX<T>>;
 
 // Aliases
 using int_t = Eigen::Index;
-using Tripletd = Eigen::Triplet<double>;
-using TripletListd = std::vector<Tripletd>;
-using SparseMatrixXXd = Eigen::SparseMatrix<double, Eigen::RowMajor>;
-using MatrixXXd = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using Tripletd = Triplet<double>;
+using TripletListd = TripletList<double>;
+using SparseMatrixXXd = SparseMatrixXX<double>;
+using SparseColMatrixXXd = SparseColMatrixXX<double>;
+using SparseColMatrixXXf = SparseColMatrixXX<float>;
+using MatrixXXd = MatrixXX<double>;
+using MatrixXXf = MatrixXX<float>;
+using MatrixViewd = MatrixView<double>;
+using MatrixViewf = MatrixView<float>;
+using MatrixXXi = Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using MatrixXXb = Eigen::Matrix<uint8_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using ArrayXXb = Eigen::Array<uint8_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using MatrixXd = Eigen::MatrixXd;
+using MatrixXf = Eigen::MatrixXf;
 using VectorXd = Eigen::VectorXd;
 using VectorXi = Eigen::VectorXi;
+using ArrayXd = Eigen::ArrayXd;
+using ArrayXXd = Eigen::ArrayXXd;
 using VectorMapd = Eigen::Map<VectorXd, Eigen::Unaligned>;
 using std_vecd = std::vector<double>;
-using map_ii = std::map<int_t, int_t>;
+using std_veci = std::vector<int_t>;
 using Solver = Eigen::LeastSquaresConjugateGradient<SparseMatrixXXd>;
-using QRSolver = Eigen::SparseQR<SparseMatrixXXd, Eigen::COLAMDOrdering<int>>;
+using QRSolver = Eigen::SparseQR<SparseColMatrixXXd, Eigen::COLAMDOrdering<int>>;
+using LDLTSolver = Eigen::SimplicialLDLT<SparseColMatrixXXd>;
+using LDLTSolverf = Eigen::SimplicialLDLT<SparseColMatrixXXf>;
+using LDLTSolverNatural = Eigen::SimplicialLDLT<SparseColMatrixXXd, Eigen::Lower, Eigen::NaturalOrdering<int>>;
 
 inline int_t ID_1D(int_t x, int_t y, int_t width) { return (y * width + x); }
 
@@ -1,317 +1,505 @@
 #include "pch.h"
 #include "framework.h"
 #include "cwfr.h"
+#include "assembly.h"
+#include "wfr_plan.h"
+#include "solvers.h"
+#include "parallel.h"
+#include "wfr_stopwatch.h"
+#include "wfr_resample.h"
+#include "wfr_pyramid.h"
+
+#include <unordered_map>
+
+namespace {
+	//! The result in the scalar type of the slopes, moved if it is double
+	template <class Scalar>
+	MatrixXX<Scalar> to_scalar(MatrixXXd&& Z)
+	{
+		if constexpr (std::is_same<Scalar, double>::value) return std::move(Z);
+		else return Z.cast<Scalar>();
+	}
+}
+
+
+CWFRGeometry::CWFRGeometry(MatrixXXd X, MatrixXXd Y)
+	: m_X(std::move(X))
+	, m_Y(std::move(Y))
+	, m_key(0)
+{
+}
+
+CWFRGeometry::~CWFRGeometry()
+{
+}
+
+size_t CWFRGeometry::key() const
+{
+	std::call_once(m_key_flag, [this]() { m_key = CWFRPlan::hash_geometry(m_X, m_Y); });
+	return m_key;
+}
+
 
+template <class Scalar>
+CWFRT<Scalar>::CWFRT(MatrixXX<Scalar> Sx, MatrixXX<Scalar> Sy, MatrixXXd X, MatrixXXd Y)
+	: m_Sx_copy(std::move(Sx))
+	, m_Sy_copy(std::move(Sy))
+	, m_geometry(std::make_shared<const CWFRGeometry>(std::move(X), std::move(Y)))
+	, m_Sx(m_Sx_copy)
+	, m_Sy(m_Sy_copy)
+	, m_X(m_geometry->X())
+	, m_Y(m_geometry->Y())
+	, m_rows(m_Sx_copy.rows())
+	, m_cols(m_Sx_copy.cols())
+	, m_num_threads(1)
+	, m_is_stats_enabled(false)
+	, m_is_split_enabled(true)
+	, m_pyramid_levels(0)
+{
+}
 
-CWFR::CWFR(const MatrixXXd& Sx, const MatrixXXd& Sy, const MatrixXXd& X, const MatrixXXd& Y)
-	: m_Sx(Sx)
+template <class Scalar>
+CWFRT<Scalar>::CWFRT(const MatrixView<Scalar>& Sx, const MatrixView<Scalar>& Sy, std::shared_ptr<const CWFRGeometry> geometry)
+	: m_geometry(std::move(geometry))
+	, m_Sx(Sx)
 	, m_Sy(Sy)
-	, m_X(X)
-	, m_Y(Y)
+	, m_X(m_geometry->X())
+	, m_Y(m_geometry->Y())
 	, m_rows(Sx.rows())
 	, m_cols(Sx.cols())
+	, m_num_threads(1)
+	, m_is_stats_enabled(false)
+	, m_is_split_enabled(true)
+	, m_pyramid_levels(0)
 {
 }
 
-CWFR::~CWFR()
+template <class Scalar>
+CWFRT<Scalar>::~CWFRT()
 {
 }
 
-MatrixXXd CWFR::operator()(WFR_METHOD method)
+template <class Scalar>
+MatrixXX<Scalar> CWFRT<Scalar>::operator()(WFR_METHOD method, const SolverOptions& options)
 {
-	switch (method)
-	{
-	case WFR_METHOD::HFLI:
-		return hfli_calculator(std::bind(&CWFR::hfli_fill_D_g, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	case WFR_METHOD::HFLIQ:
-	default:
-		return hfli_calculator(std::bind(&CWFR::hfliq_fill_D_g, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+	CWFRStopwatch stopwatch(m_is_stats_enabled);
+	if (m_is_stats_enabled) m_stats = ReconstructionStats();
+
+	// the coarse levels deliver their previews, and seed this frame instead of the initial guess
+	MatrixXXd Z0_user;
+	bool is_seeded = false;
+	if (m_pyramid_levels > 0) {
+		MatrixXXd Z0 = pyramid_calculator(method, options);
+		stopwatch.lap(m_stats.pyramid_seconds);
+		if (Z0.size() > 0) {
+			Z0_user.swap(m_Z0);
+			m_Z0.swap(Z0);
+			is_seeded = true;
+		}
+	}
+
+	MatrixXXd Z;
+	if (is_resampled(method)) {
+		Z = resample_calculator(method, options);
+	}
+	else if (m_plan_cache) {
+		Z = plan_calculator(method, options, stopwatch);
+	}
+	else {
+		// scan the validity masks for the valid ids, the stencil classes and the apertures
+		CWFRAssembly assembly(m_Sx, m_Sy, options.ordering);
+		stopwatch.lap(m_stats.scan_seconds);
+
+		if (m_is_split_enabled && assembly.num_components() > 1) {
+			Z = component_calculator(method, assembly, options, stopwatch);
+		}
+		else {
+			// all the methods share D and only differ in the stencils of g
+			Z = hfli_calculator([&](TripletListd* D_trps, std_vecd& g_std, const CWFRAssembly& assembly) { fill_D_g(method, D_trps, g_std, assembly); }, assembly, options, stopwatch);
+		}
 	}
+	if (is_seeded) m_Z0.swap(Z0_user);
+
+	finish_stats(stopwatch);
+	return to_scalar<Scalar>(std::move(Z));
 }
 
-MatrixXXd CWFR::hfli_calculator(std::function<void(TripletListd&, std_vecd&, const map_ii&)> hfli_prep)
+template <class Scalar>
+bool CWFRT<Scalar>::reconstruct_into(Eigen::Ref<MatrixXX<Scalar>> Z, WFR_METHOD method, const SolverOptions& options)
 {
-	auto z_size = m_rows * m_cols; // size of the z vector
+	eigen_assert(Z.rows() == m_rows && Z.cols() == m_cols);
+	if (is_resampled(method) || !m_plan_cache) {
+		Z = (*this)(method, options);
+		return m_report.success();
+	}
 
-	/* 0. build the least-squares system */
-	/* 0.0 Pre-allocate and reserve the memory space */
-	// construct the matrix D and reserve the maximum size
-	TripletListd D_trps;
-	D_trps.reserve(z_size);
+	CWFRStopwatch stopwatch(m_is_stats_enabled);
+	if (m_is_stats_enabled) m_stats = ReconstructionStats();
+	if (!m_workspace) m_workspace = std::make_shared<Workspace>();
 
-	// construct the std vector g_std for appending the slopes and reserve the maximum size
-	std_vecd g_std;
-	g_std.reserve(z_size);
+	auto plan = plan_solve(method, options, stopwatch, *m_workspace);
+	if (plan) {
+		plan->scatter(m_workspace->z, Z);
+		stopwatch.lap(m_stats.scatter_seconds);
+	}
+	else {
+		Z.setZero();
+	}
+
+	finish_stats(stopwatch);
+	return plan != nullptr;
+}
 
-	// get the valid ids
-	auto valid_ids_map = get_valid_ids();
+template <class Scalar>
+MatrixXXd CWFRT<Scalar>::pyramid_calculator(WFR_METHOD method, const SolverOptions& options)
+{
+	CWFRPyramid pyramid(m_Sx, m_Sy, m_X, m_Y, m_pyramid_levels);
+	MatrixXXd Z;
+	for (auto level = pyramid.num_levels(); level >= 1; level--) {
+		CWFR wfr(pyramid.Sx(level), pyramid.Sy(level), pyramid.X(level), pyramid.Y(level));
+		wfr.set_num_threads(m_num_threads);
+		wfr.set_split_enabled(m_is_split_enabled);
+		if (Z.size() > 0) wfr.set_initial_guess(CWFRPyramid::prolongate(Z, pyramid.Sx(level).rows(), pyramid.Sx(level).cols()));
+
+		// a failed level seeds nothing, and previews nothing
+		MatrixXXd Z_level = wfr(method, options);
+		if (!wfr.report().success()) {
+			Z.resize(0, 0);
+			continue;
+		}
+		Z.swap(Z_level);
+		if (m_preview_hook) m_preview_hook(level, Z);
+	}
+	if (Z.size() == 0) return Z;
+	return CWFRPyramid::prolongate(Z, m_rows, m_cols);
+}
 
+template <class Scalar>
+void CWFRT<Scalar>::finish_stats(const CWFRStopwatch& stopwatch)
+{
+	if (!m_is_stats_enabled) return;
+	m_stats.total_seconds = stopwatch.total();
+	m_stats.report = m_report;
+	if (m_stats_hook) m_stats_hook(m_stats);
+}
 
-	/* 0.1 fill D and g_std */
-	hfli_prep(D_trps, g_std, valid_ids_map);
+template <class Scalar>
+template <class Prep>
+MatrixXXd CWFRT<Scalar>::hfli_calculator(Prep&& hfli_prep, const CWFRAssembly& assembly, const SolverOptions& options, CWFRStopwatch& stopwatch)
+{
+	/* 0. build the least-squares system */
+	/* 0.0 fill D and g_std, D only if the backend is not matrix-free */
+	auto solver = CWFRSolver::create(options, assembly);
+	TripletListd D_trps;
+	std_vecd g_std;
+	hfli_prep(solver->needs_D() ? &D_trps : nullptr, g_std, assembly);
+	stopwatch.lap(m_stats.assembly_seconds);
 
 	/* 1. solve the least - squares system */
 	// build the sparse matrix D
-	SparseMatrixXXd D(D_trps.size() / 2, valid_ids_map.size());
-	D.setFromTriplets(D_trps.begin(), D_trps.end());
-	D.makeCompressed();
+	SparseMatrixXXd D;
+	if (solver->needs_D()) {
+		D.resize(assembly.num_equations(), assembly.num_unknowns());
+		D.setFromTriplets(D_trps.begin(), D_trps.end());
+		D.makeCompressed();
+	}
+	stopwatch.lap(m_stats.build_seconds);
+	if (m_is_stats_enabled) count_stats(assembly, D.nonZeros());
 
 	// map the vecotr g
 	VectorMapd g(g_std.data(), g_std.size());
 
-	// solve with QR factorization
-	Solver qr_solver(D);
-	VectorXd z = qr_solver.solve(g);
-	if (qr_solver.info() != Eigen::Success) {
+	// solve with the chosen backend, from the initial guess if there is one
+	solver->compute(assembly, D, m_num_threads);
+	stopwatch.lap(m_stats.setup_seconds);
+	MatrixXd z;
+	MatrixXd z0 = has_initial_guess() ? MatrixXd(assembly.gather(m_Z0)) : MatrixXd();
+	bool is_solved = solver->solve(g, z, m_report, has_initial_guess() ? &z0 : nullptr);
+	stopwatch.lap(m_stats.solve_seconds);
+	if (!is_solved) {
 		return MatrixXXd::Zero(m_rows, m_cols);
 	}
+	assembly.remove_pistons(z.col(0));
 
 	/* 2. Only keep the valid points */
-	MatrixXXd Z(m_rows, m_cols);
-	Z.fill(NAN);
-	for (int_t i = 0; i < m_rows; i++) {
-		for (int_t j = 0; j < m_cols; j++) {
-			if (is_valid_id(i, j))
-				Z(i, j) = z(valid_ids_map.at(ID_1D(j, i, m_cols)));
-		}
-	}
-
-	/* 3. Reshape and return the result */
+	MatrixXXd Z = assembly.scatter(z.col(0));
+	stopwatch.lap(m_stats.scatter_seconds);
 	return Z;
 }
 
-void CWFR::hfli_fill_D_g(TripletListd& D_trps, std_vecd& g_std, const map_ii& valid_ids_map)
+template <class Scalar>
+MatrixXXd CWFRT<Scalar>::component_calculator(WFR_METHOD method, const CWFRAssembly& assembly, const SolverOptions& options, CWFRStopwatch& stopwatch)
 {
-	bool is_5th = false; // determine if 5th order
-	bool is_3rd = false; // determine if 3rd order
-	int_t curr_row = 0;
-
-	// start the x iterations 
-	for (int_t i = 0; i <= m_rows - 1; i++) {
-		for (int_t j = 0; j <= m_cols - 2; j++) {
-
-			// validate if 5th,3rd or no equations
-			is_5th = is_5th_order_equation_sx(i, j);
-			is_3rd = is_3rd_order_equation_sx(i, j);
-
-			// deal with Sx
-			if (is_5th || is_3rd) {
-				// push to D_trps
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j, i, m_cols)), -1));
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j + 1, i, m_cols)), 1));
-				++curr_row;
-
-				// push to g_std
-				if (is_5th) g_std.push_back(calculate_5th_order_gx(i, j));
-				else g_std.push_back(calculate_3rd_order_gx(i, j));
-			}
+	const auto& ids = assembly.ids();
+	const auto& components = assembly.components();
+	auto n = assembly.num_components();
+
+	// the bounding box and the size of every aperture
+	std::vector<int_t> top(n, m_rows), left(n, m_cols), bottom(n, -1), right(n, -1), sizes(n, 0);
+	for (int_t i = 0; i < m_rows; i++) {
+		for (int_t j = 0; j < m_cols; j++) {
+			if (ids(i, j) < 0) continue;
+			auto k = components[ids(i, j)];
+			top[k] = std::min(top[k], i);
+			left[k] = std::min(left[k], j);
+			bottom[k] = std::max(bottom[k], i);
+			right[k] = std::max(right[k], j);
+			sizes[k]++;
 		}
 	}
 
-	// start the y iterations 
-	for (int_t i = 0; i <= m_rows - 2; i++) {
-		for (int_t j = 0; j <= m_cols - 1; j++) {
-
-			// validate if 5th,3rd or no equations
-			is_5th = is_5th_order_equation_sy(i, j);
-			is_3rd = is_3rd_order_equation_sy(i, j);
+	// the apertures in parallel, sharing the threads among them
+	MatrixXXd Z = MatrixXXd::Constant(m_rows, m_cols, std::numeric_limits<double>::quiet_NaN());
+	std::vector<SolverReport> reports(n);
+	std::vector<int_t> nnzs(n, 0);
+	auto num_threads = std::max(1, resolve_num_threads(m_num_threads) / static_cast<int>(n));
+	parallel_for(0, n, m_num_threads, 1, [&](int_t begin, int_t end) {
+		for (int_t k = begin; k < end; k++) {
+			if (sizes[k] == 1) {
+				// a single pixel has no equation, and a zero mean
+				Z(top[k], left[k]) = 0;
+				continue;
+			}
 
-			// deal with Sy
-			if (is_5th || is_3rd) {
-				// push to D_trps
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j, i, m_cols)), -1));
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j, i + 1, m_cols)), 1));
-				++curr_row;
+			// the margin of one pixel keeps the classes of the border
+			// segments, and the other apertures are masked out
+			auto i0 = std::max<int_t>(top[k] - 1, 0), j0 = std::max<int_t>(left[k] - 1, 0);
+			auto h = std::min<int_t>(bottom[k] + 1, m_rows - 1) - i0 + 1;
+			auto w = std::min<int_t>(right[k] + 1, m_cols - 1) - j0 + 1;
+			MatrixXX<Scalar> Sx = m_Sx.block(i0, j0, h, w);
+			MatrixXX<Scalar> Sy = m_Sy.block(i0, j0, h, w);
+			for (int_t i = 0; i < h; i++) {
+				for (int_t j = 0; j < w; j++) {
+					auto id = ids(i0 + i, j0 + j);
+					if (id >= 0 && components[id] != k) Sx(i, j) = Sy(i, j) = std::numeric_limits<Scalar>::quiet_NaN();
+				}
+			}
 
-				// push_to g_std
-				if (is_5th) g_std.push_back(calculate_5th_order_gy(i, j));
-				else g_std.push_back(calculate_3rd_order_gy(i, j));
+			CWFRT wfr(std::move(Sx), std::move(Sy), m_X.block(i0, j0, h, w), m_Y.block(i0, j0, h, w));
+			wfr.set_num_threads(num_threads);
+			wfr.set_stats_enabled(m_is_stats_enabled);
+			if (has_initial_guess()) wfr.set_initial_guess(m_Z0.block(i0, j0, h, w));
+			MatrixXX<Scalar> Zk = wfr(method, options);
+			reports[k] = wfr.report();
+			nnzs[k] = wfr.stats().nnz;
+
+			for (int_t i = 0; i < h; i++) {
+				for (int_t j = 0; j < w; j++) {
+					auto id = ids(i0 + i, j0 + j);
+					if (id >= 0 && components[id] == k) Z(i0 + i, j0 + j) = static_cast<double>(Zk(i, j));
+				}
 			}
 		}
+	});
+	stopwatch.lap(m_stats.solve_seconds);
+
+	// the worst of the reports, and the first failure if any
+	m_report = SolverReport();
+	for (int_t k = 0; k < n; k++) {
+		if (sizes[k] > 1) m_report.merge(reports[k]);
+	}
+	if (m_is_stats_enabled) {
+		int_t nnz = 0;
+		for (auto k : nnzs) nnz += k;
+		count_stats(assembly, nnz);
+	}
+	if (!m_report.success()) {
+		return MatrixXXd::Zero(m_rows, m_cols);
 	}
+	return Z;
 }
 
-void CWFR::hfliq_fill_D_g(TripletListd& D_trps, std_vecd& g_std, const map_ii& valid_ids_map)
+template <class Scalar>
+MatrixXXd CWFRT<Scalar>::plan_calculator(WFR_METHOD method, const SolverOptions& options, CWFRStopwatch& stopwatch)
 {
-	bool is_5th = false; // determine if 5th order
-	bool is_3rd = false; // determine if 3rd order
-	int_t curr_row = 0;
-
-	// start the x iterations 
-	for (int_t i = 0; i <= m_rows - 1; i++) {
-		for (int_t j = 0; j <= m_cols - 2; j++) {
-			// validate if 5th,3rd or no equations
-			is_5th = is_5th_order_equation_sx(i, j);
-			is_3rd = is_3rd_order_equation_sx(i, j);
-
-			// deal with Sx
-			if (is_5th || is_3rd) {
-				// push to D_trps
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j, i, m_cols)), -1));
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j + 1, i, m_cols)), 1));
-				++curr_row;
-
-				// push to g_std
-				if (is_5th)
-					g_std.push_back(
-						calculate_5th_order_gx(i, j, false) + calculate_5th_order_gx(i, j, true)
-					);
-				else
-					g_std.push_back(
-						calculate_3rd_order_gx(i, j, false) + calculate_3rd_order_gx(i, j, true)
-					);
-			}
-		}
-	}
-
-	// start the y iterations 
-	for (int_t i = 0; i <= m_rows - 2; i++) {
-		for (int_t j = 0; j <= m_cols - 1; j++) {
-
-			// validate if 5th,3rd or no equations
-			is_5th = is_5th_order_equation_sy(i, j);
-			is_3rd = is_3rd_order_equation_sy(i, j);
-
-			// deal with Sy
-			if (is_5th || is_3rd) {
-				// push to D_trps
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j, i, m_cols)), -1));
-				D_trps.push_back(Tripletd(curr_row, valid_ids_map.at(ID_1D(j, i + 1, m_cols)), 1));
-				++curr_row;
-
-				// push_to g_std
-				if (is_5th)
-					g_std.push_back(
-						calculate_5th_order_gy(i, j, false) + calculate_5th_order_gy(i, j, true)
-					);
-				else
-					g_std.push_back(
-						calculate_3rd_order_gy(i, j, false) + calculate_3rd_order_gy(i, j, true)
-					);
-			}
-		}
+	Workspace local_workspace;
+	auto& workspace = m_workspace ? *m_workspace : local_workspace;
+	auto plan = plan_solve(method, options, stopwatch, workspace);
+	if (!plan) {
+		return MatrixXXd::Zero(m_rows, m_cols);
 	}
 
+	MatrixXXd Z = plan->scatter(workspace.z);
+	stopwatch.lap(m_stats.scatter_seconds);
+	return Z;
 }
 
-map_ii CWFR::get_valid_ids()
+template <class Scalar>
+std::shared_ptr<const CWFRPlan> CWFRT<Scalar>::plan_solve(WFR_METHOD method, const SolverOptions& options, CWFRStopwatch& stopwatch, Workspace& workspace)
 {
-	map_ii valid_id_map;
-
-	int_t current_id = 0;
-	for (auto i = 0; i < m_rows; i++) {
-		for (auto j = 0; j < m_cols; j++) {
-			if (is_valid_id(i, j)) {
-				valid_id_map[ID_1D(j, i, m_cols)] = current_id++;
-			}
+	// find or build the plan
+	auto key = CWFRPlan::hash(m_Sx, m_Sy, m_geometry->key(), method, options);
+	auto plan = m_plan_cache->find(key, m_Sx, m_Sy);
+	bool is_reused = plan != nullptr;
+	if (!plan) {
+		plan = make_plan(method, options, key);
+		m_plan_cache->insert(plan);
+	}
+	stopwatch.lap(m_stats.scan_seconds);
+
+	// the phases of a new plan are timed by the plan
+	if (m_is_stats_enabled) {
+		m_stats.is_plan_reused = is_reused;
+		if (!is_reused) {
+			m_stats.assembly_seconds = plan->fill_seconds();
+			m_stats.build_seconds = plan->build_seconds();
+			m_stats.setup_seconds = plan->setup_seconds();
+			m_stats.scan_seconds -= plan->fill_seconds() + plan->build_seconds() + plan->setup_seconds();
 		}
+		count_stats(plan->assembly(), plan->D().nonZeros());
 	}
 
-	return valid_id_map;
-}
-
-bool CWFR::is_3rd_order_equation_sx(const int_t& i, const int_t& j)
-{
-	bool is_valid = true;
+	// only g changes between the frames sharing the plan
+	workspace.g.resize(plan->num_equations());
+	plan->assemble_g(m_Sx, m_Sy, m_X, m_Y, workspace.g, m_num_threads, &workspace);
+	stopwatch.lap(m_stats.assembly_seconds);
 
-	// slope x case
-	if (
-		!std::isfinite(m_Sx(i, j)) ||
-		!std::isfinite(m_Sx(i, j + 1))
-		)
-	{
-		is_valid = false;
+	if (has_initial_guess()) {
+		workspace.z0.resize(plan->num_unknowns());
+		plan->gather(m_Z0, workspace.z0);
 	}
-
-	return is_valid;
+	bool is_solved = plan->solve(workspace, m_report, has_initial_guess());
+	stopwatch.lap(m_stats.solve_seconds);
+	return is_solved ? plan : nullptr;
 }
 
-bool CWFR::is_3rd_order_equation_sy(const int_t& i, const int_t& j)
+template <class Scalar>
+MatrixXXd CWFRT<Scalar>::resample_calculator(WFR_METHOD method, const SolverOptions& options)
 {
-	bool is_valid = true;
-
-	// slope y case
-	if (
-		!std::isfinite(m_Sy(i, j)) ||
-		!std::isfinite(m_Sy(i + 1, j))
-		)
-	{
-		is_valid = false;
+	MatrixXXd Sx = m_Sx.template cast<double>();
+	MatrixXXd Sy = m_Sy.template cast<double>();
+	MatrixXXb valid = (Sx.array().isFinite() && Sy.array().isFinite() && m_X.array().isFinite() && m_Y.array().isFinite()).template cast<uint8_t>();
+
+	// integrate on the rectangular mesh, timed by the inner reconstruction
+	CWFRResampler resampler(m_X, m_Y, valid, m_num_threads);
+	CWFR wfr(resampler.to_mesh(Sx), resampler.to_mesh(Sy), resampler.mesh_X(), resampler.mesh_Y());
+	wfr.set_num_threads(m_num_threads);
+	wfr.set_plan_cache(m_plan_cache);
+	wfr.set_stats_enabled(m_is_stats_enabled);
+	wfr.set_split_enabled(m_is_split_enabled);
+	MatrixXXd Zr = wfr(base_method(method), options);
+	m_report = wfr.report();
+	if (m_is_stats_enabled) m_stats = wfr.stats();
+	if (!m_report.success()) {
+		return MatrixXXd::Zero(m_rows, m_cols);
 	}
 
-	return is_valid;
+	// interpolate back, and shift to a zero mean per connected aperture of the grid
+	MatrixXXd Z = resampler.from_mesh(Zr, m_X, m_Y, valid);
+	CWFRAssembly assembly(m_Sx, m_Sy);
+	VectorXd z = assembly.gather(Z);
+	assembly.remove_pistons(z);
+	MatrixXXd Z_grid = assembly.scatter(z);
+	Z_grid = Z.array().isFinite().select(Z_grid, std::numeric_limits<double>::quiet_NaN());
+	return Z_grid;
 }
 
-bool CWFR::is_5th_order_equation_sx(const int_t& i, const int_t& j)
+template <class Scalar>
+void CWFRT<Scalar>::count_stats(const CWFRAssembly& assembly, int_t nnz)
 {
-	bool is_valid = true;
-
-	// it should be 3rd-order valid
-	is_valid = is_3rd_order_equation_sx(i, j);
-
-	// slope x case
-	if (is_valid) {
-		// it should be valid at the right boundary
-		is_valid = (j + 2 <= m_cols - 1) && (j - 1 >= 0) ? true : false;
-
-		// it should avoid the NaN at the j + 2 position
-		if (is_valid) {
-			is_valid = std::isfinite(m_Sx(i, j + 2)) && std::isfinite(m_Sx(i, j - 1)) ? true : false;
-		}
-	}
-
-	return is_valid;
+	m_stats.valid_pixels = assembly.num_unknowns();
+	m_stats.equations = assembly.num_equations();
+	m_stats.third_order = assembly.num_third_order();
+	m_stats.fifth_order = assembly.num_fifth_order();
+	m_stats.nnz = nnz;
 }
 
-bool CWFR::is_5th_order_equation_sy(const int_t& i, const int_t& j)
+template <class Scalar>
+std::vector<MatrixXX<Scalar>> CWFRT<Scalar>::batch(const std::vector<MatrixXX<Scalar>>& Sx, const std::vector<MatrixXX<Scalar>>& Sy, const MatrixXXd& X, const MatrixXXd& Y, WFR_METHOD method, std::shared_ptr<CWFRPlanCache> plan_cache, int num_threads, const SolverOptions& options, std::vector<SolverReport>* reports)
 {
-	bool is_valid = true;
-
-	// it should be 3rd-order valid
-	is_valid = is_3rd_order_equation_sy(i, j);
+	auto n_frames = std::min(Sx.size(), Sy.size());
+	std::vector<MatrixXX<Scalar>> Zs(n_frames);
+	if (reports) reports->assign(n_frames, SolverReport());
+	if (!plan_cache) plan_cache = std::make_shared<CWFRPlanCache>(n_frames);
+
+	// the mesh of a resampled method depends on the frame, so the frames are
+	// reconstructed one by one, still sharing the plans of their meshes
+	if (is_resampled(method)) {
+		auto geometry = std::make_shared<const CWFRGeometry>(X, Y);
+		for (size_t k = 0; k < n_frames; k++) {
+			CWFRT wfr(MatrixView<Scalar>(Sx[k]), MatrixView<Scalar>(Sy[k]), geometry);
+			wfr.set_num_threads(num_threads);
+			wfr.set_plan_cache(plan_cache);
+			Zs[k] = wfr(method, options);
+			if (reports) (*reports)[k] = wfr.report();
+		}
+		return Zs;
+	}
 
-	// slope y case
-	if (is_valid) {
-		// it should be valid at the bottom boundary
-		is_valid = (i + 2 <= m_rows - 1) && (i - 1 >= 0) ? true : false;
+	// group the frames by their plans, in the order of appearance
+	auto geometry_key = CWFRPlan::hash_geometry(X, Y);
+	std::vector<size_t> keys;
+	std::unordered_map<size_t, std::vector<size_t>> groups;
+	for (size_t k = 0; k < n_frames; k++) {
+		auto key = CWFRPlan::hash(Sx[k], Sy[k], geometry_key, method, options);
+		auto& frames = groups[key];
+		if (frames.empty()) keys.push_back(key);
+		frames.push_back(k);
+	}
 
-		// it should avoid the NaN at the i + 2 position
-		if (is_valid) {
-			is_valid = std::isfinite(m_Sy(i + 2, j)) && std::isfinite(m_Sy(i - 1, j)) ? true : false;
+	// the rhs vectors of at most batch_size frames are stacked at once
+	const size_t batch_size = 16;
+	MatrixXd G, Z;
+	for (auto key : keys) {
+		auto& pending = groups[key];
+		while (!pending.empty()) {
+			// find or build the plan of the first frame, and take the frames of
+			// its mask, the others only share the key by a hash collision
+			auto first = pending.front();
+			auto plan = plan_cache->find(key, Sx[first], Sy[first]);
+			if (!plan) {
+				CWFRT wfr(Sx[first], Sy[first], X, Y);
+				wfr.set_num_threads(num_threads);
+				plan = wfr.make_plan(method, options, key);
+				plan_cache->insert(plan);
+			}
+			std::vector<size_t> frames, others;
+			for (auto k : pending) (plan->matches(Sx[k], Sy[k]) ? frames : others).push_back(k);
+			pending.swap(others);
+
+			// stack the rhs vectors, one frame per thread, and solve them together
+			for (size_t begin = 0; begin < frames.size(); begin += batch_size) {
+				auto end = std::min(begin + batch_size, frames.size());
+				G.resize(plan->num_equations(), end - begin);
+				parallel_for(begin, end, num_threads, 1, [&](int_t c_begin, int_t c_end) {
+					for (int_t c = c_begin; c < c_end; c++) {
+						plan->assemble_g(Sx[frames[c]], Sy[frames[c]], X, Y, G.col(c - begin));
+					}
+				});
+
+				SolverReport report;
+				bool is_solved = plan->solve(G, Z, report);
+				for (size_t c = begin; c < end; c++) {
+					Zs[frames[c]] = to_scalar<Scalar>(is_solved ? plan->scatter(Z.col(c - begin)) : MatrixXXd::Zero(X.rows(), X.cols()));
+					if (reports) (*reports)[frames[c]] = report;
+				}
+			}
 		}
 	}
 
-	return is_valid;
+	return Zs;
 }
 
-double CWFR::calculate_3rd_order_gx(const int_t& i, const int_t& j, bool is_from_gy)
+template <class Scalar>
+std::shared_ptr<const CWFRPlan> CWFRT<Scalar>::make_plan(WFR_METHOD method, const SolverOptions& options)
 {
-	if (!is_from_gy)
-		return (m_Sx(i, j) + m_Sx(i, j + 1)) * (m_X(i, j + 1) - m_X(i, j)) * 0.5;
-	else
-		return (m_Sy(i, j) + m_Sy(i, j + 1)) * (m_Y(i, j + 1) - m_Y(i, j)) * 0.5;
+	return make_plan(method, options, CWFRPlan::hash(m_Sx, m_Sy, m_geometry->key(), method, options));
 }
 
-double CWFR::calculate_5th_order_gx(const int_t& i, const int_t& j, bool is_from_gy)
+template <class Scalar>
+std::shared_ptr<const CWFRPlan> CWFRT<Scalar>::make_plan(WFR_METHOD method, const SolverOptions& options, size_t key)
 {
-	if (!is_from_gy)
-		return (-1.0 / 13.0 * m_Sx(i, j - 1) + m_Sx(i, j) + m_Sx(i, j + 1) - 1.0 / 13.0 * m_Sx(i, j + 2)) * (m_X(i, j + 1) - m_X(i, j)) * (13.0 / 24.0);
-	else
-		return (-1.0 / 13.0 * m_Sy(i, j - 1) + m_Sy(i, j) + m_Sy(i, j + 1) - 1.0 / 13.0 * m_Sy(i, j + 2)) * (m_Y(i, j + 1) - m_Y(i, j)) * (13.0 / 24.0);
+	return std::make_shared<const CWFRPlan>(key, method, CWFRAssembly(m_Sx, m_Sy, options.ordering), options, m_num_threads, CWFRPlan::pack_mask(m_Sx, m_Sy));
 }
 
-double CWFR::calculate_3rd_order_gy(const int_t& i, const int_t& j, bool is_from_gx)
+template <class Scalar>
+void CWFRT<Scalar>::fill_D_g(WFR_METHOD method, TripletListd* D_trps, std_vecd& g_std, const CWFRAssembly& assembly)
 {
-	if (!is_from_gx)
-		return (m_Sy(i, j) + m_Sy(i + 1, j)) * (m_Y(i + 1, j) - m_Y(i, j)) * 0.5;
-	else
-		return (m_Sx(i, j) + m_Sx(i + 1, j)) * (m_X(i + 1, j) - m_X(i, j)) * 0.5;
-}
+	if (D_trps) assembly.fill_D(*D_trps, m_num_threads);
 
-double CWFR::calculate_5th_order_gy(const int_t& i, const int_t& j, bool is_from_gx)
-{
-	if (!is_from_gx)
-		return (-1.0 / 13.0 * m_Sy(i - 1, j) + m_Sy(i, j) + m_Sy(i + 1, j) - 1.0 / 13.0 * m_Sy(i + 2, j)) * (m_Y(i + 1, j) - m_Y(i, j)) * (13.0 / 24.0);
-	else
-		return (-1.0 / 13.0 * m_Sx(i - 1, j) + m_Sx(i, j) + m_Sx(i + 1, j) - 1.0 / 13.0 * m_Sx(i + 2, j)) * (m_X(i + 1, j) - m_X(i, j)) * (13.0 / 24.0);
+	g_std.resize(assembly.num_equations());
+	assembly.fill_g(m_Sx, m_Sy, m_X, m_Y, method, g_std.data(), m_num_threads);
 }
+
+template class CWFRT<double>;
+template class CWFRT<float>;
@@ -3,6 +3,214 @@
 
 #include "common.h"
 
+class CWFRAssembly;
+class CWFRPlan;
+class CWFRPlanCache;
+class CWFRStopwatch;
+
+//! This is the geometry (X, Y) shared by the frames of a fixed setup
+/*!
+* Many CWFR instances, streams or pipelines can hold the same geometry, so
+* the coordinates are stored and hashed once for all of them.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRGeometry {
+private:
+	MatrixXXd m_X;
+	MatrixXXd m_Y;
+	mutable std::once_flag m_key_flag;
+	mutable size_t m_key;
+
+public:
+	CWFRGeometry(
+		MatrixXXd X, /*!< [in] x coordinates*/
+		MatrixXXd Y  /*!< [in] y coordinates*/
+	);
+	virtual ~CWFRGeometry();
+
+	// Disable default constructor and copying
+	CWFRGeometry() = delete;
+	CWFRGeometry(const CWFRGeometry&) = delete;
+	CWFRGeometry& operator=(const CWFRGeometry&) = delete;
+
+	const MatrixXXd& X() const { return m_X; }
+	const MatrixXXd& Y() const { return m_Y; }
+	int_t rows() const { return m_X.rows(); }
+	int_t cols() const { return m_X.cols(); }
+
+	//! The key of CWFRPlan::hash_geometry(), computed on the first call
+	size_t key() const;
+};
+
+//! This is the base of the reconstructions of any scalar type
+/*!
+* It holds the methods, the solver backends and their options, which are
+* shared by the reconstructions of double and float slopes.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRBase {
+public:
+	enum class WFR_METHOD {
+		HFLI,
+		HFLIQ,
+		TFLI, /*!< the traditional 3rd-order (Southwell) stencil along the segments*/
+		TFLIQ, /*!< TFLI with the cross terms of the other slopes in quadrilateral geometry*/
+		SLI, /*!< the spline integrals of the runs of valid pixels, TFLI elsewhere*/
+		SLIQ, /*!< the spline integrals of the runs of valid pixels, HFLIQ elsewhere and for the cross terms*/
+		TFLI_I, /*!< TFLI on a rectangular mesh, interpolated before and after, see tfli2i.m*/
+		HFLI_I, /*!< HFLI on a rectangular mesh, interpolated before and after, see hfli2i.m*/
+		SLI_I, /*!< SLI on a rectangular mesh, interpolated before and after, see sli2i.m*/
+	};
+
+	//! Check if the method integrates on a rectangular mesh interpolated from the grid
+	static bool is_resampled(WFR_METHOD method)
+	{
+		return method == WFR_METHOD::TFLI_I || method == WFR_METHOD::HFLI_I || method == WFR_METHOD::SLI_I;
+	}
+
+	//! The method integrating on the rectangular mesh of a resampled method, or the method itself
+	static WFR_METHOD base_method(WFR_METHOD method)
+	{
+		switch (method)
+		{
+		case WFR_METHOD::TFLI_I: return WFR_METHOD::TFLI;
+		case WFR_METHOD::HFLI_I: return WFR_METHOD::HFLI;
+		case WFR_METHOD::SLI_I: return WFR_METHOD::SLI;
+		default: return method;
+		}
+	}
+
+	//! The solver backend of D * z = g
+	enum class WFR_SOLVER {
+		AUTO, /*!< DCT for a fully valid rectangle, otherwise LSCG for a single frame and SIMPLICIAL_LDLT for a plan shared by many frames*/
+		LSCG, /*!< least-squares conjugate gradient on D*/
+		SPARSE_QR, /*!< sparse QR of D*/
+		SIMPLICIAL_LDLT, /*!< LDLT of the normal equations*/
+		CHOLMOD, /*!< supernodal LLT of the normal equations, needs WFR_USE_CHOLMOD*/
+		PARDISO, /*!< LDLT of the normal equations by MKL, needs EIGEN_USE_MKL_ALL*/
+		MATRIX_FREE_CG, /*!< Jacobi-preconditioned CG of the normal equations without building D*/
+		MULTIGRID, /*!< geometric multigrid V-cycles of the normal equations without building D*/
+		MULTIGRID_CG, /*!< CG preconditioned by a geometric multigrid V-cycle without building D*/
+		DCT, /*!< exact DCT Poisson solve of a fully valid rectangle without building D*/
+		DCT_CG, /*!< CG preconditioned by the DCT Poisson solve of the bounding rectangle without building D*/
+		MIXED_LDLT, /*!< LDLT of the normal equations in float, refined iteratively to double accuracy*/
+	};
+
+	//! The numbering of the unknowns, computed once per validity mask and kept by its plan
+	enum class WFR_ORDERING {
+		NATURAL, /*!< the row-major scan order*/
+		RCM, /*!< Reverse Cuthill-McKee, a narrow band for the SpMV of the iterative backends*/
+		NESTED_DISSECTION, /*!< the geometric nested dissection, factorized without any other ordering by SIMPLICIAL_LDLT*/
+	};
+
+	//! The options of the solver backend
+	struct SolverOptions {
+		WFR_SOLVER solver; /*!< the backend*/
+		double tolerance; /*!< the tolerance of the iterative backends, 0 for the default of Eigen, 1e-10 for MULTIGRID or 1e-12 for MIXED_LDLT*/
+		int_t max_iterations; /*!< the maximum iterations of the iterative backends, 0 for the default of Eigen, 100 V-cycles for MULTIGRID or 10 refinements for MIXED_LDLT*/
+		WFR_ORDERING ordering; /*!< the numbering of the unknowns, a fully valid rectangle keeps the natural one*/
+
+		SolverOptions(WFR_SOLVER solver = WFR_SOLVER::AUTO, double tolerance = 0, int_t max_iterations = 0, WFR_ORDERING ordering = WFR_ORDERING::NATURAL)
+			: solver(solver)
+			, tolerance(tolerance)
+			, max_iterations(max_iterations)
+			, ordering(ordering)
+		{
+		}
+	};
+
+	//! The outcome of a solve
+	struct SolverReport {
+		WFR_SOLVER solver; /*!< the backend in use*/
+		Eigen::ComputationInfo info; /*!< Eigen::Success, or the reason of the failure*/
+		int_t iterations; /*!< the iterations of an iterative backend, the most of all the rhs vectors*/
+		double residual; /*!< the relative residual |D^T * (g - D * z)| / |D^T * g|, the worst of all the rhs vectors*/
+		std::string message; /*!< the failure reason, empty on success*/
+
+		SolverReport()
+			: solver(WFR_SOLVER::LSCG)
+			, info(Eigen::Success)
+			, iterations(0)
+			, residual(0)
+		{
+		}
+
+		bool success() const { return info == Eigen::Success; }
+
+		//! Fold in the report of another solve of the same reconstruction, keeping the first failure and the worst of both
+		void merge(const SolverReport& other)
+		{
+			if (success() && !other.success()) {
+				info = other.info;
+				message = other.message;
+			}
+			solver = other.solver;
+			iterations = std::max(iterations, other.iterations);
+			residual = std::max(residual, other.residual);
+		}
+	};
+
+	//! The phases and the size of a reconstruction
+	struct ReconstructionStats {
+		double scan_seconds; /*!< the mask scan, or hashing the mask and finding the cached plan*/
+		double assembly_seconds; /*!< filling the triplets of D and the rhs vector g*/
+		double build_seconds; /*!< setFromTriplets and makeCompressed of D*/
+		double setup_seconds; /*!< the setup or the factorization of the backend*/
+		double solve_seconds; /*!< the solve and its residual*/
+		double scatter_seconds; /*!< removing the pistons and putting z back to the grid*/
+		double pyramid_seconds; /*!< the coarse levels of a pyramid, their previews included*/
+		double total_seconds; /*!< the whole reconstruction*/
+		int_t valid_pixels; /*!< the unknowns*/
+		int_t equations; /*!< the rows of D*/
+		int_t third_order; /*!< the equations of the 3rd-order stencil*/
+		int_t fifth_order; /*!< the equations of the 5th-order stencil*/
+		int_t nnz; /*!< the non-zeros of D, 0 for a matrix-free backend*/
+		bool is_plan_reused; /*!< the plan came from the plan cache, so D was neither filled nor set up*/
+		SolverReport report; /*!< the backend, the iterations, the residual and the status*/
+
+		ReconstructionStats()
+			: scan_seconds(0)
+			, assembly_seconds(0)
+			, build_seconds(0)
+			, setup_seconds(0)
+			, solve_seconds(0)
+			, scatter_seconds(0)
+			, pyramid_seconds(0)
+			, total_seconds(0)
+			, valid_pixels(0)
+			, equations(0)
+			, third_order(0)
+			, fifth_order(0)
+			, nnz(0)
+			, is_plan_reused(false)
+		{
+		}
+	};
+
+	//! The export of the stats of every reconstruction, e.g. to a metrics system
+	using StatsHook = std::function<void(const ReconstructionStats&)>;
+
+	//! The preview of the coarse level of a pyramid, which halves the frame level times
+	using PreviewHook = std::function<void(int level, const MatrixXXd& Z)>;
+
+	//! The buffers of a reconstruction, reused from frame to frame
+	/*!
+	* The buffers are sized by the first frame, and keep their memory while
+	* the sizes do not change, so the next frames of the same mask do not
+	* allocate. A workspace is used by one reconstruction at a time.
+	*/
+	struct Workspace {
+		VectorXd g; /*!< the rhs vector*/
+		VectorXd b; /*!< D^T * g*/
+		VectorXd z; /*!< the unknowns*/
+		VectorXd z0; /*!< the initial guess*/
+		VectorXd t; /*!< the scratch of the solve and of the residual*/
+		VectorXd r; /*!< the residual g - D * z*/
+		VectorXd pistons; /*!< the sums of the connected apertures*/
+		ArrayXXd row_buffers; /*!< the stencils of a grid row*/
+		ArrayXd spline_work; /*!< the scratch of the spline fits*/
+		MatrixXXd spline_y; /*!< the spline integrals of the columns, one column per row*/
+	};
+};
+
 //! This is the class the reconstruct the wavefront shape from gradient data
 /*!
 * Reference:
@@ -13,161 +221,349 @@
 	[2] Lei Huang, Junpeng Xue, Bo Gao, Chao Zuo, and Mourad Idir,"Zonal
 	wavefront reconstruction in quadrilateral geometry for phase measuring
 	deflectometry," Appl. Opt. 56, 5139-5144 (2017)
+	[3] Lei Huang, Junpeng Xue, Bo Gao, Chao Zuo, and Mourad Idir, "Spline
+	based least squares integration for two-dimensional shape or wavefront
+	reconstruction," Optics and Lasers in Engineering 91, 221-226 (2017)
+* The slopes are of the scalar type Scalar, e.g. the float of a sensor,
+* and are promoted to double row by row while g is assembled, so only
+* their storage and bandwidth are halved. The solve is in double unless
+* WFR_SOLVER::MIXED_LDLT is chosen, and the result is of the Scalar type.
 */
-class WAVEFRONTRECONSTRUCTION_API CWFR {
-public:
-	enum class WFR_METHOD {
-		HFLI,
-		HFLIQ,
-	};
-
+template <class Scalar>
+class CWFRT : public CWFRBase {
 private:
-	MatrixXXd m_Sx;
-	MatrixXXd m_Sy;
-	MatrixXXd m_X;
-	MatrixXXd m_Y;
+	MatrixXX<Scalar> m_Sx_copy; /*!< the owned slopes, empty for a view*/
+	MatrixXX<Scalar> m_Sy_copy; /*!< the owned slopes, empty for a view*/
+	std::shared_ptr<const CWFRGeometry> m_geometry;
+	MatrixView<Scalar> m_Sx;
+	MatrixView<Scalar> m_Sy;
+	MatrixViewd m_X;
+	MatrixViewd m_Y;
 	int_t m_rows;
 	int_t m_cols;
+	std::shared_ptr<CWFRPlanCache> m_plan_cache;
+	int m_num_threads;
+	SolverReport m_report;
+	MatrixXXd m_Z0; /*!< the initial guess, empty to start from zero*/
+	bool m_is_stats_enabled;
+	ReconstructionStats m_stats;
+	StatsHook m_stats_hook;
+	bool m_is_split_enabled;
+	std::shared_ptr<Workspace> m_workspace;
+	int m_pyramid_levels;
+	PreviewHook m_preview_hook;
 
 public:
-	CWFR(
-		const MatrixXXd& Sx,/*!< [in] Slopes in x direction*/
-		const MatrixXXd& Sy,/*!< [in] Slopes in y direction*/
-		const MatrixXXd& X, /*!< [in] x coordinates*/
-		const MatrixXXd& Y  /*!< [in] y coordinates*/
+	//! Copy the slopes and the geometry
+	CWFRT(
+		MatrixXX<Scalar> Sx,/*!< [in] Slopes in x direction*/
+		MatrixXX<Scalar> Sy,/*!< [in] Slopes in y direction*/
+		MatrixXXd X, /*!< [in] x coordinates*/
+		MatrixXXd Y  /*!< [in] y coordinates*/
 	);
-	virtual ~CWFR();
+
+	//! View the slopes in place and share the geometry
+	/*!
+	* The slopes are neither copied nor owned, so they have to outlive the
+	* object. Any row-major matrix, Map or block with contiguous rows is taken
+	* as it is, whatever its outer stride, and the other layouts do not compile
+	* rather than being copied silently.
+	*/
+	template <class DerivedSx, class DerivedSy>
+	CWFRT(
+		const Eigen::MatrixBase<DerivedSx>& Sx,/*!< [in] Slopes in x direction*/
+		const Eigen::MatrixBase<DerivedSy>& Sy,/*!< [in] Slopes in y direction*/
+		std::shared_ptr<const CWFRGeometry> geometry /*!< [in] the geometry of the same size, must not be nullptr*/
+	)
+		: CWFRT(view(Sx), view(Sy), std::move(geometry))
+	{
+	}
+
+	//! View the slopes of existing views and share the geometry
+	CWFRT(
+		const MatrixView<Scalar>& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixView<Scalar>& Sy,/*!< [in] Slopes in y direction*/
+		std::shared_ptr<const CWFRGeometry> geometry /*!< [in] the geometry of the same size, must not be nullptr*/
+	);
+
+	virtual ~CWFRT();
 
 	// Disable default constructor and copyping
-	CWFR() = delete;
-	CWFR(const CWFR&) = delete;
-	CWFR& operator=(const CWFR&) = delete;
+	CWFRT() = delete;
+	CWFRT(const CWFRT&) = delete;
+	CWFRT& operator=(const CWFRT&) = delete;
 
-	MatrixXXd operator () (
-		WFR_METHOD method = WFR_METHOD::HFLI /*!< [in] method to be used*/
+	//! Reconstruct the wavefront
+	/*!
+	* If the solver backend fails, Z is all zeros and report() holds the reason.
+	* \return the reconstructed wavefront Z
+	*/
+	MatrixXX<Scalar> operator () (
+		WFR_METHOD method = WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const SolverOptions& options = SolverOptions() /*!< [in] the solver backend*/
 		);
 
+	//! Reconstruct the wavefront into a buffer of the caller
+	/*!
+	* With a plan cache, a frame of a cached plan assembles g, solves and
+	* scatters Z in the buffers of the workspace, see set_workspace(). So with
+	* one thread and a direct backend of the normal equations, e.g. the
+	* SIMPLICIAL_LDLT that WFR_SOLVER::AUTO picks for a plan, the frames after
+	* the first one do not allocate any heap memory. Without a plan cache, or
+	* with a resampled method, the result of operator() is copied into Z.
+	* \return false if the solver backend failed, Z is all zeros then and report() holds the reason
+	*/
+	bool reconstruct_into(
+		Eigen::Ref<MatrixXX<Scalar>> Z, /*!< [out] the reconstructed wavefront, of the size of the slopes*/
+		WFR_METHOD method = WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const SolverOptions& options = SolverOptions() /*!< [in] the solver backend*/
+	);
+
+	//! Reconstruct the wavefront into a row-major buffer of the caller
+	/*!
+	* \return false if the solver backend failed, see report()
+	*/
+	bool reconstruct_into(
+		Scalar* Z, /*!< [out] the reconstructed wavefront, rows() x cols() elements*/
+		int_t stride, /*!< [in] the number of elements between the starts of two rows*/
+		WFR_METHOD method = WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const SolverOptions& options = SolverOptions() /*!< [in] the solver backend*/
+	)
+	{
+		Eigen::Map<MatrixXX<Scalar>, 0, Eigen::OuterStride<>> map(Z, m_rows, m_cols, Eigen::OuterStride<>(stride));
+		return reconstruct_into(map, method, options);
+	}
+
+	//! The outcome of the last reconstruction
+	const SolverReport& report() const { return m_report; }
+
+	//! Time the phases and count the size of every reconstruction
+	/*!
+	* The stats only read the clock between the phases, so they are cheap
+	* enough to be left on. They tell a slow frame by its phase and its size,
+	* e.g. a plan missing the cache or many iterations of the backend.
+	*/
+	void set_stats_enabled(
+		bool is_enabled /*!< [in] true to collect the stats*/
+	) { m_is_stats_enabled = is_enabled; }
+
+	//! Hand the stats of every reconstruction to the hook, and enable them
+	/*!
+	* The hook is called on the reconstructing thread, after the failures as
+	* well, so it should only queue the stats for the export.
+	*/
+	void set_stats_hook(
+		StatsHook hook /*!< [in] the export, nullptr to remove it*/
+	)
+	{
+		m_stats_hook = std::move(hook);
+		if (m_stats_hook) m_is_stats_enabled = true;
+	}
+
+	//! The stats of the last reconstruction, if enabled
+	const ReconstructionStats& stats() const { return m_stats; }
+
+	//! Reconstruct many frames sharing the geometry
+	/*!
+	* The frames with the same validity mask share one plan, their rhs
+	* vectors are stacked as the columns of G, and D * Z = G is solved for 16
+	* columns at once. The slopes are read in place without any copy.
+	* \return the reconstructed wavefront Z of each frame, all zeros if the
+	* solver backend failed for the frame, see reports
+	*/
+	static std::vector<MatrixXX<Scalar>> batch(
+		const std::vector<MatrixXX<Scalar>>& Sx,/*!< [in] Slopes in x direction of each frame*/
+		const std::vector<MatrixXX<Scalar>>& Sy,/*!< [in] Slopes in y direction of each frame*/
+		const MatrixXXd& X, /*!< [in] x coordinates*/
+		const MatrixXXd& Y, /*!< [in] y coordinates*/
+		WFR_METHOD method = WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		std::shared_ptr<CWFRPlanCache> plan_cache = nullptr, /*!< [in] the cache, nullptr for a local one*/
+		int num_threads = 1, /*!< [in] number of threads assembling the frames, 0 for all the hardware threads*/
+		const SolverOptions& options = SolverOptions(), /*!< [in] the solver backend*/
+		std::vector<SolverReport>* reports = nullptr /*!< [out] the outcome of each frame, shared by the frames solved together, nullptr to skip*/
+	);
+
+	//! Reuse the plans of the frames sharing the geometry and the validity mask
+	/*!
+	* With a plan cache, a repeated frame only assembles g and solves with the
+	* cached factorization. The cache can be shared by many CWFR instances.
+	*/
+	void set_plan_cache(
+		std::shared_ptr<CWFRPlanCache> plan_cache /*!< [in] the cache, nullptr to disable*/
+	) { m_plan_cache = std::move(plan_cache); }
+
+	//! Reuse the buffers of a workspace for the frames of the cached plans
+	/*!
+	* A workspace outlives the CWFR instance of a frame, so the next frames
+	* find their buffers already sized. It serves one reconstruction at a
+	* time, so the concurrent reconstructions need a workspace each.
+	*/
+	void set_workspace(
+		std::shared_ptr<Workspace> workspace /*!< [in] the workspace, nullptr for a new one per instance*/
+	) { m_workspace = std::move(workspace); }
+
+	//! Assemble D and g with many threads
+	/*!
+	* The rows of the grid are filled in parallel into preallocated slots, so
+	* the result is bit-identical to the serial assembly.
+	*/
+	void set_num_threads(
+		int num_threads /*!< [in] number of threads, 0 for all the hardware threads, 1 for serial*/
+	) { m_num_threads = num_threads; }
+
+	//! Solve the disconnected apertures as independent systems
+	/*!
+	* Each connected aperture, e.g. a segment of a segmented mirror, has its
+	* own piston, so the single system of all of them is rank-deficient by
+	* the number of apertures. With the split, which is on by default, every
+	* aperture is cropped to its bounding box and solved as a smaller system
+	* of its own, concurrently with the others, and shifted to its own zero
+	* mean as before. The equations are the same, so only the conditioning
+	* and the speed differ. A cached plan is never split.
+	*/
+	void set_split_enabled(
+		bool is_enabled /*!< [in] false to solve all the apertures as one system*/
+	) { m_is_split_enabled = is_enabled; }
+
+	//! Reconstruct coarse-to-fine through a pyramid of halved frames
+	/*!
+	* The slopes, the coordinates and the validity mask are halved up to
+	* num_levels times, see CWFRPyramid, and the coarsest level is
+	* reconstructed first, in a small fraction of the time of the frame. The
+	* result of every coarse level goes to the hook right away, as a preview,
+	* and is prolongated bilinearly to seed the next finer level, down to the
+	* frame itself. The prolongated result replaces the initial guess of the
+	* frame. So the iterative backends start every level close to its result,
+	* while the direct ones ignore the guesses, and only add the previews.
+	* A level that fails is skipped, so the frame is solved in any case.
+	*/
+	void set_pyramid(
+		int num_levels, /*!< [in] the coarse levels at most, 0 to disable*/
+		PreviewHook hook = nullptr /*!< [in] the preview of every coarse level, called on the reconstructing thread, coarsest first*/
+	)
+	{
+		m_pyramid_levels = std::max(num_levels, 0);
+		m_preview_hook = std::move(hook);
+	}
+
+	//! Start the iterative backends from an initial guess
+	/*!
+	* The guess is usually the result of a previous frame with little change,
+	* which cuts the LSCG iterations. It is mapped to the unknowns through the
+	* valid ids of this frame, its non-finite pixels start from 0, and a guess
+	* of another size is ignored. The direct backends do not need any guess.
+	*/
+	void set_initial_guess(
+		const MatrixXXd& Z0 /*!< [in] the initial guess of Z, empty to start from zero*/
+	) { m_Z0 = Z0; }
+
+	//! Build the plan of this frame
+	/*!
+	* A resampled method is planned as its base method on the grid itself,
+	* as its mesh and its mask depend on the frame.
+	* \return the plan holding D and the prepared solver backend
+	*/
+	std::shared_ptr<const CWFRPlan> make_plan(
+		WFR_METHOD method = WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const SolverOptions& options = SolverOptions() /*!< [in] the solver backend*/
+	);
+
 private:
 	//! HFLI method
 	/*!
 	* Reconstruct the height from the slopes in x and y directions with
 	* the High-order Finite-difference-based Least-squares Integration for
-	* Quadrileteral (HFLIQ) method.
+	* Quadrileteral (HFLIQ) method, or any other method differing only in g.
 	*					D * z = g
 	* \return the reconstructed wavefront Z
 	*/
-	MatrixXXd hfli_calculator(std::function<void (TripletListd&, std_vecd&, const map_ii&)>hfli_prep);
-
-private:
-	//! Fill the matrix D and the rhs vector g for hfli
-	void hfli_fill_D_g(
-		TripletListd& D_trps, /*!< [out] the filled matrix D*/
-		std_vecd& g_std, /*!< [out] the filled vector g_std*/
-		const map_ii& valid_ids_map
+	template <class Prep>
+	MatrixXXd hfli_calculator(
+		Prep&& hfli_prep, /*!< [in] hfli_prep(D_trps, g_std, assembly) fills D, unless D_trps is nullptr, and g*/
+		const CWFRAssembly& assembly,
+		const SolverOptions& options,
+		CWFRStopwatch& stopwatch
 	);
 
-	//! Fill the matrix D and the rhs vector g for hfliq
-	void hfliq_fill_D_g(
-		TripletListd& D_trps, /*!< [out] the filled matrix D*/
-		std_vecd& g_std, /*!< [out] the filled vector g_std*/
-		const map_ii& valid_ids_map
-	);
-
-	//! Determine if the id is valid
-	bool is_valid_id(const int& i, const int& j) const { return isfinite(m_Sx(i, j)) && isfinite(m_Sy(i, j)); };
-
-	//! Get all the valid ids
-	map_ii get_valid_ids();
-
-	//! Determine if the current position is valid for a 3rd-order equation
-	/*
-	* Determine if the current [i, j] can be used to insert a 3rd-order equation to
-	* the matrix D and an element into the rhs vector g. The rules are:
-	* 1) For Sx,
-	*			x, NaN, x
-	* 2) For Sy,
-	*			 x
-	*			NaN
-	*			 x
-	* where "x" and "NaN" are the invalid positions.
-	* \return a pair of (bool, bool) indicating whether the (x, y) has the 3rd-order equation.
-	*/
-	bool is_3rd_order_equation_sx(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j  /*!< [in] the id in x-axis*/
-	);
-	bool is_3rd_order_equation_sy(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j  /*!< [in] the id in x-axis*/
-	);
-
-	//! Determine if the current position can write a 5th-order equation
-	/*
-	* Determine if the current [i, j] can be used to write a 5th-order equation
-	* in the matrix D. The rules are:
-	* 1) For Sx,
-	*			   |
-	*			x, x, NaN, x, so the right boundary needs two pixels at least
-	* 2) For Sy,
-	*			 x
-	*			 x <--
-	*			NaN
-	*			 x
-	*	so the bottom boundary needs two pixels at least
-	* where "x" and "NaN" are the invalid positions for a 5th-order equation.
-	* This means 5th-order = 3rd-order + boundary care + NaN
-	* \return a pair of (bool, bool) indicating whether the (x, y) has the 5th-order equation.
-	*/
-	bool is_5th_order_equation_sx(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j  /*!< [in] the id in x-axis*/
-	);
-	bool is_5th_order_equation_sy(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j  /*!< [in] the id in x-axis*/
-	);
+	//! Connected-component method
+	/*!
+	* Reconstruct every connected aperture of the scanned validity masks on
+	* its own bounding box, concurrently, and merge their reports.
+	* \return the reconstructed wavefront Z
+	*/
+	MatrixXXd component_calculator(WFR_METHOD method, const CWFRAssembly& assembly, const SolverOptions& options, CWFRStopwatch& stopwatch);
 
-	//! Calcualte the 3rd order for the gx
-	/*
-	* \return the gx for the j, j+1 segment
+	//! Cached-plan method
+	/*!
+	* Reconstruct the height with the plan from the plan cache, and build
+	* and cache the plan if it is not there yet.
+	* \return the reconstructed wavefront Z
 	*/
-	double calculate_3rd_order_gx(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j, /*!< [in] the id in x-axis*/
-		bool is_from_gy = false /*!< [in] for hfliq, if gy contributes*/
-	);
+	MatrixXXd plan_calculator(WFR_METHOD method, const SolverOptions& options, CWFRStopwatch& stopwatch);
 
-	//! Calcualte the 5th order for the gx
-	/*
-	* \return the gx for the j, j+1 segment
+	//! Solve with the cached plan into the workspace
+	/*!
+	* Find the plan in the plan cache, or build and cache it, then assemble g
+	* and solve in the buffers of the workspace.
+	* \return the plan, with the unknowns in workspace.z, or nullptr if the solver backend failed
 	*/
-	double calculate_5th_order_gx(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j, /*!< [in] the id in x-axis*/
-		bool is_from_gy = false /*!< [in] for hfliq, if gy contributes*/
-	);
+	std::shared_ptr<const CWFRPlan> plan_solve(WFR_METHOD method, const SolverOptions& options, CWFRStopwatch& stopwatch, Workspace& workspace);
 
-	//! Calcualte the 3rd order for the gy
-	/*
-	* \return the gy for the i, i+1 segment
+	//! Complete the stats of a reconstruction, and hand them to the hook
+	void finish_stats(const CWFRStopwatch& stopwatch);
+
+	//! Resampled method
+	/*!
+	* Interpolate the slopes to a rectangular mesh over the valid pixels,
+	* reconstruct there with the base method, and interpolate the height back
+	* to the grid.
+	* \return the reconstructed wavefront Z
 	*/
-	double calculate_3rd_order_gy(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j, /*!< [in] the id in x-axis*/
-		bool is_from_gx = false /*!< [in] for hfliq, if gx contributes*/
-	);
+	MatrixXXd resample_calculator(WFR_METHOD method, const SolverOptions& options);
 
-	//! Calcualte the 5th order for the gy
-	/*
-	* \return the gy for the i, i+1 segment
+	//! Pyramid method
+	/*!
+	* Reconstruct the coarse levels of the frame, coarsest first, each one
+	* seeded with the prolongated result of the coarser one, and hand every
+	* result to the preview hook.
+	* \return the result of the finest coarse level prolongated to the frame, empty if there is none
 	*/
-	double calculate_5th_order_gy(
-		const int_t& i, /*!< [in] the id in y-axis*/
-		const int_t& j, /*!< [in] the id in x-axis*/
-		bool is_from_gx = false /*!< [in] for hfliq, if gx contributes*/
+	MatrixXXd pyramid_calculator(WFR_METHOD method, const SolverOptions& options);
+
+	//! Count the size of the system for the stats
+	void count_stats(const CWFRAssembly& assembly, int_t nnz);
+
+	//! Check if the initial guess fits this frame
+	bool has_initial_guess() const { return m_Z0.rows() == m_rows && m_Z0.cols() == m_cols; }
+
+	//! View the slopes without any copy, or fail to compile
+	template <class Derived>
+	static MatrixView<Scalar> view(const Eigen::MatrixBase<Derived>& S)
+	{
+		static_assert(bool(Derived::Flags & Eigen::RowMajorBit) && bool(Derived::Flags & Eigen::DirectAccessBit) && Derived::InnerStrideAtCompileTime == 1,
+			"The slopes have to be row-major with contiguous rows to be viewed in place");
+		return MatrixView<Scalar>(S.derived());
+	}
+
+	//! Build the plan of this frame with a known key
+	std::shared_ptr<const CWFRPlan> make_plan(WFR_METHOD method, const SolverOptions& options, size_t key);
+
+private:
+	//! Fill the matrix D and the rhs vector g for the method
+	void fill_D_g(
+		WFR_METHOD method, /*!< [in] method to be used*/
+		TripletListd* D_trps, /*!< [out] the filled matrix D, nullptr to skip it*/
+		std_vecd& g_std, /*!< [out] the filled vector g_std*/
+		const CWFRAssembly& assembly /*!< [in] the scanned validity masks*/
 	);
 };
 
 
+using CWFR = CWFRT<double>;
+using CWFRf = CWFRT<float>;
+
+extern template class WAVEFRONTRECONSTRUCTION_API CWFRT<double>;
+extern template class WAVEFRONTRECONSTRUCTION_API CWFRT<float>;
+
 
 #endif // !CWFR_H
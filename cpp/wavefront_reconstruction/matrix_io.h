@@ -4,6 +4,35 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+//! fopen_s of the Microsoft CRT, for the other platforms
+inline int fopen_s(FILE** file, const char* filename, const char* mode)
+{
+	*file = fopen(filename, mode);
+	return *file ? 0 : errno;
+}
+#endif
 
 inline int ID_1D(int x, int y, int width) { return (y * width + x); }
 
@@ -107,6 +136,783 @@ int write_matrix_to_stream(FILE* file, int rows, int cols, T* matrix)
 	return 0;
 }
 
+//! This is a read-only memory mapping of a matrix file
+/*!
+* The payload after the 8-byte header is viewed in place by map(), so the
+* matrix is neither copied nor buffered twice, the pages are loaded from the
+* page cache on demand. The mapping is released by the destructor, so the
+* views must not outlive the object.
+* The file has to hold exactly rows * cols values after the header, which
+* also rejects the files of the other byte order.
+*/
+template <class T>
+class CMappedMatrix {
+public:
+	typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+	typedef Eigen::Map<const Matrix> ConstMap;
+
+private:
+	static constexpr size_t HEADER_SIZE = 2 * sizeof(int);
+
+	const char* m_view;
+	size_t m_size;
+	int m_rows;
+	int m_cols;
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#endif
+
+public:
+	CMappedMatrix() { reset(); }
+
+	explicit CMappedMatrix(const char* filename)
+	{
+		reset();
+		open(filename);
+	}
+
+	~CMappedMatrix() { close(); }
+
+	CMappedMatrix(CMappedMatrix&& other) noexcept
+	{
+		reset();
+		swap(other);
+	}
+
+	CMappedMatrix& operator=(CMappedMatrix&& other) noexcept
+	{
+		if (this != &other) {
+			close();
+			swap(other);
+		}
+		return *this;
+	}
+
+	// Disable copying
+	CMappedMatrix(const CMappedMatrix&) = delete;
+	CMappedMatrix& operator=(const CMappedMatrix&) = delete;
+
+	//! Map a matrix file, closing the previous one
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	int open(const char* filename)
+	{
+		close();
+		if (map_file(filename) != 0)
+		{
+			printf("Can't map input matrix file: %s.\n", filename);
+			close();
+			return 1;
+		}
+
+		// the header, in the byte order of this machine
+		if (m_size < HEADER_SIZE)
+		{
+			printf("Error reading matrix header from disk file: %s.\n", filename);
+			close();
+			return 1;
+		}
+		memcpy(&m_rows, m_view, sizeof(int));
+		memcpy(&m_cols, m_view + sizeof(int), sizeof(int));
+		if (m_rows < 0 || m_cols < 0 || m_size - HEADER_SIZE != static_cast<size_t>(m_rows) * m_cols * sizeof(T))
+		{
+			printf("Error: the size of %s does not match its header, or its byte order is not native.\n", filename);
+			close();
+			return 1;
+		}
+
+		// the mapping is page aligned, but the payload has to be aligned for T as well
+		if (reinterpret_cast<uintptr_t>(m_view + HEADER_SIZE) % alignof(T) != 0)
+		{
+			printf("Error: the payload of %s is misaligned for sizeof(T)=%lu.\n", filename, static_cast<unsigned long>(sizeof(T)));
+			close();
+			return 1;
+		}
+
+		return 0;
+	}
+
+	//! Release the mapping
+	void close()
+	{
+#ifdef _WIN32
+		if (m_view) UnmapViewOfFile(m_view);
+		if (m_mapping) CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+		if (m_view) munmap(const_cast<char*>(m_view), m_size);
+#endif
+		reset();
+	}
+
+	bool is_open() const { return m_view != nullptr; }
+	int rows() const { return m_rows; }
+	int cols() const { return m_cols; }
+	const T* data() const { return m_view ? reinterpret_cast<const T*>(m_view + HEADER_SIZE) : nullptr; }
+
+	//! The read-only view of the payload, valid until close()
+	ConstMap map() const { return ConstMap(data(), m_rows, m_cols); }
+
+private:
+	void reset()
+	{
+		m_view = nullptr;
+		m_size = 0;
+		m_rows = 0;
+		m_cols = 0;
+#ifdef _WIN32
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = nullptr;
+#endif
+	}
+
+	void swap(CMappedMatrix& other)
+	{
+		std::swap(m_view, other.m_view);
+		std::swap(m_size, other.m_size);
+		std::swap(m_rows, other.m_rows);
+		std::swap(m_cols, other.m_cols);
+#ifdef _WIN32
+		std::swap(m_file, other.m_file);
+		std::swap(m_mapping, other.m_mapping);
+#endif
+	}
+
+	//! Map the whole file read-only
+	int map_file(const char* filename)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			return 1;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+			return 1;
+		m_size = static_cast<size_t>(size.QuadPart);
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!m_mapping)
+			return 1;
+		m_view = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		return m_view ? 0 : 1;
+#else
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0)
+			return 1;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			return 1;
+		}
+		void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (view == MAP_FAILED)
+			return 1;
+		m_view = static_cast<const char*>(view);
+		m_size = static_cast<size_t>(st.st_size);
+		madvise(view, m_size, MADV_SEQUENTIAL);
+		return 0;
+#endif
+	}
+};
+
+//! Map a matrix file read-only, see CMappedMatrix
+/*!
+* \return 0 on success, 1 otherwise
+*/
+template <class T>
+int map_matrix_from_disk(const char* filename, CMappedMatrix<T>& matrix)
+{
+	return matrix.open(filename);
+}
+
+//! This is the layout of a slope archive, a container of many frames of Sx and Sy
+/*!
+* The file starts with a Header, followed by X and Y stored once as
+* doubles, the chunks of frames_per_chunk frames each, and the chunk index
+* at index_offset. A frame stores Sx and then Sy, each as a bit-packed
+* validity mask of ceil(rows * cols / 8) bytes, bit (id % 8) of the byte
+* id / 8 set for a finite value, followed by the valid values only, in the
+* dtype of the archive. So the invalid pixels take one bit instead of a
+* full value, and read back as NaN.
+* An archive of the codec SHUFFLE_PACKBITS stores every valid value as the
+* difference of its bits and the bits of the previous valid value of its
+* slope, both read as unsigned integers of the dtype size, wrapping around,
+* and zigzag-coded, (d << 1) ^ (d >> (bits - 1)) with an arithmetic shift,
+* so small differences of either sign give small codes. The first valid
+* value of a slope is the difference from 0. A compressed chunk then
+* shuffles its bytes by significance, the byte b of every value into the
+* plane b, and packs the runs of equal bytes, as PackBits. The neighbouring
+* slopes share their sign, exponent and upper mantissa, so the shuffled
+* chunk is mostly runs of zeros. A chunk which does not shrink is stored
+* without the shuffle and PackBits, its values are still the zigzag
+* differences, as all the values of the archive.
+* The numbers are in the byte order of this machine, an archive of the
+* other order fails the version check.
+*/
+class CSlopeArchive {
+public:
+	enum class DTYPE : uint32_t {
+		FLOAT32 = 0,
+		FLOAT64 = 1
+	};
+
+	enum class CODEC : uint32_t {
+		RAW = 0,
+		SHUFFLE_PACKBITS = 1 /*!< the zigzag integer difference of the values, the byte shuffle and PackBits*/
+	};
+
+	static constexpr uint32_t VERSION = 1;
+
+protected:
+	struct Header {
+		char magic[4]; /*!< "WFRA"*/
+		uint32_t version;
+		uint32_t dtype;
+		uint32_t codec; /*!< the codec requested for the chunks*/
+		int32_t rows;
+		int32_t cols;
+		uint32_t frames_per_chunk;
+		uint32_t num_chunks;
+		uint64_t num_frames;
+		uint64_t index_offset; /*!< the file offset of the chunk index*/
+	};
+
+	struct ChunkEntry {
+		uint64_t offset; /*!< the file offset of the chunk*/
+		uint64_t stored_size; /*!< the bytes in the file*/
+		uint64_t raw_size; /*!< the bytes after decoding*/
+		uint32_t num_frames;
+		uint32_t codec; /*!< the codec of this chunk, RAW if it did not shrink*/
+	};
+
+	static_assert(sizeof(Header) == 48 && sizeof(ChunkEntry) == 32, "the archive structs must not be padded");
+
+	static size_t mask_size(size_t n) { return (n + 7) / 8; }
+	static size_t dtype_size(DTYPE dtype) { return dtype == DTYPE::FLOAT32 ? sizeof(float) : sizeof(double); }
+
+	static int seek_stream(FILE* file, uint64_t offset)
+	{
+#ifdef _WIN32
+		return _fseeki64(file, static_cast<long long>(offset), SEEK_SET);
+#else
+		return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+	}
+
+	//! The size of the file, 0 if unknown, the position is left at the end
+	static uint64_t stream_size(FILE* file)
+	{
+#ifdef _WIN32
+		if (_fseeki64(file, 0, SEEK_END) != 0) return 0;
+		auto size = _ftelli64(file);
+#else
+		if (fseeko(file, 0, SEEK_END) != 0) return 0;
+		auto size = ftello(file);
+#endif
+		return size > 0 ? static_cast<uint64_t>(size) : 0;
+	}
+
+	//! Map the differences of small magnitude, positive or negative, to small codes
+	template <class Bits>
+	static Bits zigzag(Bits d) { return static_cast<Bits>((d << 1) ^ (0 - (d >> (8 * sizeof(Bits) - 1)))); }
+
+	template <class Bits>
+	static Bits unzigzag(Bits z) { return static_cast<Bits>((z >> 1) ^ (0 - (z & 1))); }
+
+	//! Append the mask and the valid values of a slope
+	template <class Stored, class T>
+	static void pack_slope(const T* S, size_t n, bool is_delta, std::vector<uint8_t>& out)
+	{
+		using Bits = typename std::conditional<sizeof(Stored) == 4, uint32_t, uint64_t>::type;
+		auto mask = out.size();
+		out.resize(mask + mask_size(n), 0);
+		size_t n_valid = 0;
+		for (size_t id = 0; id < n; id++) {
+			if (!std::isfinite(static_cast<double>(S[id]))) continue;
+			out[mask + id / 8] |= static_cast<uint8_t>(1u << (id % 8));
+			n_valid++;
+		}
+
+		auto values = out.size();
+		out.resize(values + n_valid * sizeof(Stored));
+		Bits previous = 0;
+		for (size_t id = 0; id < n; id++) {
+			if (!std::isfinite(static_cast<double>(S[id]))) continue;
+			auto value = static_cast<Stored>(S[id]);
+			Bits bits;
+			memcpy(&bits, &value, sizeof(Bits));
+			auto stored = is_delta ? zigzag(static_cast<Bits>(bits - previous)) : bits;
+			previous = bits;
+			memcpy(&out[values], &stored, sizeof(Bits));
+			values += sizeof(Bits);
+		}
+	}
+
+	//! Read the mask and the valid values of a slope at p, NaN for the invalid pixels
+	/*!
+	* \return the position after the slope, nullptr if it overruns end
+	*/
+	template <class Stored, class T>
+	static const uint8_t* unpack_slope(const uint8_t* p, const uint8_t* end, size_t n, bool is_delta, T* S)
+	{
+		using Bits = typename std::conditional<sizeof(Stored) == 4, uint32_t, uint64_t>::type;
+		if (static_cast<size_t>(end - p) < mask_size(n)) return nullptr;
+		const uint8_t* mask = p;
+		p += mask_size(n);
+
+		Bits previous = 0;
+		for (size_t id = 0; id < n; id++) {
+			if (!(mask[id / 8] & (1u << (id % 8)))) {
+				S[id] = std::numeric_limits<T>::quiet_NaN();
+				continue;
+			}
+			if (static_cast<size_t>(end - p) < sizeof(Bits)) return nullptr;
+			Bits bits;
+			memcpy(&bits, p, sizeof(Bits));
+			p += sizeof(Bits);
+			if (is_delta) bits = static_cast<Bits>(unzigzag(bits) + previous);
+			previous = bits;
+			Stored value;
+			memcpy(&value, &bits, sizeof(Bits));
+			S[id] = static_cast<T>(value);
+		}
+		return p;
+	}
+
+	//! Gather the byte b of every stride bytes into the plane b, the tail is kept as is
+	static void shuffle(const std::vector<uint8_t>& in, size_t stride, std::vector<uint8_t>& out)
+	{
+		out.resize(in.size());
+		auto m = in.size() / stride;
+		for (size_t b = 0; b < stride; b++)
+			for (size_t i = 0; i < m; i++) out[b * m + i] = in[i * stride + b];
+		memcpy(out.data() + m * stride, in.data() + m * stride, in.size() - m * stride);
+	}
+
+	static void unshuffle(const std::vector<uint8_t>& in, size_t stride, std::vector<uint8_t>& out)
+	{
+		out.resize(in.size());
+		auto m = in.size() / stride;
+		for (size_t b = 0; b < stride; b++)
+			for (size_t i = 0; i < m; i++) out[i * stride + b] = in[b * m + i];
+		memcpy(out.data() + m * stride, in.data() + m * stride, in.size() - m * stride);
+	}
+
+	//! Encode runs of 3 to 128 equal bytes as (257 - length, byte), and the other bytes as (length - 1, bytes)
+	static void pack_bits(const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+	{
+		out.clear();
+		size_t i = 0, n = in.size();
+		while (i < n) {
+			size_t run = 1;
+			while (i + run < n && run < 128 && in[i + run] == in[i]) run++;
+			if (run >= 3) {
+				out.push_back(static_cast<uint8_t>(257 - run));
+				out.push_back(in[i]);
+				i += run;
+				continue;
+			}
+
+			// the literals up to the next run of 3
+			size_t literal = i;
+			while (literal < n && literal - i < 128 && !(literal + 2 < n && in[literal] == in[literal + 1] && in[literal] == in[literal + 2])) literal++;
+			out.push_back(static_cast<uint8_t>(literal - i - 1));
+			out.insert(out.end(), in.begin() + i, in.begin() + literal);
+			i = literal;
+		}
+	}
+
+	//! Decode PackBits into raw_size bytes
+	/*!
+	* \return 0 on success, 1 if the data is corrupt
+	*/
+	static int unpack_bits(const std::vector<uint8_t>& in, size_t raw_size, std::vector<uint8_t>& out)
+	{
+		out.clear();
+		out.reserve(raw_size);
+		size_t i = 0;
+		while (i < in.size()) {
+			auto c = in[i++];
+			if (c < 128) {
+				size_t length = c + 1;
+				if (i + length > in.size() || out.size() + length > raw_size) return 1;
+				out.insert(out.end(), in.begin() + i, in.begin() + i + length);
+				i += length;
+			}
+			else {
+				size_t length = 257 - c;
+				if (i >= in.size() || out.size() + length > raw_size) return 1;
+				out.insert(out.end(), length, in[i++]);
+			}
+		}
+		return out.size() == raw_size ? 0 : 1;
+	}
+};
+
+//! This is the writer of a slope archive, see CSlopeArchive
+/*!
+* The frames are buffered until a chunk is full, and the chunk index is
+* written by close(), so an archive which is not closed is unreadable.
+*/
+class CSlopeArchiveWriter : public CSlopeArchive {
+private:
+	FILE* m_file;
+	Header m_header;
+	std::vector<ChunkEntry> m_index;
+	std::vector<uint8_t> m_chunk; /*!< the frames of the open chunk*/
+	std::vector<uint8_t> m_shuffled;
+	std::vector<uint8_t> m_packed;
+	uint32_t m_chunk_frames;
+	uint64_t m_offset; /*!< the end of the file*/
+
+public:
+	CSlopeArchiveWriter()
+		: m_file(nullptr)
+	{
+	}
+
+	~CSlopeArchiveWriter() { close(); }
+
+	// Disable copying
+	CSlopeArchiveWriter(const CSlopeArchiveWriter&) = delete;
+	CSlopeArchiveWriter& operator=(const CSlopeArchiveWriter&) = delete;
+
+	//! Create an archive of the geometry, closing the previous one
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	int open(const char* filename, int rows, int cols, const double* X, const double* Y, DTYPE dtype = DTYPE::FLOAT32, int frames_per_chunk = 16, CODEC codec = CODEC::SHUFFLE_PACKBITS)
+	{
+		close();
+		fopen_s(&m_file, filename, "wb");
+		if (!m_file)
+		{
+			printf("Can't open output file: %s.\n", filename);
+			return 1;
+		}
+
+		memcpy(m_header.magic, "WFRA", 4);
+		m_header.version = VERSION;
+		m_header.dtype = static_cast<uint32_t>(dtype);
+		m_header.codec = static_cast<uint32_t>(codec);
+		m_header.rows = rows;
+		m_header.cols = cols;
+		m_header.frames_per_chunk = static_cast<uint32_t>(std::max(frames_per_chunk, 1));
+		m_header.num_chunks = 0;
+		m_header.num_frames = 0;
+		m_header.index_offset = 0;
+		m_index.clear();
+		m_chunk.clear();
+		m_chunk_frames = 0;
+
+		// the header is rewritten by close()
+		size_t n = static_cast<size_t>(rows) * cols;
+		if (fwrite(&m_header, sizeof(Header), 1, m_file) < 1 || fwrite(X, sizeof(double), n, m_file) < n || fwrite(Y, sizeof(double), n, m_file) < n)
+		{
+			printf("Error writing the archive header to disk file: %s.\n", filename);
+			fclose(m_file);
+			m_file = nullptr;
+			return 1;
+		}
+		m_offset = sizeof(Header) + 2 * n * sizeof(double);
+		return 0;
+	}
+
+	//! Append a frame of rows x cols slopes, converted to the dtype of the archive
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	template <class T>
+	int write_frame(const T* Sx, const T* Sy)
+	{
+		if (!m_file) return 1;
+		size_t n = static_cast<size_t>(m_header.rows) * m_header.cols;
+		bool is_delta = m_header.codec == static_cast<uint32_t>(CODEC::SHUFFLE_PACKBITS);
+		if (m_header.dtype == static_cast<uint32_t>(DTYPE::FLOAT32)) {
+			pack_slope<float>(Sx, n, is_delta, m_chunk);
+			pack_slope<float>(Sy, n, is_delta, m_chunk);
+		}
+		else {
+			pack_slope<double>(Sx, n, is_delta, m_chunk);
+			pack_slope<double>(Sy, n, is_delta, m_chunk);
+		}
+		m_header.num_frames++;
+		if (++m_chunk_frames == m_header.frames_per_chunk) return flush();
+		return 0;
+	}
+
+	//! Write the last chunk, the index and the final header
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	int close()
+	{
+		if (!m_file) return 0;
+		int error = flush();
+		m_header.num_chunks = static_cast<uint32_t>(m_index.size());
+		m_header.index_offset = m_offset;
+		if (!m_index.empty() && fwrite(m_index.data(), sizeof(ChunkEntry), m_index.size(), m_file) < m_index.size()) error = 1;
+		if (seek_stream(m_file, 0) != 0 || fwrite(&m_header, sizeof(Header), 1, m_file) < 1) error = 1;
+		if (fclose(m_file) != 0) error = 1;
+		m_file = nullptr;
+		if (error) printf("Error writing the archive to disk.\n");
+		return error;
+	}
+
+	bool is_open() const { return m_file != nullptr; }
+
+	//! The bytes written so far, without the buffered chunk
+	uint64_t size() const { return m_offset; }
+
+private:
+	int flush()
+	{
+		if (m_chunk_frames == 0) return 0;
+		ChunkEntry entry;
+		entry.offset = m_offset;
+		entry.raw_size = m_chunk.size();
+		entry.num_frames = m_chunk_frames;
+		entry.codec = static_cast<uint32_t>(CODEC::RAW);
+		const std::vector<uint8_t>* stored = &m_chunk;
+		if (m_header.codec == static_cast<uint32_t>(CODEC::SHUFFLE_PACKBITS)) {
+			shuffle(m_chunk, dtype_size(static_cast<DTYPE>(m_header.dtype)), m_shuffled);
+			pack_bits(m_shuffled, m_packed);
+			if (m_packed.size() < m_chunk.size()) {
+				entry.codec = m_header.codec;
+				stored = &m_packed;
+			}
+		}
+		entry.stored_size = stored->size();
+
+		if (fwrite(stored->data(), 1, stored->size(), m_file) < stored->size()) return 1;
+		m_offset += stored->size();
+		m_index.push_back(entry);
+		m_chunk.clear();
+		m_chunk_frames = 0;
+		return 0;
+	}
+};
+
+//! This is the reader of a slope archive, see CSlopeArchive
+/*!
+* Only the chunk index and the geometry are read by open(), a frame is
+* found by the index and its chunk is decoded once for all its frames.
+*/
+class CSlopeArchiveReader : public CSlopeArchive {
+public:
+	typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+
+private:
+	FILE* m_file;
+	Header m_header;
+	std::vector<ChunkEntry> m_index;
+	Matrix m_X;
+	Matrix m_Y;
+	int64_t m_chunk_id; /*!< the decoded chunk, -1 if none*/
+	std::vector<uint8_t> m_stored;
+	std::vector<uint8_t> m_unpacked;
+	std::vector<uint8_t> m_chunk;
+	std::vector<size_t> m_frame_offsets; /*!< the offsets of the frames in the decoded chunk*/
+
+public:
+	CSlopeArchiveReader()
+		: m_file(nullptr)
+		, m_chunk_id(-1)
+	{
+		memset(&m_header, 0, sizeof(Header));
+	}
+
+	explicit CSlopeArchiveReader(const char* filename)
+		: CSlopeArchiveReader()
+	{
+		open(filename);
+	}
+
+	~CSlopeArchiveReader() { close(); }
+
+	// Disable copying
+	CSlopeArchiveReader(const CSlopeArchiveReader&) = delete;
+	CSlopeArchiveReader& operator=(const CSlopeArchiveReader&) = delete;
+
+	//! Open an archive, closing the previous one
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	int open(const char* filename)
+	{
+		close();
+		fopen_s(&m_file, filename, "rb");
+		if (!m_file)
+		{
+			printf("Can't open input archive file: %s.\n", filename);
+			return 1;
+		}
+
+		if (fread(&m_header, sizeof(Header), 1, m_file) < 1 || memcmp(m_header.magic, "WFRA", 4) != 0 || m_header.version != VERSION
+			|| m_header.dtype > static_cast<uint32_t>(DTYPE::FLOAT64) || m_header.codec > static_cast<uint32_t>(CODEC::SHUFFLE_PACKBITS)
+			|| m_header.rows < 0 || m_header.cols < 0 || m_header.frames_per_chunk == 0)
+		{
+			printf("Error: %s is not a slope archive of version %u, or its byte order is not native.\n", filename, VERSION);
+			close();
+			return 1;
+		}
+
+		// the geometry and the index must fit in the file, the index of an archive which is not closed is still at 0
+		size_t n = static_cast<size_t>(m_header.rows) * m_header.cols;
+		uint64_t geometry_end = sizeof(Header) + 2 * static_cast<uint64_t>(n) * sizeof(double);
+		uint64_t file_size = stream_size(m_file);
+		if (m_header.index_offset < geometry_end || m_header.index_offset > file_size
+			|| m_header.num_chunks > (file_size - m_header.index_offset) / sizeof(ChunkEntry) || seek_stream(m_file, sizeof(Header)) != 0)
+		{
+			printf("Error reading the chunk index from disk file: %s.\n", filename);
+			close();
+			return 1;
+		}
+
+		m_X.resize(m_header.rows, m_header.cols);
+		m_Y.resize(m_header.rows, m_header.cols);
+		m_index.resize(m_header.num_chunks);
+		uint64_t num_frames = 0;
+
+		bool is_read = fread(m_X.data(), sizeof(double), n, m_file) == n && fread(m_Y.data(), sizeof(double), n, m_file) == n
+			&& seek_stream(m_file, m_header.index_offset) == 0
+			&& fread(m_index.data(), sizeof(ChunkEntry), m_index.size(), m_file) == m_index.size();
+		for (const auto& entry : m_index) num_frames += entry.num_frames;
+		if (!is_read || num_frames != m_header.num_frames)
+		{
+			printf("Error reading the chunk index from disk file: %s.\n", filename);
+			close();
+			return 1;
+		}
+		return 0;
+	}
+
+	void close()
+	{
+		if (m_file) fclose(m_file);
+		m_file = nullptr;
+		m_index.clear();
+		m_chunk_id = -1;
+	}
+
+	bool is_open() const { return m_file != nullptr; }
+	int rows() const { return m_header.rows; }
+	int cols() const { return m_header.cols; }
+	int64_t num_frames() const { return static_cast<int64_t>(m_header.num_frames); }
+	DTYPE dtype() const { return static_cast<DTYPE>(m_header.dtype); }
+	const Matrix& X() const { return m_X; }
+	const Matrix& Y() const { return m_Y; }
+
+	//! Read the frame k into rows x cols slopes of any scalar type
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	template <class T>
+	int read_frame(int64_t k, T* Sx, T* Sy)
+	{
+		if (!m_file || k < 0 || k >= num_frames()) return 1;
+
+		// the chunks before k, all full but the last one
+		auto chunk_id = static_cast<int64_t>(k / m_header.frames_per_chunk);
+		auto frame = static_cast<size_t>(k % m_header.frames_per_chunk);
+		if ((chunk_id != m_chunk_id && load_chunk(chunk_id) != 0) || frame >= m_frame_offsets.size())
+		{
+			printf("Error reading the chunk %lld of the archive.\n", static_cast<long long>(chunk_id));
+			return 1;
+		}
+
+		size_t n = static_cast<size_t>(m_header.rows) * m_header.cols;
+		bool is_delta = m_header.codec == static_cast<uint32_t>(CODEC::SHUFFLE_PACKBITS);
+		const uint8_t* p = m_chunk.data() + m_frame_offsets[frame];
+		const uint8_t* end = m_chunk.data() + m_chunk.size();
+		if (dtype() == DTYPE::FLOAT32) {
+			p = unpack_slope<float>(p, end, n, is_delta, Sx);
+			if (p) p = unpack_slope<float>(p, end, n, is_delta, Sy);
+		}
+		else {
+			p = unpack_slope<double>(p, end, n, is_delta, Sx);
+			if (p) p = unpack_slope<double>(p, end, n, is_delta, Sy);
+		}
+		return p ? 0 : 1;
+	}
+
+	//! Read the frames [begin, end) as matrices, e.g. for CWFR::batch() with X() and Y()
+	/*!
+	* \return 0 on success, 1 otherwise
+	*/
+	template <class T>
+	int read_frames(int64_t begin, int64_t end, std::vector<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>& Sx, std::vector<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>& Sy)
+	{
+		end = std::min(end, num_frames());
+		auto count = static_cast<size_t>(std::max<int64_t>(end - begin, 0));
+		Sx.resize(count);
+		Sy.resize(count);
+		for (size_t k = 0; k < count; k++) {
+			Sx[k].resize(m_header.rows, m_header.cols);
+			Sy[k].resize(m_header.rows, m_header.cols);
+			if (read_frame(begin + static_cast<int64_t>(k), Sx[k].data(), Sy[k].data()) != 0) return 1;
+		}
+		return 0;
+	}
+
+private:
+	//! Read and decode a chunk, and find the offsets of its frames
+	int load_chunk(int64_t chunk_id)
+	{
+		m_chunk_id = -1;
+		m_frame_offsets.clear();
+		if (chunk_id >= static_cast<int64_t>(m_index.size())) return 1;
+
+		// only the last chunk may be short
+		const auto& entry = m_index[static_cast<size_t>(chunk_id)];
+		bool is_last = chunk_id + 1 == static_cast<int64_t>(m_index.size());
+		if (entry.num_frames == 0 || entry.num_frames > m_header.frames_per_chunk || (!is_last && entry.num_frames != m_header.frames_per_chunk)) return 1;
+
+		// the chunks lie before the index, and decode to the masks and values of their frames at most
+		size_t n = static_cast<size_t>(m_header.rows) * m_header.cols;
+		uint64_t max_raw_size = 2ull * entry.num_frames * (mask_size(n) + n * dtype_size(dtype()));
+		if (entry.offset > m_header.index_offset || entry.stored_size > m_header.index_offset - entry.offset || entry.raw_size > max_raw_size) return 1;
+		m_stored.resize(static_cast<size_t>(entry.stored_size));
+		if (seek_stream(m_file, entry.offset) != 0 || fread(m_stored.data(), 1, m_stored.size(), m_file) < m_stored.size()) return 1;
+
+		if (entry.codec == static_cast<uint32_t>(CODEC::SHUFFLE_PACKBITS)) {
+			if (unpack_bits(m_stored, static_cast<size_t>(entry.raw_size), m_unpacked) != 0) return 1;
+			unshuffle(m_unpacked, dtype_size(dtype()), m_chunk);
+		}
+		else if (entry.codec == static_cast<uint32_t>(CODEC::RAW)) {
+			m_chunk.swap(m_stored);
+		}
+		else {
+			return 1;
+		}
+
+		// the size of a frame follows from its masks
+		size_t offset = 0;
+		for (uint32_t frame = 0; frame < entry.num_frames; frame++) {
+			m_frame_offsets.push_back(offset);
+			for (int slope = 0; slope < 2; slope++) {
+				if (offset + mask_size(n) > m_chunk.size()) return 1;
+				size_t n_valid = 0;
+				for (size_t b = 0; b < mask_size(n); b++) n_valid += popcount(m_chunk[offset + b]);
+				offset += mask_size(n) + n_valid * dtype_size(dtype());
+			}
+		}
+		if (offset != m_chunk.size()) return 1;
+		m_chunk_id = chunk_id;
+		return 0;
+	}
+
+	static size_t popcount(uint8_t byte)
+	{
+		size_t count = 0;
+		for (; byte; byte &= byte - 1) count++;
+		return count;
+	}
+};
+
 template <class T>
 void print_matrix_in_matlab_format(int rows, int cols, T* U)
 {
@@ -0,0 +1,110 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "common.h"
+#include "wfr_thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+//! Resolve the number of threads, 0 for all the hardware threads
+inline int resolve_num_threads(int num_threads)
+{
+	if (num_threads > 0) return num_threads;
+	return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+//! Run f(chunk_begin, chunk_end) over [begin, end) in chunks of grain ids
+/*!
+* The chunks are handed out dynamically to num_threads threads, including
+* the calling one, so uneven chunks still balance. With one thread, or one
+* chunk only, f is called in place over the whole range.
+* Called from a worker of a CWFRThreadPool, the chunks are pushed to its
+* deque for the idle workers to steal instead of spawning threads, and
+* num_threads is capped at the size of the pool.
+* The first exception of the chunks is rethrown once all of them are done.
+*/
+template <class F>
+void parallel_for(
+	int_t begin, /*!< [in] the first id*/
+	int_t end, /*!< [in] the id after the last one*/
+	int num_threads, /*!< [in] number of threads, 0 for all the hardware threads*/
+	int_t grain, /*!< [in] the number of ids per chunk*/
+	F&& f /*!< [in] the function of a chunk*/
+)
+{
+	grain = std::max<int_t>(grain, 1);
+	auto n_chunks = (end - begin + grain - 1) / grain;
+	num_threads = static_cast<int>(std::min<int_t>(resolve_num_threads(num_threads), n_chunks));
+	auto pool = CWFRThreadPool::current();
+	if (pool) num_threads = std::min(num_threads, pool->size());
+	if (num_threads <= 1) {
+		if (end > begin) f(begin, end);
+		return;
+	}
+
+	if (pool) {
+		// a stolen helper may start after the last chunk is done, so the counters outlive this call
+		struct State {
+			std::atomic<int_t> next_chunk{ 0 };
+			std::atomic<int_t> done_chunks{ 0 };
+			std::mutex mutex;
+			std::condition_variable is_done;
+			std::exception_ptr exception; /*!< the first exception of the chunks, guarded by mutex*/
+		};
+		auto state = std::make_shared<State>();
+		auto helper = [state, begin, end, grain, n_chunks, &f]() {
+			for (int_t chunk = state->next_chunk++; chunk < n_chunks; chunk = state->next_chunk++) {
+				auto chunk_begin = begin + chunk * grain;
+				try {
+					f(chunk_begin, std::min(chunk_begin + grain, end));
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(state->mutex);
+					if (!state->exception) state->exception = std::current_exception();
+				}
+				if (++state->done_chunks == n_chunks) {
+					std::lock_guard<std::mutex> lock(state->mutex);
+					state->is_done.notify_all();
+				}
+			}
+		};
+
+		for (int t = 1; t < num_threads; t++) pool->push_local(helper);
+		helper();
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->is_done.wait(lock, [&] { return state->done_chunks == n_chunks; });
+		if (state->exception) std::rethrow_exception(state->exception);
+		return;
+	}
+
+	std::atomic<int_t> next_chunk(0);
+	std::mutex mutex;
+	std::exception_ptr exception;
+	auto worker = [&]() {
+		for (int_t chunk = next_chunk++; chunk < n_chunks; chunk = next_chunk++) {
+			auto chunk_begin = begin + chunk * grain;
+			try {
+				f(chunk_begin, std::min(chunk_begin + grain, end));
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!exception) exception = std::current_exception();
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads - 1);
+	for (int t = 1; t < num_threads; t++) threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads) thread.join();
+	if (exception) std::rethrow_exception(exception);
+}
+
+
+#endif // !PARALLEL_H
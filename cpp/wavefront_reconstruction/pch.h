@@ -13,10 +13,15 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <Eigen/Sparse>
 #include <Eigen/Dense>
 #include <Eigen/IterativeLinearSolvers>
 #include <Eigen/SparseQR>
+#include <Eigen/SparseCholesky>
 
 
 #endif //PCH_H
@@ -0,0 +1,661 @@
+#include "pch.h"
+#include "framework.h"
+#include "solvers.h"
+#include "assembly.h"
+#include "wfr_operator.h"
+#include "wfr_multigrid.h"
+#include "wfr_poisson.h"
+#include "wfr_thread_pool.h"
+#include "parallel.h"
+
+#include <future>
+
+#ifdef WFR_USE_CHOLMOD
+#include <Eigen/CholmodSupport>
+#endif
+#ifdef EIGEN_USE_MKL_ALL
+#include <Eigen/PardisoSupport>
+#endif
+
+namespace {
+	//! The pinning matrix P with one unit diagonal entry per pinned unknown
+	SparseColMatrixXXd pinning_matrix(int_t n, const std_veci& pins)
+	{
+		TripletListd P_trps;
+		P_trps.reserve(pins.size());
+		for (auto k : pins) P_trps.push_back(Tripletd(k, k, 1));
+
+		SparseColMatrixXXd P(n, n);
+		P.setFromTriplets(P_trps.begin(), P_trps.end());
+		return P;
+	}
+
+	//! Keep the diagonal of a factorization for the in-place solves, none for most
+	template <class Factorization>
+	void cache_diagonal(const Factorization&, VectorXd& diagonal)
+	{
+		diagonal.resize(0);
+	}
+
+	//! The diagonal D of a simplicial LDLT, which vectorD() returns by copy
+	template <int UpLo, class Ordering>
+	void cache_diagonal(const Eigen::SimplicialLDLT<SparseColMatrixXXd, UpLo, Ordering>& factorization, VectorXd& diagonal)
+	{
+		diagonal = factorization.vectorD();
+	}
+
+	//! Solve with a factorization into z
+	template <class Factorization>
+	void solve_factorization(const Factorization& factorization, const VectorXd&, const VectorXd& b, Eigen::Ref<VectorXd> z, VectorXd&)
+	{
+		z = factorization.solve(b);
+	}
+
+	//! Solve with a simplicial LDLT and its cached diagonal into z through the scratch t
+	/*!
+	* These are the steps of SimplicialLDLT::solve(), without the temporaries
+	* of its in-place permutations and of vectorD().
+	*/
+	template <int UpLo, class Ordering>
+	void solve_factorization(const Eigen::SimplicialLDLT<SparseColMatrixXXd, UpLo, Ordering>& factorization, const VectorXd& diagonal, const VectorXd& b, Eigen::Ref<VectorXd> z, VectorXd& t)
+	{
+		if (factorization.permutationP().size() > 0) t = factorization.permutationP() * b;
+		else t = b;
+		factorization.matrixL().solveInPlace(t);
+		t.array() /= diagonal.array();
+		factorization.matrixU().solveInPlace(t);
+		if (factorization.permutationPinv().size() > 0) z = factorization.permutationPinv() * t;
+		else z = t;
+	}
+
+	//! Least-squares conjugate gradient on D
+	/*!
+	* The Jacobi preconditioner is set up per solve, as it only costs one pass
+	* over D, so that a shared backend can solve from many threads at once.
+	*/
+	class LSCGBackend : public CWFRSolver {
+	public:
+		using CWFRSolver::CWFRSolver;
+
+	protected:
+		void do_compute(const CWFRAssembly&, const SparseMatrixXXd&, int, CWFR::SolverReport&) override
+		{
+		}
+
+		void do_solve(const MatrixXd& G, const MatrixXd* Z0, MatrixXd& Z, CWFR::SolverReport& report) const override
+		{
+			Solver lscg;
+			if (m_options.tolerance > 0) lscg.setTolerance(m_options.tolerance);
+			if (m_options.max_iterations > 0) lscg.setMaxIterations(m_options.max_iterations);
+			lscg.compute(*m_D);
+
+			Z.resize(m_D->cols(), G.cols());
+			for (int_t k = 0; k < G.cols(); k++) {
+				if (Z0) {
+					Z.col(k) = lscg.solveWithGuess(G.col(k), Z0->col(k));
+				}
+				else {
+					Z.col(k) = lscg.solve(G.col(k));
+				}
+				report.iterations = std::max<int_t>(report.iterations, lscg.iterations());
+				if (lscg.info() != Eigen::Success) {
+					report.info = lscg.info();
+					report.message = "LSCG did not converge within " + std::to_string(lscg.maxIterations()) + " iterations";
+					return;
+				}
+			}
+		}
+	};
+
+	//! Sparse QR of D augmented with the rows of P
+	class SparseQRBackend : public CWFRSolver {
+	private:
+		SparseColMatrixXXd m_D_pinned;
+		QRSolver m_qr;
+
+	public:
+		using CWFRSolver::CWFRSolver;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int, CWFR::SolverReport& report) override
+		{
+			const auto& pins = assembly.pins();
+			TripletListd D_trps;
+			D_trps.reserve(D.nonZeros() + pins.size());
+			for (int_t row = 0; row < D.outerSize(); row++) {
+				for (SparseMatrixXXd::InnerIterator it(D, row); it; ++it) {
+					D_trps.push_back(Tripletd(it.row(), it.col(), it.value()));
+				}
+			}
+			for (size_t p = 0; p < pins.size(); p++) {
+				D_trps.push_back(Tripletd(D.rows() + p, pins[p], 1));
+			}
+			m_D_pinned.resize(D.rows() + pins.size(), D.cols());
+			m_D_pinned.setFromTriplets(D_trps.begin(), D_trps.end());
+			m_D_pinned.makeCompressed();
+
+			m_qr.compute(m_D_pinned);
+			if (m_qr.info() != Eigen::Success) {
+				report.info = m_qr.info();
+				report.message = "SparseQR factorization failed: " + m_qr.lastErrorMessage();
+			}
+		}
+
+		void do_solve(const MatrixXd& G, const MatrixXd*, MatrixXd& Z, CWFR::SolverReport& report) const override
+		{
+			MatrixXd G_pinned = MatrixXd::Zero(m_D_pinned.rows(), G.cols());
+			G_pinned.topRows(G.rows()) = G;
+			Z = m_qr.solve(G_pinned);
+			if (m_qr.info() != Eigen::Success) {
+				report.info = m_qr.info();
+				report.message = "SparseQR solve failed";
+			}
+		}
+	};
+
+	//! Factorization of the pinned normal equations D^T * D + P
+	/*!
+	* The backends that are not safe to solve concurrently are serialized.
+	*/
+	template <class Factorization, bool IsThreadSafe>
+	class NormalEquationsBackend : public CWFRSolver {
+	private:
+		Factorization m_factorization;
+		VectorXd m_diagonal; /*!< the diagonal of a simplicial LDLT, see cache_diagonal()*/
+		mutable std::mutex m_mutex;
+
+	public:
+		using CWFRSolver::CWFRSolver;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int, CWFR::SolverReport& report) override
+		{
+			SparseColMatrixXXd A = SparseColMatrixXXd(D.transpose() * D) + pinning_matrix(D.cols(), assembly.pins());
+			m_factorization.compute(A);
+			if (m_factorization.info() != Eigen::Success) {
+				report.info = m_factorization.info();
+				report.message = std::string(name(m_options.solver)) + " factorization of the pinned normal equations failed";
+				return;
+			}
+			cache_diagonal(m_factorization, m_diagonal);
+		}
+
+		void do_solve(const MatrixXd& G, const MatrixXd*, MatrixXd& Z, CWFR::SolverReport& report) const override
+		{
+			MatrixXd B = m_D->transpose() * G;
+
+			std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+			if (!IsThreadSafe) lock.lock();
+			Z = m_factorization.solve(B);
+			if (m_factorization.info() != Eigen::Success) {
+				report.info = m_factorization.info();
+				report.message = std::string(name(m_options.solver)) + " solve failed";
+			}
+		}
+
+		bool do_solve_in_place(const Eigen::Ref<const VectorXd>& g, Eigen::Ref<VectorXd> z, CWFR::Workspace& workspace, CWFR::SolverReport& report) const override
+		{
+			workspace.b.noalias() = m_D->transpose() * g;
+
+			std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+			if (!IsThreadSafe) lock.lock();
+			solve_factorization(m_factorization, m_diagonal, workspace.b, z, workspace.t);
+			if (m_factorization.info() != Eigen::Success) {
+				report.info = m_factorization.info();
+				report.message = std::string(name(m_options.solver)) + " solve failed";
+			}
+			return true;
+		}
+	};
+
+	//! Factorization of the pinned normal equations in float, refined in double
+	/*!
+	* The float factor takes half the memory and the bandwidth of the double
+	* one. Its solution is refined against the residual of the pinned normal
+	* equations in double, until the residual is within the tolerance.
+	*/
+	class MixedLDLTBackend : public CWFRSolver {
+	private:
+		LDLTSolverf m_factorization;
+		std_veci m_pins;
+
+	public:
+		using CWFRSolver::CWFRSolver;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int, CWFR::SolverReport& report) override
+		{
+			m_pins = assembly.pins();
+			SparseColMatrixXXd A = SparseColMatrixXXd(D.transpose() * D) + pinning_matrix(D.cols(), m_pins);
+			m_factorization.compute(SparseColMatrixXXf(A.cast<float>()));
+			if (m_factorization.info() != Eigen::Success) {
+				report.info = m_factorization.info();
+				report.message = std::string(name(m_options.solver)) + " factorization of the pinned normal equations failed";
+			}
+		}
+
+		void do_solve(const MatrixXd& G, const MatrixXd* Z0, MatrixXd& Z, CWFR::SolverReport& report) const override
+		{
+			auto tolerance = m_options.tolerance > 0 ? m_options.tolerance : 1e-12;
+			auto max_iterations = m_options.max_iterations > 0 ? m_options.max_iterations : 10;
+
+			MatrixXd B = m_D->transpose() * G;
+			Z = Z0 ? *Z0 : MatrixXd::Zero(B.rows(), B.cols());
+			VectorXd b_norms = B.colwise().norm();
+			for (int_t step = 0; ; step++) {
+				// the residual of (D^T * D + P) * Z = B in double
+				MatrixXd R = B - normal_product(Z);
+				for (auto k : m_pins) R.row(k) -= Z.row(k);
+
+				bool is_converged = true;
+				for (int_t k = 0; k < B.cols(); k++) is_converged &= R.col(k).norm() <= tolerance * b_norms(k);
+				if (is_converged) return;
+				if (step == max_iterations) {
+					report.info = Eigen::NoConvergence;
+					report.message = std::string(name(m_options.solver)) + " did not converge within " + std::to_string(max_iterations) + " refinement steps";
+					return;
+				}
+
+				Z += m_factorization.solve(MatrixXf(R.cast<float>())).cast<double>();
+				report.iterations = step + 1;
+			}
+		}
+	};
+
+	//! The normal equations with the matrix-free D
+	/*!
+	* The rhs D^T * g is consistent with the undetermined pistons, so the
+	* iterations converge on the singular normal equations without pinning.
+	* With many threads, the backend keeps a pool of them for its lifetime and
+	* runs every solve on it, so the parallel_for() of each product and of
+	* each smoothing sweep hands its chunks to the workers of the pool
+	* instead of spawning threads.
+	*/
+	class MatrixFreeBackend : public CWFRSolver {
+	protected:
+		std::unique_ptr<CWFROperator> m_operator;
+		std::unique_ptr<CWFRThreadPool> m_pool;
+
+	public:
+		using CWFRSolver::CWFRSolver;
+
+		bool needs_D() const override { return false; }
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd&, int num_threads, CWFR::SolverReport&) override
+		{
+			m_operator = std::make_unique<CWFROperator>(assembly, num_threads);
+			if (resolve_num_threads(num_threads) > 1) m_pool = std::make_unique<CWFRThreadPool>(num_threads);
+		}
+
+		void run(const std::function<void()>& f) const override
+		{
+			// a worker of any pool already shares its threads with the parallel_for() calls
+			if (!m_pool || CWFRThreadPool::current()) {
+				f();
+				return;
+			}
+
+			std::promise<void> promise;
+			auto is_done = promise.get_future();
+			m_pool->submit([&]() {
+				try {
+					f();
+					promise.set_value();
+				}
+				catch (...) {
+					promise.set_exception(std::current_exception());
+				}
+			}, CWFRThreadPool::PRIORITY::LIVE);
+			is_done.get();
+		}
+
+		MatrixXd normal_rhs(const MatrixXd& G) const override
+		{
+			MatrixXd B(m_operator->cols(), G.cols());
+			for (int_t k = 0; k < G.cols(); k++) m_operator->apply_Dt(G.col(k), B.col(k));
+			return B;
+		}
+
+		MatrixXd normal_product(const MatrixXd& Z) const override
+		{
+			MatrixXd Y = MatrixXd::Zero(Z.rows(), Z.cols());
+			for (int_t k = 0; k < Z.cols(); k++) m_operator->add_DtD(Z.col(k), Y.col(k));
+			return Y;
+		}
+	};
+
+	//! Preconditioned CG of the normal equations with the matrix-free D
+	template <class Preconditioner>
+	class MatrixFreeCGBackend : public MatrixFreeBackend {
+	public:
+		using MatrixFreeBackend::MatrixFreeBackend;
+
+	protected:
+		//! Hand the prepared parts to the preconditioner of a solve
+		virtual void prepare(Preconditioner&) const {}
+
+		void do_solve(const MatrixXd& G, const MatrixXd* Z0, MatrixXd& Z, CWFR::SolverReport& report) const override
+		{
+			Eigen::ConjugateGradient<CWFROperator, Eigen::Lower | Eigen::Upper, Preconditioner> cg;
+			if (m_options.tolerance > 0) cg.setTolerance(m_options.tolerance);
+			if (m_options.max_iterations > 0) cg.setMaxIterations(m_options.max_iterations);
+			prepare(cg.preconditioner());
+			cg.compute(*m_operator);
+
+			Z.resize(m_operator->cols(), G.cols());
+			VectorXd b(m_operator->cols());
+			for (int_t k = 0; k < G.cols(); k++) {
+				m_operator->apply_Dt(G.col(k), b);
+				if (Z0) {
+					Z.col(k) = cg.solveWithGuess(b, Z0->col(k));
+				}
+				else {
+					Z.col(k) = cg.solve(b);
+				}
+				report.iterations = std::max<int_t>(report.iterations, cg.iterations());
+				if (cg.info() != Eigen::Success) {
+					report.info = cg.info();
+					report.message = "CG did not converge within " + std::to_string(cg.maxIterations()) + " iterations";
+					return;
+				}
+			}
+		}
+	};
+
+	//! CG preconditioned by a multigrid V-cycle, with the hierarchy built once
+	class MultigridCGBackend : public MatrixFreeCGBackend<CWFRMultigridPreconditioner> {
+	private:
+		std::shared_ptr<const CWFRMultigrid> m_multigrid;
+
+	public:
+		using MatrixFreeCGBackend::MatrixFreeCGBackend;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int num_threads, CWFR::SolverReport& report) override
+		{
+			MatrixFreeCGBackend::do_compute(assembly, D, num_threads, report);
+			m_multigrid = std::make_shared<const CWFRMultigrid>(*m_operator);
+		}
+
+		void prepare(CWFRMultigridPreconditioner& preconditioner) const override
+		{
+			preconditioner.set_multigrid(m_multigrid);
+		}
+	};
+
+	//! Multigrid V-cycles alone
+	class MultigridBackend : public MatrixFreeBackend {
+	private:
+		std::unique_ptr<CWFRMultigrid> m_multigrid;
+
+	public:
+		using MatrixFreeBackend::MatrixFreeBackend;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int num_threads, CWFR::SolverReport& report) override
+		{
+			MatrixFreeBackend::do_compute(assembly, D, num_threads, report);
+			m_multigrid = std::make_unique<CWFRMultigrid>(*m_operator);
+		}
+
+		void do_solve(const MatrixXd& G, const MatrixXd* Z0, MatrixXd& Z, CWFR::SolverReport& report) const override
+		{
+			auto tolerance = m_options.tolerance > 0 ? m_options.tolerance : 1e-10;
+			auto max_iterations = m_options.max_iterations > 0 ? m_options.max_iterations : 100;
+
+			Z = Z0 ? *Z0 : MatrixXd::Zero(m_operator->cols(), G.cols());
+			VectorXd b(m_operator->cols());
+			for (int_t k = 0; k < G.cols(); k++) {
+				m_operator->apply_Dt(G.col(k), b);
+				auto cycles = m_multigrid->solve(b, Z.col(k), tolerance, max_iterations);
+				if (cycles < 0) {
+					report.iterations = max_iterations;
+					report.info = Eigen::NoConvergence;
+					report.message = "Multigrid did not converge within " + std::to_string(max_iterations) + " V-cycles";
+					return;
+				}
+				report.iterations = std::max<int_t>(report.iterations, cycles);
+			}
+		}
+	};
+
+	//! The exact DCT Poisson solve of a fully valid rectangle
+	class DCTBackend : public MatrixFreeBackend {
+	private:
+		std::unique_ptr<CWFRPoisson> m_poisson;
+
+	public:
+		using MatrixFreeBackend::MatrixFreeBackend;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int num_threads, CWFR::SolverReport& report) override
+		{
+			if (!assembly.is_full_rectangle()) {
+				report.info = Eigen::InvalidInput;
+				report.message = "DCT needs a fully valid rectangular aperture, use DCT_CG for a masked one";
+				return;
+			}
+			MatrixFreeBackend::do_compute(assembly, D, num_threads, report);
+			m_poisson = std::make_unique<CWFRPoisson>(assembly.rows(), assembly.cols(), num_threads);
+		}
+
+		void do_solve(const MatrixXd& G, const MatrixXd*, MatrixXd& Z, CWFR::SolverReport&) const override
+		{
+			Z.resize(m_operator->cols(), G.cols());
+			VectorXd b(m_operator->cols());
+			for (int_t k = 0; k < G.cols(); k++) {
+				m_operator->apply_Dt(G.col(k), b);
+				m_poisson->solve(b, Z.col(k));
+			}
+		}
+	};
+
+	//! CG preconditioned by the DCT Poisson solve of the bounding rectangle
+	class DCTCGBackend : public MatrixFreeCGBackend<CWFRPoissonPreconditioner> {
+	private:
+		std::shared_ptr<const CWFRPoisson> m_poisson;
+
+	public:
+		using MatrixFreeCGBackend::MatrixFreeCGBackend;
+
+	protected:
+		void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int num_threads, CWFR::SolverReport& report) override
+		{
+			MatrixFreeCGBackend::do_compute(assembly, D, num_threads, report);
+			m_poisson = std::make_shared<const CWFRPoisson>(assembly.rows(), assembly.cols(), num_threads);
+		}
+
+		void prepare(CWFRPoissonPreconditioner& preconditioner) const override
+		{
+			preconditioner.set_poisson(m_poisson);
+		}
+	};
+
+	//! A backend which is not compiled in
+	class UnavailableBackend : public CWFRSolver {
+	private:
+		const char* m_flag;
+
+	public:
+		UnavailableBackend(const CWFR::SolverOptions& options, const char* flag)
+			: CWFRSolver(options)
+			, m_flag(flag)
+		{
+		}
+
+	protected:
+		void do_compute(const CWFRAssembly&, const SparseMatrixXXd&, int, CWFR::SolverReport& report) override
+		{
+			report.info = Eigen::InvalidInput;
+			report.message = std::string(name(m_options.solver)) + " is not available in this build, define " + m_flag;
+		}
+
+		void do_solve(const MatrixXd&, const MatrixXd*, MatrixXd&, CWFR::SolverReport&) const override
+		{
+		}
+	};
+}
+
+CWFRSolver::CWFRSolver(const CWFR::SolverOptions& options)
+	: m_options(options)
+	, m_assembly(nullptr)
+	, m_D(nullptr)
+{
+	m_compute_report.solver = options.solver;
+}
+
+CWFRSolver::~CWFRSolver()
+{
+}
+
+std::unique_ptr<CWFRSolver> CWFRSolver::create(const CWFR::SolverOptions& options_in, const CWFRAssembly& assembly, bool is_reused)
+{
+	// a fully valid rectangle is solved exactly by the DCT, otherwise a
+	// factorization pays off when many frames share it
+	auto options = options_in;
+	if (options.solver == CWFR::WFR_SOLVER::AUTO) {
+		if (assembly.is_full_rectangle()) options.solver = CWFR::WFR_SOLVER::DCT;
+		else options.solver = is_reused ? CWFR::WFR_SOLVER::SIMPLICIAL_LDLT : CWFR::WFR_SOLVER::LSCG;
+	}
+
+	switch (options.solver)
+	{
+	case CWFR::WFR_SOLVER::SPARSE_QR:
+		return std::make_unique<SparseQRBackend>(options);
+	case CWFR::WFR_SOLVER::SIMPLICIAL_LDLT:
+		// the nested dissection of the unknowns is the elimination order itself
+		if (assembly.ordering() == CWFR::WFR_ORDERING::NESTED_DISSECTION) return std::make_unique<NormalEquationsBackend<LDLTSolverNatural, true>>(options);
+		return std::make_unique<NormalEquationsBackend<LDLTSolver, true>>(options);
+	case CWFR::WFR_SOLVER::CHOLMOD:
+#ifdef WFR_USE_CHOLMOD
+		return std::make_unique<NormalEquationsBackend<Eigen::CholmodSupernodalLLT<SparseColMatrixXXd>, false>>(options);
+#else
+		return std::make_unique<UnavailableBackend>(options, "WFR_USE_CHOLMOD");
+#endif
+	case CWFR::WFR_SOLVER::PARDISO:
+#ifdef EIGEN_USE_MKL_ALL
+		return std::make_unique<NormalEquationsBackend<Eigen::PardisoLDLT<SparseColMatrixXXd>, false>>(options);
+#else
+		return std::make_unique<UnavailableBackend>(options, "EIGEN_USE_MKL_ALL");
+#endif
+	case CWFR::WFR_SOLVER::MATRIX_FREE_CG:
+		return std::make_unique<MatrixFreeCGBackend<CWFRJacobiPreconditioner>>(options);
+	case CWFR::WFR_SOLVER::MULTIGRID:
+		return std::make_unique<MultigridBackend>(options);
+	case CWFR::WFR_SOLVER::MULTIGRID_CG:
+		return std::make_unique<MultigridCGBackend>(options);
+	case CWFR::WFR_SOLVER::DCT:
+		return std::make_unique<DCTBackend>(options);
+	case CWFR::WFR_SOLVER::DCT_CG:
+		return std::make_unique<DCTCGBackend>(options);
+	case CWFR::WFR_SOLVER::MIXED_LDLT:
+		return std::make_unique<MixedLDLTBackend>(options);
+	case CWFR::WFR_SOLVER::LSCG:
+	case CWFR::WFR_SOLVER::AUTO:
+	default:
+		return std::make_unique<LSCGBackend>(options);
+	}
+}
+
+bool CWFRSolver::compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int num_threads)
+{
+	m_assembly = &assembly;
+	m_D = &D;
+	m_compute_report = CWFR::SolverReport();
+	m_compute_report.solver = m_options.solver;
+	do_compute(assembly, D, num_threads, m_compute_report);
+	return m_compute_report.success();
+}
+
+bool CWFRSolver::solve(const MatrixXd& G, MatrixXd& Z, CWFR::SolverReport& report, const MatrixXd* Z0) const
+{
+	report = m_compute_report;
+	if (!report.success()) return false;
+
+	if (Z0 && (Z0->rows() != m_assembly->num_unknowns() || Z0->cols() != G.cols())) Z0 = nullptr;
+	run([&]() {
+		do_solve(G, Z0, Z, report);
+		if (!report.success()) return;
+
+		// the relative residual of the normal equations, the worst of the columns
+		MatrixXd B = normal_rhs(G);
+		MatrixXd R = B - normal_product(Z);
+		for (int_t k = 0; k < G.cols(); k++) {
+			auto b_norm = B.col(k).norm();
+			auto r_norm = R.col(k).norm();
+			report.residual = std::max(report.residual, b_norm > 0 ? r_norm / b_norm : r_norm);
+		}
+	});
+	return report.success();
+}
+
+bool CWFRSolver::solve(const Eigen::Ref<const VectorXd>& g, Eigen::Ref<VectorXd> z, CWFR::Workspace& workspace, CWFR::SolverReport& report, const VectorXd* z0) const
+{
+	report = m_compute_report;
+	if (!report.success()) return false;
+
+	// the buffers keep their memory while the sizes do not change
+	workspace.b.resize(z.size());
+	workspace.t.resize(z.size());
+	workspace.r.resize(g.size());
+	if (!do_solve_in_place(g, z, workspace, report)) {
+		MatrixXd Z;
+		MatrixXd Z0 = z0 ? MatrixXd(*z0) : MatrixXd();
+		if (!solve(MatrixXd(g), Z, report, z0 ? &Z0 : nullptr)) return false;
+		z = Z.col(0);
+		return true;
+	}
+	if (!report.success()) return false;
+
+	// the relative residual of the normal equations, D is there for every in-place backend
+	workspace.r.noalias() = *m_D * z;
+	workspace.t.noalias() = m_D->transpose() * workspace.r;
+	workspace.t = workspace.b - workspace.t;
+	auto b_norm = workspace.b.norm();
+	auto r_norm = workspace.t.norm();
+	report.residual = b_norm > 0 ? r_norm / b_norm : r_norm;
+	return true;
+}
+
+MatrixXd CWFRSolver::normal_rhs(const MatrixXd& G) const
+{
+	return m_D->transpose() * G;
+}
+
+MatrixXd CWFRSolver::normal_product(const MatrixXd& Z) const
+{
+	return m_D->transpose() * (*m_D * Z);
+}
+
+const char* CWFRSolver::name(CWFR::WFR_SOLVER solver)
+{
+	switch (solver)
+	{
+	case CWFR::WFR_SOLVER::SPARSE_QR:
+		return "SparseQR";
+	case CWFR::WFR_SOLVER::SIMPLICIAL_LDLT:
+		return "SimplicialLDLT";
+	case CWFR::WFR_SOLVER::CHOLMOD:
+		return "CHOLMOD";
+	case CWFR::WFR_SOLVER::PARDISO:
+		return "Pardiso";
+	case CWFR::WFR_SOLVER::MATRIX_FREE_CG:
+		return "MatrixFreeCG";
+	case CWFR::WFR_SOLVER::MULTIGRID:
+		return "Multigrid";
+	case CWFR::WFR_SOLVER::MULTIGRID_CG:
+		return "MultigridCG";
+	case CWFR::WFR_SOLVER::DCT:
+		return "DCT";
+	case CWFR::WFR_SOLVER::DCT_CG:
+		return "DCTCG";
+	case CWFR::WFR_SOLVER::MIXED_LDLT:
+		return "MixedLDLT";
+	case CWFR::WFR_SOLVER::AUTO:
+		return "Auto";
+	case CWFR::WFR_SOLVER::LSCG:
+	default:
+		return "LSCG";
+	}
+}
@@ -0,0 +1,120 @@
+#ifndef SOLVERS_H
+#define SOLVERS_H
+
+#include "common.h"
+#include "cwfr.h"
+
+class CWFRAssembly;
+
+//! This is the interface of the solver backends of D * z = g
+/*!
+* A backend is prepared once per matrix D by compute(), which factorizes or
+* preconditions, and then solves any number of rhs vectors stacked as the
+* columns of G. The direct backends work on the normal equations
+*					(D^T * D + P) * z = D^T * g
+* or on D augmented with the rows of P, where P pins the first unknown of
+* every connected aperture to remove the undetermined pistons. Whatever the
+* backend, the solution is shifted to a zero mean per connected aperture by
+* the caller, so all the backends share the same piston convention.
+* The iterative backends can start from an initial guess, e.g. the result
+* of the previous frame, which the direct backends ignore.
+* The matrix-free backend applies D straight from the assembly, so D is not
+* built at all for it, see needs_D(). A fully valid rectangle is solved
+* exactly by the DCT, which WFR_SOLVER::AUTO picks from the assembly.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRSolver {
+protected:
+	CWFR::SolverOptions m_options;
+	const CWFRAssembly* m_assembly;
+	const SparseMatrixXXd* m_D;
+	CWFR::SolverReport m_compute_report; /*!< the result of compute()*/
+
+public:
+	explicit CWFRSolver(const CWFR::SolverOptions& options);
+	virtual ~CWFRSolver();
+
+	// Disable copying
+	CWFRSolver(const CWFRSolver&) = delete;
+	CWFRSolver& operator=(const CWFRSolver&) = delete;
+
+	//! Create the backend of the options
+	/*!
+	* \return the backend, which reports a failure if it is not available in this build
+	*/
+	static std::unique_ptr<CWFRSolver> create(
+		const CWFR::SolverOptions& options, /*!< [in] the backend and its parameters*/
+		const CWFRAssembly& assembly, /*!< [in] the scanned validity masks, which resolves WFR_SOLVER::AUTO*/
+		bool is_reused = false /*!< [in] true if many frames share the backend, which resolves WFR_SOLVER::AUTO*/
+	);
+
+	//! Factorize or precondition D
+	/*!
+	* The assembly and D have to outlive the backend.
+	* \return false if the preparation failed, see compute_report()
+	*/
+	bool compute(
+		const CWFRAssembly& assembly, /*!< [in] the scanned validity masks*/
+		const SparseMatrixXXd& D, /*!< [in] the matrix D, empty if needs_D() is false*/
+		int num_threads = 1 /*!< [in] number of threads of the matrix-free backend*/
+	);
+
+	//! Check if the backend needs the compressed matrix D
+	virtual bool needs_D() const { return true; }
+
+	//! Solve D * Z = G in the least-squares sense, one column per rhs vector
+	/*!
+	* \return false if the solve failed, see the report
+	*/
+	bool solve(
+		const MatrixXd& G, /*!< [in] the rhs vectors*/
+		MatrixXd& Z, /*!< [out] the unknowns*/
+		CWFR::SolverReport& report, /*!< [out] the iterations, the residual and the failure reason*/
+		const MatrixXd* Z0 = nullptr /*!< [in] the initial guess of an iterative backend, nullptr to start from zero*/
+	) const;
+
+	//! Solve D * z = g for one rhs vector with the buffers of a workspace
+	/*!
+	* The direct backends of the normal equations solve in place, so once
+	* the workspace is sized by a previous solve of this backend, they do not
+	* allocate any heap memory. The other backends go through solve().
+	* \return false if the solve failed, see the report
+	*/
+	bool solve(
+		const Eigen::Ref<const VectorXd>& g, /*!< [in] the rhs vector*/
+		Eigen::Ref<VectorXd> z, /*!< [out] the unknowns*/
+		CWFR::Workspace& workspace, /*!< [in,out] the buffers of the solve*/
+		CWFR::SolverReport& report, /*!< [out] the iterations, the residual and the failure reason*/
+		const VectorXd* z0 = nullptr /*!< [in] the initial guess of an iterative backend, nullptr to start from zero*/
+	) const;
+
+	const CWFR::SolverOptions& options() const { return m_options; }
+	const CWFR::SolverReport& compute_report() const { return m_compute_report; }
+
+	//! The name of a backend
+	static const char* name(CWFR::WFR_SOLVER solver);
+
+protected:
+	//! Prepare the backend, and set the info and the failure reason of the report
+	virtual void do_compute(const CWFRAssembly& assembly, const SparseMatrixXXd& D, int num_threads, CWFR::SolverReport& report) = 0;
+
+	//! Solve with the prepared backend, and set the info, the iterations and the failure reason of the report
+	virtual void do_solve(const MatrixXd& G, const MatrixXd* Z0, MatrixXd& Z, CWFR::SolverReport& report) const = 0;
+
+	//! Solve one rhs vector in place, with workspace.b = D^T * g and the scratch workspace.t of the size of z
+	/*!
+	* \return false if the backend has no in-place solve
+	*/
+	virtual bool do_solve_in_place(const Eigen::Ref<const VectorXd>&, Eigen::Ref<VectorXd>, CWFR::Workspace&, CWFR::SolverReport&) const { return false; }
+
+	//! D^T * G, for the residual
+	virtual MatrixXd normal_rhs(const MatrixXd& G) const;
+
+	//! D^T * D * Z, for the residual
+	virtual MatrixXd normal_product(const MatrixXd& Z) const;
+
+	//! Run a solve on the threads of the backend, in place by default
+	virtual void run(const std::function<void()>& f) const { f(); }
+};
+
+
+#endif // !SOLVERS_H
@@ -0,0 +1,192 @@
+#ifndef STENCILS_H
+#define STENCILS_H
+
+#include "common.h"
+
+//! The integration stencils of the TFLI, HFLI and SLI methods
+/*!
+* Each stencil integrates the slopes S over the segments of one grid row
+* with the coordinates P, where (S, P) is either (Sx, X) or (Sy, Y). The
+* HFLI method uses the slopes along the segment only, while the HFLIQ method
+* sums the contributions of both pairs, and so do TFLI and TFLIQ with the
+* 3rd-order stencil only.
+* The 3rd-order stencil uses the trapezoidal rule, and the 5th-order one
+* uses the two outer neighbours as well. A whole row is evaluated at once
+* as Eigen array expressions, which are vectorized with the SIMD packets of
+* the target, so the NaN segments are computed too and the caller selects
+* the valid ones by their stencil classes. The slopes can be of any scalar
+* type, e.g. the float of a sensor, and are promoted to double row by row.
+* The spacings of the segments come from a Spacing policy, either read from
+* the coordinates, or the constants of a uniform grid, so the kernel of a
+* uniform grid does not touch the coordinates at all.
+*/
+
+//! The spacings of the segments, read from the coordinates P
+struct CoordinateSpacing {
+	const MatrixViewd& P;
+
+	explicit CoordinateSpacing(const MatrixViewd& P) : P(P) {}
+
+	//! The spacings of the (i, j)-(i, j+1) segments, j = begin, ..., begin + n - 1
+	auto x(int_t i, int_t begin, int_t n) const { return P.row(i).array().segment(begin + 1, n) - P.row(i).array().segment(begin, n); }
+
+	//! The spacings of the (i, j)-(i+1, j) segments, j = 0, ..., n - 1
+	auto y(int_t i, int_t n) const { return P.row(i + 1).array().head(n) - P.row(i).array().head(n); }
+};
+
+//! The constant spacings of the coordinates P of an affine grid, P(i, j) = P(0, 0) + j * along_x + i * along_y
+struct UniformSpacing {
+	double along_x;
+	double along_y;
+
+	double x(int_t, int_t, int_t) const { return along_x; }
+	double y(int_t, int_t) const { return along_y; }
+
+	//! Detect an affine grid, up to the rounding of its coordinates
+	/*!
+	* \return true if P is affine, with its spacings in spacing
+	*/
+	static bool detect(const MatrixViewd& P, UniformSpacing& spacing)
+	{
+		auto rows = P.rows(), cols = P.cols();
+		if (rows < 2 || cols < 2) return false;
+		spacing.along_x = (P(0, cols - 1) - P(0, 0)) / (cols - 1);
+		spacing.along_y = (P(rows - 1, 0) - P(0, 0)) / (rows - 1);
+		auto tolerance = 1e-12 * (std::abs(P(0, 0)) + std::abs(spacing.along_x) * cols + std::abs(spacing.along_y) * rows);
+		for (int_t i = 0; i < rows; i++) {
+			for (int_t j = 0; j < cols; j++) {
+				if (!(std::abs(P(i, j) - P(0, 0) - j * spacing.along_x - i * spacing.along_y) <= tolerance)) return false;
+			}
+		}
+		return true;
+	}
+};
+
+//! 3rd order along x
+/*
+* g(j) is the integrated value for the (i, j)-(i, j+1) segment, j = 0, ..., cols - 2
+*/
+template <class SlopeView, class Spacing>
+inline void stencil_3rd_order_x(
+	const SlopeView& S, /*!< [in] slopes of any scalar type*/
+	const Spacing& h, /*!< [in] the spacings of the coordinates*/
+	const int_t& i, /*!< [in] the id in y-axis*/
+	Eigen::Ref<ArrayXd> g /*!< [out] the integrated values of the row*/
+)
+{
+	auto n = S.cols() - 1;
+	if (n <= 0) return;
+	auto s = S.row(i).array().template cast<double>();
+	g.head(n) = (s.head(n) + s.tail(n)) * h.x(i, 0, n) * 0.5;
+}
+
+//! 5th order along x
+/*
+* g(j) is the integrated value for the (i, j)-(i, j+1) segment, j = 1, ..., cols - 3
+*/
+template <class SlopeView, class Spacing>
+inline void stencil_5th_order_x(
+	const SlopeView& S, /*!< [in] slopes of any scalar type*/
+	const Spacing& h, /*!< [in] the spacings of the coordinates*/
+	const int_t& i, /*!< [in] the id in y-axis*/
+	Eigen::Ref<ArrayXd> g /*!< [out] the integrated values of the row*/
+)
+{
+	auto n = S.cols() - 3;
+	if (n <= 0) return;
+	auto s = S.row(i).array().template cast<double>();
+	g.segment(1, n) = (-1.0 / 13.0 * s.head(n) + s.segment(1, n) + s.segment(2, n) - 1.0 / 13.0 * s.tail(n)) * h.x(i, 1, n) * (13.0 / 24.0);
+}
+
+//! 3rd order along y
+/*
+* g(j) is the integrated value for the (i, j)-(i+1, j) segment, i = 0, ..., rows - 2
+*/
+template <class SlopeView, class Spacing>
+inline void stencil_3rd_order_y(
+	const SlopeView& S, /*!< [in] slopes of any scalar type*/
+	const Spacing& h, /*!< [in] the spacings of the coordinates*/
+	const int_t& i, /*!< [in] the id in y-axis*/
+	Eigen::Ref<ArrayXd> g /*!< [out] the integrated values of the row*/
+)
+{
+	if (i + 1 >= S.rows()) return;
+	g.head(S.cols()) = (S.row(i).array().template cast<double>() + S.row(i + 1).array().template cast<double>()) * h.y(i, S.cols()) * 0.5;
+}
+
+//! 5th order along y
+/*
+* g(j) is the integrated value for the (i, j)-(i+1, j) segment, i = 1, ..., rows - 3
+*/
+template <class SlopeView, class Spacing>
+inline void stencil_5th_order_y(
+	const SlopeView& S, /*!< [in] slopes of any scalar type*/
+	const Spacing& h, /*!< [in] the spacings of the coordinates*/
+	const int_t& i, /*!< [in] the id in y-axis*/
+	Eigen::Ref<ArrayXd> g /*!< [out] the integrated values of the row*/
+)
+{
+	if (i < 1 || i + 2 >= S.rows()) return;
+	g.head(S.cols()) = (-1.0 / 13.0 * S.row(i - 1).array().template cast<double>() + S.row(i).array().template cast<double>() + S.row(i + 1).array().template cast<double>() - 1.0 / 13.0 * S.row(i + 2).array().template cast<double>()) * h.y(i, S.cols()) * (13.0 / 24.0);
+}
+
+//! The integrals of the not-a-knot cubic spline of a run of slopes
+/*
+* g(k) is the integral of the spline through (p(k), s(k)), k = 0, ..., n - 1,
+* over the segment (p(k), p(k+1)), k = 0, ..., n - 2, as spline() of sli2.m.
+* The second derivatives M of the spline solve the tridiagonal system of the
+* interior points, with the not-a-knot ends eliminated into its first and
+* last rows, and then
+*		g(k) = h(k) * (s(k) + s(k+1)) / 2 - h(k)^3 * (M(k) + M(k+1)) / 24
+* with h(k) = p(k+1) - p(k), which holds for decreasing coordinates as well.
+* A run of less than 4 points is left alone, as sli2.m keeps the Southwell
+* stencils there. work holds 3 * n values at least.
+*/
+inline void spline_integrals(
+	int_t n, /*!< [in] the points of the run*/
+	const double* p, /*!< [in] the n coordinates*/
+	const double* s, /*!< [in] the n slopes*/
+	double* work, /*!< [in] the scratch of 3 * n values*/
+	double* g /*!< [out] the n - 1 integrated values*/
+)
+{
+	if (n < 4) return;
+	auto* h = work;
+	auto* c = work + n; /*!< the eliminated super diagonal*/
+	auto* m = work + 2 * n; /*!< the rhs, then the second derivatives*/
+	for (int_t k = 0; k + 1 < n; k++) h[k] = p[k + 1] - p[k];
+
+	// the rows k = 1, ..., n - 2 of the interior points, solved by the Thomas algorithm
+	for (int_t k = 1; k + 1 < n; k++) {
+		auto sub = h[k - 1], diag = 2 * (h[k - 1] + h[k]), super = h[k];
+		m[k] = 6 * ((s[k + 1] - s[k]) / h[k] - (s[k] - s[k - 1]) / h[k - 1]);
+		if (k == 1) {
+			// M(0) = ((h(0) + h(1)) * M(1) - h(0) * M(2)) / h(1)
+			diag += h[0] * (h[0] + h[1]) / h[1];
+			super -= h[0] * h[0] / h[1];
+			sub = 0;
+		}
+		if (k == n - 2) {
+			// M(n-1) = ((h(n-3) + h(n-2)) * M(n-2) - h(n-2) * M(n-3)) / h(n-3)
+			diag += h[n - 2] * (h[n - 3] + h[n - 2]) / h[n - 3];
+			if (k > 1) sub -= h[n - 2] * h[n - 2] / h[n - 3];
+			super = 0;
+		}
+		if (k > 1) {
+			diag -= sub * c[k - 1];
+			m[k] -= sub * m[k - 1];
+		}
+		c[k] = super / diag;
+		m[k] /= diag;
+	}
+	for (int_t k = n - 3; k >= 1; k--) m[k] -= c[k] * m[k + 1];
+	m[0] = ((h[0] + h[1]) * m[1] - h[0] * m[2]) / h[1];
+	m[n - 1] = ((h[n - 3] + h[n - 2]) * m[n - 2] - h[n - 2] * m[n - 3]) / h[n - 3];
+
+	for (int_t k = 0; k + 1 < n; k++) {
+		g[k] = h[k] * (s[k] + s[k + 1]) * 0.5 - h[k] * h[k] * h[k] * (m[k] + m[k + 1]) / 24;
+	}
+}
+
+
+#endif // !STENCILS_H
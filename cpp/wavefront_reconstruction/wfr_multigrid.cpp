@@ -0,0 +1,240 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_multigrid.h"
+#include "parallel.h"
+
+
+CWFRMultigrid::CWFRMultigrid(const CWFROperator& op, int_t coarsest_size, int num_smooth, double omega, double over_correction)
+	: m_operator(&op)
+	, m_num_smooth(num_smooth)
+	, m_omega(omega)
+	, m_over_correction(over_correction)
+{
+	// the finest level is the assembly itself
+	Level finest;
+	finest.ids = op.assembly().ids();
+	finest.num_unknowns = op.assembly().num_unknowns();
+	finest.inv_diag = op.diagonal();
+	finest.inv_diag = (finest.inv_diag.array() > 0).select(finest.inv_diag.cwiseInverse(), 1);
+	m_levels.push_back(std::move(finest));
+
+	// coarsen until the coarsest level is small enough, or does not shrink any more
+	while (m_levels.back().num_unknowns > coarsest_size) {
+		auto n = m_levels.back().num_unknowns;
+		coarsen();
+		if (m_levels.back().num_unknowns == n) {
+			m_levels.pop_back();
+			break;
+		}
+	}
+
+	// factorize the coarsest level with one pinned unknown per connected aperture
+	auto l = num_levels() - 1;
+	const auto& ids = m_levels[l].ids;
+	auto n = m_levels[l].num_unknowns;
+	TripletListd A_trps;
+	std_veci parent(n);
+	for (int_t k = 0; k < n; k++) parent[k] = k;
+	auto find = [&parent](int_t k) {
+		while (parent[k] != k) k = parent[k] = parent[parent[k]];
+		return k;
+	};
+	auto link = [&](int_t a, int_t b, double w) {
+		if (w == 0) return;
+		A_trps.push_back(Tripletd(a, a, w));
+		A_trps.push_back(Tripletd(b, b, w));
+		A_trps.push_back(Tripletd(a, b, -w));
+		A_trps.push_back(Tripletd(b, a, -w));
+		a = find(a);
+		b = find(b);
+		if (a != b) parent[std::max(a, b)] = std::min(a, b);
+	};
+	for (int_t i = 0; i < ids.rows(); i++) {
+		for (int_t j = 0; j < ids.cols(); j++) {
+			if (j + 1 < ids.cols()) link(ids(i, j), ids(i, j + 1), weight_x(l, i, j));
+			if (i + 1 < ids.rows()) link(ids(i, j), ids(i + 1, j), weight_y(l, i, j));
+		}
+	}
+	for (int_t k = 0; k < n; k++) {
+		if (find(k) == k) A_trps.push_back(Tripletd(k, k, 1));
+	}
+
+	SparseColMatrixXXd A(n, n);
+	A.setFromTriplets(A_trps.begin(), A_trps.end());
+	m_coarsest.compute(A);
+}
+
+CWFRMultigrid::~CWFRMultigrid()
+{
+}
+
+void CWFRMultigrid::coarsen()
+{
+	auto l = num_levels() - 1;
+	auto& fine = m_levels[l];
+	auto rows = fine.ids.rows();
+	auto cols = fine.ids.cols();
+
+	// a coarse unknown for every 2 x 2 block with a valid unknown
+	Level coarse;
+	auto coarse_rows = (rows + 1) / 2;
+	auto coarse_cols = (cols + 1) / 2;
+	coarse.ids = MatrixXXi::Constant(coarse_rows, coarse_cols, -1);
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			if (fine.ids(i, j) >= 0) coarse.ids(i / 2, j / 2) = 0;
+		}
+	}
+	int32_t current_id = 0;
+	for (int_t id = 0; id < coarse.ids.size(); id++) {
+		if (coarse.ids.data()[id] >= 0) coarse.ids.data()[id] = current_id++;
+	}
+	coarse.num_unknowns = current_id;
+
+	fine.coarse.assign(fine.num_unknowns, -1);
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			auto k = fine.ids(i, j);
+			if (k >= 0) fine.coarse[k] = coarse.ids(i / 2, j / 2);
+		}
+	}
+
+	// the Galerkin weights sum the fine segments crossing between the blocks,
+	// while the segments inside a block cancel out
+	coarse.wx = MatrixXXd::Zero(coarse_rows, coarse_cols);
+	coarse.wy = MatrixXXd::Zero(coarse_rows, coarse_cols);
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 1; j + 1 < cols; j += 2) {
+			coarse.wx(i / 2, j / 2) += weight_x(l, i, j);
+		}
+	}
+	for (int_t i = 1; i + 1 < rows; i += 2) {
+		for (int_t j = 0; j < cols; j++) {
+			coarse.wy(i / 2, j / 2) += weight_y(l, i, j);
+		}
+	}
+
+	// the diagonal is the sum of the weights around each unknown
+	VectorXd diag = VectorXd::Zero(coarse.num_unknowns);
+	for (int_t i = 0; i < coarse_rows; i++) {
+		for (int_t j = 0; j < coarse_cols; j++) {
+			if (coarse.wx(i, j) > 0) {
+				diag(coarse.ids(i, j)) += coarse.wx(i, j);
+				diag(coarse.ids(i, j + 1)) += coarse.wx(i, j);
+			}
+			if (coarse.wy(i, j) > 0) {
+				diag(coarse.ids(i, j)) += coarse.wy(i, j);
+				diag(coarse.ids(i + 1, j)) += coarse.wy(i, j);
+			}
+		}
+	}
+	coarse.inv_diag = (diag.array() > 0).select(diag.cwiseInverse(), 1);
+
+	m_levels.push_back(std::move(coarse));
+}
+
+double CWFRMultigrid::weight_x(int_t l, int_t i, int_t j) const
+{
+	if (l > 0) return m_levels[l].wx(i, j);
+	return m_operator->assembly().class_x()(i, j) != CWFRAssembly::NONE ? 1 : 0;
+}
+
+double CWFRMultigrid::weight_y(int_t l, int_t i, int_t j) const
+{
+	if (l > 0) return m_levels[l].wy(i, j);
+	return m_operator->assembly().class_y()(i, j) != CWFRAssembly::NONE ? 1 : 0;
+}
+
+void CWFRMultigrid::apply(int_t l, const VectorXd& x, VectorXd& y) const
+{
+	y.setZero(x.size());
+	if (l == 0) {
+		m_operator->add_DtD(x, y);
+		return;
+	}
+
+	// the weighted differences to the linked neighbours
+	const auto& level = m_levels[l];
+	const auto& ids = level.ids;
+	const auto& wx = level.wx;
+	const auto& wy = level.wy;
+	auto rows = ids.rows();
+	auto cols = ids.cols();
+	parallel_for(0, rows, m_operator->num_threads(), 16, [&](int_t begin, int_t end) {
+		for (int_t i = begin; i < end; i++) {
+			for (int_t j = 0; j < cols; j++) {
+				auto k = ids(i, j);
+				if (k < 0) continue;
+
+				double xk = x(k);
+				double v = 0;
+				if (j > 0 && wx(i, j - 1) > 0) v += wx(i, j - 1) * (xk - x(ids(i, j - 1)));
+				if (wx(i, j) > 0) v += wx(i, j) * (xk - x(ids(i, j + 1)));
+				if (i > 0 && wy(i - 1, j) > 0) v += wy(i - 1, j) * (xk - x(ids(i - 1, j)));
+				if (wy(i, j) > 0) v += wy(i, j) * (xk - x(ids(i + 1, j)));
+				y(k) = v;
+			}
+		}
+	});
+}
+
+void CWFRMultigrid::cycle(int_t l, const VectorXd& b, VectorXd& x) const
+{
+	const auto& level = m_levels[l];
+	if (l == num_levels() - 1) {
+		x = m_coarsest.solve(b);
+		return;
+	}
+
+	// pre-smoothing from zero
+	VectorXd Ax(level.num_unknowns);
+	x = m_omega * level.inv_diag.cwiseProduct(b);
+	for (int s = 1; s < m_num_smooth; s++) {
+		apply(l, x, Ax);
+		x += m_omega * level.inv_diag.cwiseProduct(b - Ax);
+	}
+
+	// restrict the residual, and correct with the scaled coarse solution
+	apply(l, x, Ax);
+	VectorXd r = b - Ax;
+	const auto& coarse = m_levels[l + 1];
+	VectorXd b_coarse = VectorXd::Zero(coarse.num_unknowns);
+	for (int_t k = 0; k < level.num_unknowns; k++) b_coarse(level.coarse[k]) += r(k);
+
+	VectorXd x_coarse;
+	cycle(l + 1, b_coarse, x_coarse);
+	for (int_t k = 0; k < level.num_unknowns; k++) x(k) += m_over_correction * x_coarse(level.coarse[k]);
+
+	// post-smoothing
+	for (int s = 0; s < m_num_smooth; s++) {
+		apply(l, x, Ax);
+		x += m_omega * level.inv_diag.cwiseProduct(b - Ax);
+	}
+}
+
+void CWFRMultigrid::vcycle(const Eigen::Ref<const VectorXd>& b, Eigen::Ref<VectorXd> x) const
+{
+	VectorXd y;
+	cycle(0, b, y);
+	x = y;
+}
+
+int_t CWFRMultigrid::solve(const Eigen::Ref<const VectorXd>& b, Eigen::Ref<VectorXd> x, double tolerance, int_t max_iterations, double* residual) const
+{
+	auto b_norm = b.norm();
+	if (b_norm == 0) b_norm = 1;
+
+	VectorXd Ax(b.size());
+	VectorXd e(b.size());
+	for (int_t it = 0; ; it++) {
+		apply(0, x, Ax);
+		VectorXd r = b - Ax;
+		auto r_norm = r.norm() / b_norm;
+		if (residual) *residual = r_norm;
+		if (r_norm <= tolerance) return it;
+		if (it == max_iterations) return -1;
+
+		vcycle(r, e);
+		x += e;
+	}
+}
@@ -0,0 +1,147 @@
+#ifndef WFR_MULTIGRID_H
+#define WFR_MULTIGRID_H
+
+#include "common.h"
+#include "wfr_operator.h"
+
+//! This is the geometric multigrid hierarchy of the normal equations D^T * D
+/*!
+* Every level coarsens the grid of the finer level by 2 x 2 blocks, and a
+* coarse unknown aggregates the valid unknowns of its block, so the NaN holes
+* and the irregular boundaries of the aperture are coarsened with the mask.
+* The coarse operators are the Galerkin products P^T * A * P with the
+* piecewise-constant prolongation P, i.e. the graph Laplacians weighted by
+* the number of segments between the blocks, so every level is a 5-point
+* stencil on its own grid and is applied matrix-free like the finest one.
+* The coarsest level is factorized with one pinned unknown per connected
+* aperture.
+* D only links neighbouring unknowns by -1 and +1, so neither D^T * D nor
+* its coarse levels depend on the coordinates X and Y, which only enter g.
+* The piecewise-constant prolongation makes the coarse corrections about
+* half as large as they should be for the smooth errors, so they are scaled
+* by the over-correction factor 2, which keeps the V-cycles converging at a
+* rate independent of the grid size. A V-cycle with damped Jacobi smoothing
+* is symmetric, so it preconditions CG as well as it iterates alone.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRMultigrid {
+public:
+	//! A level of the hierarchy
+	struct Level {
+		MatrixXXi ids; /*!< the unknown of each block of the level grid, -1 if empty*/
+		int_t num_unknowns;
+		MatrixXXd wx; /*!< the weight of the (i, j)-(i, j+1) link, empty for the finest level*/
+		MatrixXXd wy; /*!< the weight of the (i, j)-(i+1, j) link, empty for the finest level*/
+		VectorXd inv_diag; /*!< the inverse diagonal of A, 1 for the isolated unknowns*/
+		std_veci coarse; /*!< the unknown of the next level aggregating each unknown*/
+	};
+
+private:
+	const CWFROperator* m_operator;
+	std::vector<Level> m_levels;
+	LDLTSolver m_coarsest;
+	int m_num_smooth;
+	double m_omega;
+	double m_over_correction;
+
+public:
+	explicit CWFRMultigrid(
+		const CWFROperator& op, /*!< [in] the finest operator, which has to outlive the hierarchy*/
+		int_t coarsest_size = 1024, /*!< [in] the most unknowns of the factorized coarsest level*/
+		int num_smooth = 2, /*!< [in] the Jacobi sweeps before and after each coarse correction*/
+		double omega = 2.0 / 3.0, /*!< [in] the Jacobi damping*/
+		double over_correction = 2.0 /*!< [in] the scale of the coarse corrections*/
+	);
+	virtual ~CWFRMultigrid();
+
+	// Disable copying
+	CWFRMultigrid(const CWFRMultigrid&) = delete;
+	CWFRMultigrid& operator=(const CWFRMultigrid&) = delete;
+
+	//! Approximate x = (D^T * D)^+ * b by one V-cycle from zero
+	void vcycle(
+		const Eigen::Ref<const VectorXd>& b, /*!< [in] the rhs of the normal equations*/
+		Eigen::Ref<VectorXd> x /*!< [out] the approximate solution*/
+	) const;
+
+	//! Solve (D^T * D) * x = b by V-cycles until the relative residual reaches the tolerance
+	/*!
+	* \return the number of V-cycles, or -1 if max_iterations was reached
+	*/
+	int_t solve(
+		const Eigen::Ref<const VectorXd>& b, /*!< [in] the rhs of the normal equations*/
+		Eigen::Ref<VectorXd> x, /*!< [in, out] the initial guess and the solution*/
+		double tolerance, /*!< [in] the relative residual to reach*/
+		int_t max_iterations, /*!< [in] the most V-cycles*/
+		double* residual = nullptr /*!< [out] the relative residual reached*/
+	) const;
+
+	int_t num_levels() const { return static_cast<int_t>(m_levels.size()); }
+	const Level& level(int_t l) const { return m_levels[l]; }
+
+private:
+	//! Coarsen the last level by 2 x 2 blocks
+	void coarsen();
+
+	//! The weight of the x and y links of the level l
+	double weight_x(int_t l, int_t i, int_t j) const;
+	double weight_y(int_t l, int_t i, int_t j) const;
+
+	//! y = A_l * x
+	void apply(int_t l, const VectorXd& x, VectorXd& y) const;
+
+	//! x = A_l^+ * b by one V-cycle from zero
+	void cycle(int_t l, const VectorXd& b, VectorXd& x) const;
+};
+
+//! This is the multigrid preconditioner of Eigen::ConjugateGradient with a CWFROperator
+/*!
+* The hierarchy is built by compute() unless one was set before, so a
+* prepared hierarchy can be shared by many solves.
+*/
+class CWFRMultigridPreconditioner {
+private:
+	std::shared_ptr<const CWFRMultigrid> m_multigrid;
+
+public:
+	typedef int StorageIndex;
+	enum {
+		ColsAtCompileTime = Eigen::Dynamic,
+		MaxColsAtCompileTime = Eigen::Dynamic
+	};
+
+	CWFRMultigridPreconditioner() {}
+
+	void set_multigrid(std::shared_ptr<const CWFRMultigrid> multigrid) { m_multigrid = std::move(multigrid); }
+
+	CWFRMultigridPreconditioner& analyzePattern(const CWFROperator&) { return *this; }
+
+	CWFRMultigridPreconditioner& factorize(const CWFROperator& op)
+	{
+		if (!m_multigrid) m_multigrid = std::make_shared<const CWFRMultigrid>(op);
+		return *this;
+	}
+
+	CWFRMultigridPreconditioner& compute(const CWFROperator& op) { return factorize(op); }
+
+	Eigen::Index rows() const { return m_multigrid->level(0).num_unknowns; }
+	Eigen::Index cols() const { return m_multigrid->level(0).num_unknowns; }
+
+	template <class Rhs, class Dest>
+	void _solve_impl(const Rhs& b, Dest& x) const
+	{
+		VectorXd y(b.rows());
+		m_multigrid->vcycle(b, y);
+		x = y;
+	}
+
+	template <class Rhs>
+	Eigen::Solve<CWFRMultigridPreconditioner, Rhs> solve(const Eigen::MatrixBase<Rhs>& b) const
+	{
+		return Eigen::Solve<CWFRMultigridPreconditioner, Rhs>(*this, b.derived());
+	}
+
+	Eigen::ComputationInfo info() { return Eigen::Success; }
+};
+
+
+#endif // !WFR_MULTIGRID_H
@@ -0,0 +1,233 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_noise.h"
+#include "wfr_plan.h"
+#include "parallel.h"
+
+namespace {
+	const uint64_t kGolden = 0x9E3779B97F4A7C15ull;
+
+	//! The finalizer of SplitMix64
+	uint64_t mix(uint64_t x)
+	{
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
+	}
+
+	//! The random bits of the counter c of the stream key, as SplitMix64 at the step c
+	uint64_t random_bits(uint64_t key, uint64_t c)
+	{
+		return mix(key + (c + 1) * kGolden);
+	}
+
+	//! A uniform value in (0, 1) of the upper 53 bits
+	double uniform(uint64_t bits)
+	{
+		return ((bits >> 11) + 0.5) / 9007199254740992.0;
+	}
+
+	//! Two independent standard normal values of the counter c, by Box-Muller
+	void normal_pair(uint64_t key, uint64_t c, double& n0, double& n1)
+	{
+		auto r = std::sqrt(-2 * std::log(uniform(random_bits(key, 2 * c))));
+		auto phi = 2 * EIGEN_PI * uniform(random_bits(key, 2 * c + 1));
+		n0 = r * std::cos(phi);
+		n1 = r * std::sin(phi);
+	}
+
+	//! The running moments of the error of every pixel
+	/*!
+	* The pixels are counted one by one, as a resampled method may leave a
+	* valid pixel NaN in some realizations.
+	*/
+	struct Moments {
+		MatrixXXd count;
+		MatrixXXd mean;
+		MatrixXXd m2; /*!< the sum of the squared deviations from the mean*/
+
+		Moments(int_t rows, int_t cols)
+			: count(MatrixXXd::Zero(rows, cols))
+			, mean(MatrixXXd::Zero(rows, cols))
+			, m2(MatrixXXd::Zero(rows, cols))
+		{
+		}
+
+		//! Add an error map, as Welford
+		void add(const MatrixXXd& E)
+		{
+			for (int_t id = 0; id < E.size(); id++) {
+				auto e = E.data()[id];
+				if (!std::isfinite(e)) continue;
+				auto& n = count.data()[id];
+				auto& m = mean.data()[id];
+				n += 1;
+				auto delta = e - m;
+				m += delta / n;
+				m2.data()[id] += delta * (e - m);
+			}
+		}
+
+		//! Merge the moments of another batch, as Chan et al.
+		void merge(const Moments& other)
+		{
+			for (int_t id = 0; id < count.size(); id++) {
+				auto nb = other.count.data()[id];
+				if (nb == 0) continue;
+				auto& na = count.data()[id];
+				auto n = na + nb;
+				auto delta = other.mean.data()[id] - mean.data()[id];
+				mean.data()[id] += delta * nb / n;
+				m2.data()[id] += other.m2.data()[id] + delta * delta * na * nb / n;
+				na = n;
+			}
+		}
+	};
+
+	//! The RMS of the finite errors without their mean, as EvaluateError.m
+	double rms_without_mean(const MatrixXXd& E)
+	{
+		double sum = 0, sum_2 = 0;
+		int_t n = 0;
+		for (int_t id = 0; id < E.size(); id++) {
+			auto e = E.data()[id];
+			if (!std::isfinite(e)) continue;
+			sum += e;
+			sum_2 += e * e;
+			n++;
+		}
+		if (n == 0) return std::numeric_limits<double>::quiet_NaN();
+		auto mean = sum / n;
+		return std::sqrt(std::max(sum_2 / n - mean * mean, 0.0));
+	}
+}
+
+
+CWFRNoiseStudy::CWFRNoiseStudy(const MatrixXXd& Sx, const MatrixXXd& Sy, std::shared_ptr<const CWFRGeometry> geometry, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+	: m_Sx(Sx)
+	, m_Sy(Sy)
+	, m_geometry(std::move(geometry))
+	, m_method(method)
+	, m_options(options)
+	, m_num_threads(1)
+	, m_batch_size(16)
+	, m_seed(0)
+{
+	// the plan of the noise-free slopes serves all the realizations
+	CWFR wfr(m_Sx, m_Sy, m_geometry);
+	if (CWFR::is_resampled(m_method)) {
+		m_Z_ref = wfr(m_method, m_options);
+		m_report = wfr.report();
+		return;
+	}
+
+	m_plan = wfr.make_plan(m_method, m_options);
+	VectorXd g(m_plan->num_equations()), z;
+	m_plan->assemble_g(m_Sx, m_Sy, m_geometry->X(), m_geometry->Y(), g);
+	m_Z_ref = m_plan->solve(g, z, m_report) ? m_plan->scatter(z) : MatrixXXd::Zero(m_Sx.rows(), m_Sx.cols());
+}
+
+CWFRNoiseStudy::~CWFRNoiseStudy()
+{
+}
+
+template <class Noise>
+CWFRNoiseStudy::Result CWFRNoiseStudy::simulate(int_t num_realizations, const MatrixXXd& Z_ref, Noise&& noise)
+{
+	auto rows = m_Sx.rows(), cols = m_Sx.cols();
+	auto nan = std::numeric_limits<double>::quiet_NaN();
+	Result result;
+	result.num_realizations = num_realizations;
+	result.rms_errors.assign(num_realizations, nan);
+
+	Moments moments(rows, cols);
+	std::mutex mutex;
+	m_report = CWFR::SolverReport();
+	m_report.solver = m_options.solver;
+	parallel_for(0, num_realizations, m_num_threads, m_batch_size, [&](int_t begin, int_t end) {
+		Moments batch(rows, cols);
+		CWFR::SolverReport report;
+		MatrixXXd Sx(rows, cols), Sy(rows, cols), E;
+		auto add = [&](int_t k, const MatrixXXd& Z) {
+			E = Z - Z_ref;
+			batch.add(E);
+			result.rms_errors[k] = rms_without_mean(E);
+		};
+
+		if (m_plan) {
+			// every batch as the columns of one rhs matrix of the shared plan,
+			// a serial run gets the whole range at once
+			MatrixXd G, Z;
+			for (int_t first = begin; first < end && report.success(); first += m_batch_size) {
+				auto last = std::min(first + m_batch_size, end);
+				G.resize(m_plan->num_equations(), last - first);
+				for (int_t k = first; k < last; k++) {
+					noise(k, Sx, Sy);
+					m_plan->assemble_g(Sx, Sy, m_geometry->X(), m_geometry->Y(), G.col(k - first));
+				}
+				if (m_plan->solve(G, Z, report)) {
+					for (int_t k = first; k < last; k++) add(k, m_plan->scatter(Z.col(k - first)));
+				}
+			}
+		}
+		else {
+			for (int_t k = begin; k < end && report.success(); k++) {
+				noise(k, Sx, Sy);
+				CWFR wfr(Sx, Sy, m_geometry);
+				MatrixXXd Z = wfr(m_method, m_options);
+				report = wfr.report();
+				if (report.success()) add(k, Z);
+			}
+		}
+
+		// the worst of all the batches
+		std::lock_guard<std::mutex> lock(mutex);
+		moments.merge(batch);
+		m_report.merge(report);
+	});
+
+	result.mean = MatrixXXd::Constant(rows, cols, nan);
+	result.std = MatrixXXd::Constant(rows, cols, nan);
+	result.rms = MatrixXXd::Constant(rows, cols, nan);
+	if (!m_report.success()) return result;
+	for (int_t id = 0; id < moments.count.size(); id++) {
+		auto n = moments.count.data()[id];
+		if (n == 0) continue;
+		auto mean = moments.mean.data()[id];
+		auto m2 = moments.m2.data()[id];
+		result.mean.data()[id] = mean;
+		result.std.data()[id] = n > 1 ? std::sqrt(m2 / (n - 1)) : 0.0;
+		result.rms.data()[id] = std::sqrt(m2 / n + mean * mean);
+	}
+	return result;
+}
+
+CWFRNoiseStudy::Result CWFRNoiseStudy::run(double sigma, int_t num_realizations)
+{
+	auto key = mix(m_seed);
+	auto pixels = static_cast<uint64_t>(m_Sx.size());
+	return simulate(num_realizations, m_Z_ref, [&](int_t k, MatrixXXd& Sx, MatrixXXd& Sy) {
+		for (uint64_t p = 0; p < pixels; p++) {
+			double nx, ny;
+			normal_pair(key, k * pixels + p, nx, ny);
+			Sx.data()[p] = m_Sx.data()[p] + sigma * nx;
+			Sy.data()[p] = m_Sy.data()[p] + sigma * ny;
+		}
+	});
+}
+
+MatrixXXd CWFRNoiseStudy::estimate_variance(int_t num_probes)
+{
+	// the probes draw from another stream than the noise, and keep the validity mask
+	auto key = mix(~m_seed);
+	auto pixels = static_cast<uint64_t>(m_Sx.size());
+	auto nan = std::numeric_limits<double>::quiet_NaN();
+	auto result = simulate(num_probes, MatrixXXd::Zero(m_Sx.rows(), m_Sx.cols()), [&](int_t k, MatrixXXd& Sx, MatrixXXd& Sy) {
+		for (uint64_t p = 0; p < pixels; p++) {
+			auto bits = random_bits(key, k * pixels + p);
+			Sx.data()[p] = std::isfinite(m_Sx.data()[p]) ? (bits & 1 ? 1.0 : -1.0) : nan;
+			Sy.data()[p] = std::isfinite(m_Sy.data()[p]) ? (bits & 2 ? 1.0 : -1.0) : nan;
+		}
+	});
+	return result.rms.array().square().matrix();
+}
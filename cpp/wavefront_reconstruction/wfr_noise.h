@@ -0,0 +1,117 @@
+#ifndef WFR_NOISE_H
+#define WFR_NOISE_H
+
+#include "common.h"
+#include "cwfr.h"
+
+class CWFRPlan;
+
+//! This is the Monte-Carlo study of the slope noise propagating into the height
+/*!
+* As Step_03_StudyNoiseInfluence.m, every realization adds normally
+* distributed noise to the valid slopes, reconstructs the height and
+* compares it with a reference, by default the noise-free reconstruction.
+* The noise is drawn from a counter-based generator, i.e. a hash of the
+* seed, the realization and the pixel, so every realization is the same
+* whatever thread draws it and in whatever order.
+* The noise leaves the validity mask unchanged, so all the realizations
+* share one plan and its factorization, and every thread solves a batch of
+* realizations as the columns of one rhs matrix. The errors are folded into
+* running per-pixel moments, which are merged across the batches, so the
+* memory does not grow with the number of realizations. The resampled
+* methods have no plan, so they reconstruct realization by realization.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRNoiseStudy {
+public:
+	//! The per-pixel statistics of the height error, NaN for the invalid pixels
+	struct Result {
+		int_t num_realizations; /*!< the realizations of the study*/
+		MatrixXXd mean; /*!< the mean error*/
+		MatrixXXd std; /*!< the standard deviation of the error*/
+		MatrixXXd rms; /*!< the root mean square of the error*/
+		std_vecd rms_errors; /*!< the RMS of every error map without its mean, as EvaluateError.m*/
+	};
+
+private:
+	MatrixXXd m_Sx;
+	MatrixXXd m_Sy;
+	std::shared_ptr<const CWFRGeometry> m_geometry;
+	CWFR::WFR_METHOD m_method;
+	CWFR::SolverOptions m_options;
+	std::shared_ptr<const CWFRPlan> m_plan; /*!< nullptr for a resampled method*/
+	MatrixXXd m_Z_ref;
+	int m_num_threads;
+	int_t m_batch_size;
+	uint64_t m_seed;
+	CWFR::SolverReport m_report;
+
+public:
+	//! Plan the study of the noise-free slopes, and reconstruct the default reference
+	CWFRNoiseStudy(
+		const MatrixXXd& Sx,/*!< [in] the noise-free slopes in x direction*/
+		const MatrixXXd& Sy,/*!< [in] the noise-free slopes in y direction*/
+		std::shared_ptr<const CWFRGeometry> geometry, /*!< [in] the geometry of the same size, must not be nullptr*/
+		CWFR::WFR_METHOD method = CWFR::WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options = CWFR::SolverOptions() /*!< [in] the solver backend*/
+	);
+	virtual ~CWFRNoiseStudy();
+
+	// Disable default constructor and copying
+	CWFRNoiseStudy() = delete;
+	CWFRNoiseStudy(const CWFRNoiseStudy&) = delete;
+	CWFRNoiseStudy& operator=(const CWFRNoiseStudy&) = delete;
+
+	//! Reconstruct the noisy realizations, and gather the statistics of their errors
+	/*!
+	* \return the statistics, NaN everywhere if the solver backend failed, see report()
+	*/
+	Result run(
+		double sigma, /*!< [in] the standard deviation of the slope noise*/
+		int_t num_realizations /*!< [in] the number of realizations*/
+	);
+
+	//! Estimate the height variance of every pixel per unit slope variance
+	/*!
+	* The height error is linear in the slope noise n, e = K * n, so its
+	* covariance is sigma^2 * K * K^T. Its diagonal is estimated from random
+	* Rademacher probes r of +1 and -1 as the mean of (K * r)^2, whose
+	* expectation is exactly diag(K * K^T). Unlike the normal noise of run(),
+	* the probes square to 1, so the estimate converges with fewer probes.
+	* \return the variance per unit slope variance, NaN for the invalid pixels
+	*/
+	MatrixXXd estimate_variance(
+		int_t num_probes /*!< [in] the number of probes*/
+	);
+
+	//! Compare with another reference, e.g. the analytical height
+	void set_reference(
+		const MatrixXXd& Z_ref /*!< [in] the reference of the same size*/
+	) { m_Z_ref = Z_ref; }
+
+	void set_num_threads(
+		int num_threads /*!< [in] number of threads, 0 for all the hardware threads*/
+	) { m_num_threads = num_threads; }
+
+	//! The realizations solved at once as the columns of one rhs matrix
+	void set_batch_size(
+		int_t batch_size /*!< [in] the realizations per batch*/
+	) { m_batch_size = std::max<int_t>(batch_size, 1); }
+
+	//! Draw another sequence of realizations
+	void set_seed(
+		uint64_t seed /*!< [in] the seed of the generator*/
+	) { m_seed = seed; }
+
+	//! The outcome of the last study, the worst of all the solves
+	const CWFR::SolverReport& report() const { return m_report; }
+
+	const MatrixXXd& reference() const { return m_Z_ref; }
+
+private:
+	//! Reconstruct the realizations, whose slopes are drawn by noise(k, Sx, Sy) for the realization k
+	template <class Noise>
+	Result simulate(int_t num_realizations, const MatrixXXd& Z_ref, Noise&& noise);
+};
+
+
+#endif // !WFR_NOISE_H
@@ -0,0 +1,130 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_operator.h"
+#include "parallel.h"
+
+
+CWFROperator::CWFROperator(const CWFRAssembly& assembly, int num_threads)
+	: m_assembly(&assembly)
+	, m_num_threads(num_threads)
+{
+}
+
+CWFROperator::~CWFROperator()
+{
+}
+
+void CWFROperator::apply_D(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<VectorXd> g) const
+{
+	const auto& ids = m_assembly->ids();
+	const auto& class_x = m_assembly->class_x();
+	const auto& class_y = m_assembly->class_y();
+	const auto& offsets = m_assembly->row_offsets();
+	auto rows = m_assembly->rows();
+	auto cols = m_assembly->cols();
+
+	// one pass row after another, as in CWFRAssembly::fill_D()
+	parallel_for(0, 2 * rows, m_num_threads, 16, [&](int_t begin, int_t end) {
+		for (int_t r = begin; r < end; r++) {
+			auto e = offsets[r];
+			if (r < rows) {
+				auto i = r;
+				for (int_t j = 0; j < cols - 1; j++) {
+					if (class_x(i, j) != CWFRAssembly::NONE) g(e++) = z(ids(i, j + 1)) - z(ids(i, j));
+				}
+			}
+			else {
+				auto i = r - rows;
+				if (i > rows - 2) continue;
+				for (int_t j = 0; j < cols; j++) {
+					if (class_y(i, j) != CWFRAssembly::NONE) g(e++) = z(ids(i + 1, j)) - z(ids(i, j));
+				}
+			}
+		}
+	});
+}
+
+void CWFROperator::apply_Dt(const Eigen::Ref<const VectorXd>& g, Eigen::Ref<VectorXd> z) const
+{
+	const auto& ids = m_assembly->ids();
+	const auto& class_x = m_assembly->class_x();
+	const auto& class_y = m_assembly->class_y();
+	const auto& offsets = m_assembly->row_offsets();
+	auto rows = m_assembly->rows();
+	auto cols = m_assembly->cols();
+
+	// gather the segments around each unknown of the grid row i, i.e. the
+	// x row i and the y rows i - 1 and i
+	parallel_for(0, rows, m_num_threads, 16, [&](int_t begin, int_t end) {
+		for (int_t i = begin; i < end; i++) {
+			auto e_x = offsets[i];
+			auto e_up = i > 0 ? offsets[rows + i - 1] : 0;
+			auto e_down = offsets[rows + i];
+			double left = 0;
+			for (int_t j = 0; j < cols; j++) {
+				double v = left;
+				left = 0;
+				if (class_x(i, j) != CWFRAssembly::NONE) {
+					left = g(e_x++);
+					v -= left;
+				}
+				if (i > 0 && class_y(i - 1, j) != CWFRAssembly::NONE) v += g(e_up++);
+				if (class_y(i, j) != CWFRAssembly::NONE) v -= g(e_down++);
+
+				auto k = ids(i, j);
+				if (k >= 0) z(k) = v;
+			}
+		}
+	});
+}
+
+void CWFROperator::add_DtD(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<VectorXd> y, double alpha) const
+{
+	const auto& ids = m_assembly->ids();
+	const auto& class_x = m_assembly->class_x();
+	const auto& class_y = m_assembly->class_y();
+	auto rows = m_assembly->rows();
+	auto cols = m_assembly->cols();
+
+	// the sum of the differences to the linked neighbours
+	parallel_for(0, rows, m_num_threads, 16, [&](int_t begin, int_t end) {
+		for (int_t i = begin; i < end; i++) {
+			for (int_t j = 0; j < cols; j++) {
+				auto k = ids(i, j);
+				if (k < 0) continue;
+
+				double zk = z(k);
+				double v = 0;
+				if (j > 0 && class_x(i, j - 1) != CWFRAssembly::NONE) v += zk - z(ids(i, j - 1));
+				if (class_x(i, j) != CWFRAssembly::NONE) v += zk - z(ids(i, j + 1));
+				if (i > 0 && class_y(i - 1, j) != CWFRAssembly::NONE) v += zk - z(ids(i - 1, j));
+				if (class_y(i, j) != CWFRAssembly::NONE) v += zk - z(ids(i + 1, j));
+				y(k) += alpha * v;
+			}
+		}
+	});
+}
+
+VectorXd CWFROperator::diagonal() const
+{
+	const auto& ids = m_assembly->ids();
+	const auto& class_x = m_assembly->class_x();
+	const auto& class_y = m_assembly->class_y();
+	auto rows = m_assembly->rows();
+	auto cols = m_assembly->cols();
+
+	VectorXd d = VectorXd::Zero(m_assembly->num_unknowns());
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			if (class_x(i, j) != CWFRAssembly::NONE) {
+				d(ids(i, j)) += 1;
+				d(ids(i, j + 1)) += 1;
+			}
+			if (class_y(i, j) != CWFRAssembly::NONE) {
+				d(ids(i, j)) += 1;
+				d(ids(i + 1, j)) += 1;
+			}
+		}
+	}
+	return d;
+}
@@ -0,0 +1,123 @@
+#ifndef WFR_OPERATOR_H
+#define WFR_OPERATOR_H
+
+#include "common.h"
+#include "assembly.h"
+
+class CWFROperator;
+
+namespace Eigen {
+	namespace internal {
+		//! CWFROperator acts as a sparse matrix to the iterative solvers of Eigen
+		template <>
+		struct traits<CWFROperator> : public traits<SparseColMatrixXXd> {};
+	}
+}
+
+//! This is the matrix-free form of D and of the normal equations D^T * D
+/*!
+* Every row of D links two neighbouring unknowns by -1 and +1, so D, D^T
+* and D^T * D are applied straight from the index image and the stencil
+* classes of the assembly without any triplet or compressed matrix. The
+* equations keep the numbering of the assembly, i.e. the x rows first and
+* then the y rows. D^T and D^T * D are gathered per grid row, so the rows
+* are filled by many threads without any race. The matrix-free backends
+* apply the operator on the workers of their own CWFRThreadPool, so the
+* threads of a product are not spawned anew on every call.
+* As an Eigen operator, the object is the square matrix D^T * D, which drives
+* Eigen::ConjugateGradient with the CWFRJacobiPreconditioner.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFROperator : public Eigen::EigenBase<CWFROperator> {
+public:
+	typedef double Scalar;
+	typedef double RealScalar;
+	typedef int StorageIndex;
+	enum {
+		ColsAtCompileTime = Eigen::Dynamic,
+		MaxColsAtCompileTime = Eigen::Dynamic,
+		IsRowMajor = false
+	};
+
+private:
+	const CWFRAssembly* m_assembly;
+	int m_num_threads;
+
+public:
+	explicit CWFROperator(
+		const CWFRAssembly& assembly, /*!< [in] the scanned validity masks, which has to outlive the operator*/
+		int num_threads = 1 /*!< [in] number of threads, 0 for all the hardware threads*/
+	);
+	virtual ~CWFROperator();
+
+	Eigen::Index rows() const { return m_assembly->num_unknowns(); }
+	Eigen::Index cols() const { return m_assembly->num_unknowns(); }
+
+	//! D^T * D * x as an Eigen expression
+	template <class Rhs>
+	Eigen::Product<CWFROperator, Rhs, Eigen::AliasFreeProduct> operator * (const Eigen::MatrixBase<Rhs>& x) const
+	{
+		return Eigen::Product<CWFROperator, Rhs, Eigen::AliasFreeProduct>(*this, x.derived());
+	}
+
+	//! g = D * z
+	void apply_D(
+		const Eigen::Ref<const VectorXd>& z, /*!< [in] the unknowns*/
+		Eigen::Ref<VectorXd> g /*!< [out] the equations*/
+	) const;
+
+	//! z = D^T * g
+	void apply_Dt(
+		const Eigen::Ref<const VectorXd>& g, /*!< [in] the equations*/
+		Eigen::Ref<VectorXd> z /*!< [out] the unknowns*/
+	) const;
+
+	//! y += alpha * D^T * D * z
+	void add_DtD(
+		const Eigen::Ref<const VectorXd>& z, /*!< [in] the unknowns*/
+		Eigen::Ref<VectorXd> y, /*!< [in, out] the accumulated product*/
+		double alpha = 1 /*!< [in] the scale of the product*/
+	) const;
+
+	//! The diagonal of D^T * D, i.e. the number of segments of each unknown
+	VectorXd diagonal() const;
+
+	const CWFRAssembly& assembly() const { return *m_assembly; }
+	int num_threads() const { return m_num_threads; }
+};
+
+//! This is the Jacobi preconditioner of Eigen::ConjugateGradient with a CWFROperator
+class CWFRJacobiPreconditioner : public Eigen::DiagonalPreconditioner<double> {
+public:
+	CWFRJacobiPreconditioner() {}
+
+	CWFRJacobiPreconditioner& analyzePattern(const CWFROperator&) { return *this; }
+
+	CWFRJacobiPreconditioner& factorize(const CWFROperator& op)
+	{
+		// an isolated unknown has no segment, and is kept as it is
+		m_invdiag = op.diagonal().cwiseMax(1).cwiseInverse();
+		m_isInitialized = true;
+		return *this;
+	}
+
+	CWFRJacobiPreconditioner& compute(const CWFROperator& op) { return factorize(op); }
+};
+
+namespace Eigen {
+	namespace internal {
+		//! The product D^T * D * x, see CWFROperator::operator*
+		template <class Rhs>
+		struct generic_product_impl<CWFROperator, Rhs, SparseShape, DenseShape, GemvProduct>
+			: generic_product_impl_base<CWFROperator, Rhs, generic_product_impl<CWFROperator, Rhs>>
+		{
+			template <class Dest>
+			static void scaleAndAddTo(Dest& dst, const CWFROperator& lhs, const Rhs& rhs, const double& alpha)
+			{
+				lhs.add_DtD(rhs, dst, alpha);
+			}
+		};
+	}
+}
+
+
+#endif // !WFR_OPERATOR_H
@@ -0,0 +1,150 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_ordering.h"
+
+namespace {
+	//! The boxes of at most this many pixels are not bisected any more
+	const int_t kLeafPixels = 64;
+
+	//! The valid neighbours of the pixel p in x and y
+	template <class F>
+	void for_each_neighbour(const MatrixXXi& ids, int_t p, F&& f)
+	{
+		auto rows = ids.rows(), cols = ids.cols();
+		auto i = p / cols, j = p % cols;
+		if (j > 0 && ids(i, j - 1) >= 0) f(p - 1);
+		if (j + 1 < cols && ids(i, j + 1) >= 0) f(p + 1);
+		if (i > 0 && ids(i - 1, j) >= 0) f(p - cols);
+		if (i + 1 < rows && ids(i + 1, j) >= 0) f(p + cols);
+	}
+
+	int_t degree(const MatrixXXi& ids, int_t p)
+	{
+		int_t d = 0;
+		for_each_neighbour(ids, p, [&d](int_t) { d++; });
+		return d;
+	}
+
+	//! Append the pixels breadth-first from the pixel start, the neighbours by increasing degree
+	void breadth_first(const MatrixXXi& ids, int_t start, std::vector<uint8_t>& is_visited, std_veci& order)
+	{
+		std_veci neighbours;
+		auto head = order.size();
+		order.push_back(start);
+		is_visited[start] = 1;
+		while (head < order.size()) {
+			auto p = order[head++];
+			neighbours.clear();
+			for_each_neighbour(ids, p, [&](int_t q) {
+				if (!is_visited[q]) {
+					is_visited[q] = 1;
+					neighbours.push_back(q);
+				}
+			});
+			std::stable_sort(neighbours.begin(), neighbours.end(), [&ids](int_t a, int_t b) { return degree(ids, a) < degree(ids, b); });
+			order.insert(order.end(), neighbours.begin(), neighbours.end());
+		}
+	}
+
+	//! The least linked pixel of the last breadth-first level from the pixel start
+	int_t last_level_pixel(const MatrixXXi& ids, int_t start, std::vector<uint8_t>& is_scratch)
+	{
+		std_veci level = { start }, next, visited = { start };
+		is_scratch[start] = 1;
+		for (;;) {
+			next.clear();
+			for (auto p : level) {
+				for_each_neighbour(ids, p, [&](int_t q) {
+					if (!is_scratch[q]) {
+						is_scratch[q] = 1;
+						next.push_back(q);
+					}
+				});
+			}
+			if (next.empty()) break;
+			visited.insert(visited.end(), next.begin(), next.end());
+			std::swap(level, next);
+		}
+		for (auto p : visited) is_scratch[p] = 0;
+		return *std::min_element(level.begin(), level.end(), [&ids](int_t a, int_t b) { return degree(ids, a) < degree(ids, b); });
+	}
+
+	std_veci reverse_cuthill_mckee(const MatrixXXi& ids)
+	{
+		std::vector<uint8_t> is_visited(ids.size(), 0);
+		std::vector<uint8_t> is_scratch(ids.size(), 0);
+		std_veci order;
+		order.reserve(ids.size());
+
+		for (int_t p = 0; p < ids.size(); p++) {
+			if (ids.data()[p] < 0 || is_visited[p]) continue;
+
+			// a pseudo-peripheral pixel of the aperture, as George and Liu
+			auto start = last_level_pixel(ids, last_level_pixel(ids, p, is_scratch), is_scratch);
+			breadth_first(ids, start, is_visited, order);
+		}
+
+		std::reverse(order.begin(), order.end());
+		return order;
+	}
+
+	//! Bisect the box [i0, i1) x [j0, j1) recursively, and append its pixels
+	void nested_dissection(const MatrixXXi& ids, int_t i0, int_t i1, int_t j0, int_t j1, std_veci& order)
+	{
+		if (i0 >= i1 || j0 >= j1) return;
+		if ((i1 - i0) * (j1 - j0) <= kLeafPixels) {
+			for (int_t i = i0; i < i1; i++) {
+				for (int_t j = j0; j < j1; j++) {
+					if (ids(i, j) >= 0) order.push_back(i * ids.cols() + j);
+				}
+			}
+			return;
+		}
+
+		// the halves first, and the separator last
+		if (i1 - i0 >= j1 - j0) {
+			auto m = (i0 + i1) / 2;
+			nested_dissection(ids, i0, m, j0, j1, order);
+			nested_dissection(ids, m + 1, i1, j0, j1, order);
+			for (int_t j = j0; j < j1; j++) {
+				if (ids(m, j) >= 0) order.push_back(m * ids.cols() + j);
+			}
+		}
+		else {
+			auto m = (j0 + j1) / 2;
+			nested_dissection(ids, i0, i1, j0, m, order);
+			nested_dissection(ids, i0, i1, m + 1, j1, order);
+			for (int_t i = i0; i < i1; i++) {
+				if (ids(i, m) >= 0) order.push_back(i * ids.cols() + m);
+			}
+		}
+	}
+}
+
+std_veci order_unknowns(const MatrixXXi& ids, int_t num_unknowns, CWFR::WFR_ORDERING ordering)
+{
+	std_veci order;
+	order.reserve(num_unknowns);
+	switch (ordering)
+	{
+	case CWFR::WFR_ORDERING::RCM:
+		order = reverse_cuthill_mckee(ids);
+		break;
+	case CWFR::WFR_ORDERING::NESTED_DISSECTION:
+		nested_dissection(ids, 0, ids.rows(), 0, ids.cols(), order);
+		break;
+	case CWFR::WFR_ORDERING::NATURAL:
+	default:
+		for (int_t p = 0; p < ids.size(); p++) {
+			if (ids.data()[p] >= 0) order.push_back(p);
+		}
+		break;
+	}
+
+	// the new unknown of every old one
+	std_veci permutation(num_unknowns);
+	for (int_t k = 0; k < static_cast<int_t>(order.size()); k++) {
+		permutation[ids.data()[order[k]]] = k;
+	}
+	return permutation;
+}
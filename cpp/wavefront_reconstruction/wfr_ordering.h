@@ -0,0 +1,28 @@
+#ifndef WFR_ORDERING_H
+#define WFR_ORDERING_H
+
+#include "common.h"
+#include "cwfr.h"
+
+//! Number the unknowns of a validity mask for the locality of the solve
+/*!
+* The graph of the unknowns links the valid pixels next to each other in x
+* or y, i.e. the pattern of D^T * D.
+* 1) The Reverse Cuthill-McKee ordering numbers the pixels breadth-first
+*	from a pseudo-peripheral pixel of every aperture, the neighbours by
+*	increasing degree, and reverses the result. This narrows the band of
+*	D^T * D, so the SpMV of the iterative backends touches nearby memory.
+* 2) The nested dissection bisects the bounding box of the pixels along its
+*	longer side recursively, and numbers the two halves before the
+*	separating row or column. Eliminated in this order, the fill-in of a
+*	factorization stays within the separators.
+* \return the new unknown of every unknown of ids
+*/
+WAVEFRONTRECONSTRUCTION_API std_veci order_unknowns(
+	const MatrixXXi& ids, /*!< [in] the unknown of each pixel, -1 if invalid*/
+	int_t num_unknowns, /*!< [in] the number of unknowns*/
+	CWFR::WFR_ORDERING ordering /*!< [in] the ordering*/
+);
+
+
+#endif // !WFR_ORDERING_H
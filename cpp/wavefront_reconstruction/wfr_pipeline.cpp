@@ -0,0 +1,153 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_pipeline.h"
+#include "wfr_plan.h"
+#include "matrix_io.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+namespace {
+	//! A frame in flight between two stages
+	struct Item {
+		size_t frame;
+		MatrixXXd Sx;
+		MatrixXXd Sy;
+		MatrixXXd Z;
+	};
+
+	//! Read a matrix file straight into the matrix
+	bool read_matrix(const std::string& filename, MatrixXXd& M)
+	{
+		FILE* file = nullptr;
+		fopen_s(&file, filename.c_str(), "rb");
+		if (!file) return false;
+
+		int rows = 0, cols = 0;
+		bool is_read = read_matrix_size_from_stream(file, &rows, &cols) == 0 && rows >= 0 && cols >= 0;
+		if (is_read) {
+			M.resize(rows, cols);
+			is_read = read_matrix_from_stream(file, rows, cols, M.data()) == 0;
+		}
+		fclose(file);
+		return is_read;
+	}
+}
+
+
+CWFRPipeline::CWFRPipeline(const MatrixXXd& X, const MatrixXXd& Y, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options, const PipelineOptions& pipeline_options)
+	: m_geometry(std::make_shared<const CWFRGeometry>(X, Y))
+	, m_method(method)
+	, m_options(options)
+	, m_pipeline_options(pipeline_options)
+	, m_plan_cache(std::make_shared<CWFRPlanCache>())
+{
+}
+
+CWFRPipeline::~CWFRPipeline()
+{
+}
+
+CWFRPipeline::PipelineReport CWFRPipeline::run(const std::vector<Frame>& frames)
+{
+	auto start = std::chrono::steady_clock::now();
+	const auto& po = m_pipeline_options;
+	CWFRBoundedQueue<Item> read_queue(po.queue_capacity);
+	CWFRBoundedQueue<Item> solved_queue(po.queue_capacity);
+
+	PipelineReport report;
+	std::mutex report_mutex;
+	auto fail = [&](const std::string& message) {
+		std::lock_guard<std::mutex> lock(report_mutex);
+		if (report.failed++ == 0) report.message = message;
+	};
+
+	// every stage closes its output queue when its last thread is done
+	std::atomic<size_t> next_frame(0);
+	std::atomic<int> active_readers(std::max(po.num_readers, 1));
+	std::atomic<int> active_workers(std::max(po.num_workers, 1));
+	std::atomic<int_t> written(0);
+
+	auto reader = [&]() {
+		for (size_t k = next_frame++; k < frames.size(); k = next_frame++) {
+			Item item;
+			item.frame = k;
+			if (!read_matrix(frames[k].sx_file, item.Sx) || !read_matrix(frames[k].sy_file, item.Sy)) {
+				fail("Can't read the slopes of " + frames[k].sx_file);
+				continue;
+			}
+			if (item.Sx.rows() != m_geometry->rows() || item.Sx.cols() != m_geometry->cols() || item.Sy.rows() != m_geometry->rows() || item.Sy.cols() != m_geometry->cols()) {
+				fail("The slopes of " + frames[k].sx_file + " do not match the geometry");
+				continue;
+			}
+			read_queue.push(std::move(item));
+		}
+		if (--active_readers == 0) read_queue.close();
+	};
+
+	auto worker = [&]() {
+		Item item;
+		while (read_queue.pop(item)) {
+			CWFR wfr(item.Sx, item.Sy, m_geometry);
+			wfr.set_plan_cache(m_plan_cache);
+			wfr.set_num_threads(po.threads_per_worker);
+			item.Z = wfr(m_method, m_options);
+			if (!wfr.report().success()) {
+				fail("Can't solve " + frames[item.frame].sx_file + ": " + wfr.report().message);
+				continue;
+			}
+
+			// the slopes are not needed anymore
+			item.Sx.resize(0, 0);
+			item.Sy.resize(0, 0);
+			solved_queue.push(std::move(item));
+		}
+		if (--active_workers == 0) solved_queue.close();
+	};
+
+	auto writer = [&]() {
+		Item item;
+		while (solved_queue.pop(item)) {
+			const auto& filename = frames[item.frame].z_file;
+			if (write_matrix_to_disk(filename.c_str(), static_cast<int>(item.Z.rows()), static_cast<int>(item.Z.cols()), item.Z.data()) != 0) {
+				fail("Can't write " + filename);
+				continue;
+			}
+			written++;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < std::max(po.num_readers, 1); t++) threads.emplace_back(reader);
+	for (int t = 0; t < std::max(po.num_workers, 1); t++) threads.emplace_back(worker);
+	for (int t = 0; t < std::max(po.num_writers, 1); t++) threads.emplace_back(writer);
+	for (auto& thread : threads) thread.join();
+
+	report.frames = written;
+	report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	report.frames_per_second = report.seconds > 0 ? report.frames / report.seconds : 0;
+	return report;
+}
+
+std::vector<CWFRPipeline::Frame> CWFRPipeline::list_frames(const std::string& directory, const std::string& output_directory)
+{
+	namespace fs = std::filesystem;
+
+	std::vector<Frame> frames;
+	std::error_code error;
+	for (const auto& entry : fs::directory_iterator(directory, error)) {
+		auto filename = entry.path().filename().string();
+		if (!entry.is_regular_file() || filename.rfind("Sx", 0) != 0 || entry.path().extension() != ".bin") continue;
+
+		auto name = filename.substr(2);
+		auto sy_path = entry.path().parent_path() / ("Sy" + name);
+		if (!fs::is_regular_file(sy_path, error)) continue;
+		frames.push_back({ entry.path().string(), sy_path.string(), (fs::path(output_directory) / ("Z" + name)).string() });
+	}
+
+	std::sort(frames.begin(), frames.end(), [](const Frame& a, const Frame& b) { return a.sx_file < b.sx_file; });
+	return frames;
+}
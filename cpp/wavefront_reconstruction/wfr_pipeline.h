@@ -0,0 +1,187 @@
+#ifndef WFR_PIPELINE_H
+#define WFR_PIPELINE_H
+
+#include "common.h"
+#include "cwfr.h"
+
+#include <condition_variable>
+#include <deque>
+
+class CWFRPlanCache;
+
+//! This is a blocking queue of a bounded capacity between two pipeline stages
+/*!
+* push() blocks while the queue is full, which throttles a fast producer to
+* the pace of its consumers, and pop() blocks while it is empty. Once the
+* producers close() it, pop() drains the remaining items and then fails.
+*/
+template <class T>
+class CWFRBoundedQueue {
+private:
+	size_t m_capacity;
+	std::deque<T> m_items;
+	bool m_is_closed;
+	std::mutex m_mutex;
+	std::condition_variable m_not_full;
+	std::condition_variable m_not_empty;
+
+public:
+	explicit CWFRBoundedQueue(
+		size_t capacity /*!< [in] the maximum number of queued items*/
+	)
+		: m_capacity(std::max<size_t>(capacity, 1))
+		, m_is_closed(false)
+	{
+	}
+
+	//! Wait for a free slot and append the item
+	/*!
+	* \return false if the queue is closed, and the item is dropped
+	*/
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_not_full.wait(lock, [this] { return m_items.size() < m_capacity || m_is_closed; });
+		if (m_is_closed) return false;
+		m_items.push_back(std::move(item));
+		m_not_empty.notify_one();
+		return true;
+	}
+
+	//! Wait for an item and take the oldest one
+	/*!
+	* \return false if the queue is closed and drained
+	*/
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_not_empty.wait(lock, [this] { return !m_items.empty() || m_is_closed; });
+		if (m_items.empty()) return false;
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		m_not_full.notify_one();
+		return true;
+	}
+
+	//! Wake up all the waiting stages, no item is accepted anymore
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_is_closed = true;
+		m_not_full.notify_all();
+		m_not_empty.notify_all();
+	}
+};
+
+//! This is the reconstruction of a sequence of frame files on overlapped stages
+/*!
+* The reader threads load the slope files of the frames, the worker threads
+* reconstruct them and the writer threads store the results, the stages
+* being linked by bounded queues. So the disk I/O of the readers and the
+* writers overlaps the solves, while at most queue_capacity frames wait
+* between two stages. The frames share the geometry and a plan cache, so the
+* frames with the same validity mask are only assembled and solved.
+* The files are in the format of matrix_io.h.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRPipeline {
+public:
+	//! The files of a frame
+	struct Frame {
+		std::string sx_file; /*!< the slopes in x direction*/
+		std::string sy_file; /*!< the slopes in y direction*/
+		std::string z_file; /*!< the reconstructed wavefront*/
+	};
+
+	//! The stage sizes
+	struct PipelineOptions {
+		int num_readers; /*!< the reader threads*/
+		int num_workers; /*!< the reconstruction threads*/
+		int num_writers; /*!< the writer threads*/
+		int threads_per_worker; /*!< the threads of every reconstruction, see CWFR::set_num_threads()*/
+		size_t queue_capacity; /*!< the frames waiting between two stages at most*/
+
+		PipelineOptions(
+			int num_readers = 1,
+			int num_workers = 1,
+			int num_writers = 1,
+			int threads_per_worker = 1,
+			size_t queue_capacity = 4
+		)
+			: num_readers(num_readers)
+			, num_workers(num_workers)
+			, num_writers(num_writers)
+			, threads_per_worker(threads_per_worker)
+			, queue_capacity(queue_capacity)
+		{
+		}
+	};
+
+	//! The outcome of a run
+	struct PipelineReport {
+		int_t frames; /*!< the frames written*/
+		int_t failed; /*!< the frames not read, not solved or not written*/
+		double seconds; /*!< the wall time of the run*/
+		double frames_per_second; /*!< the throughput of the written frames*/
+		std::string message; /*!< the first failure, empty if none*/
+
+		PipelineReport()
+			: frames(0)
+			, failed(0)
+			, seconds(0)
+			, frames_per_second(0)
+		{
+		}
+	};
+
+private:
+	std::shared_ptr<const CWFRGeometry> m_geometry;
+	CWFR::WFR_METHOD m_method;
+	CWFR::SolverOptions m_options;
+	PipelineOptions m_pipeline_options;
+	std::shared_ptr<CWFRPlanCache> m_plan_cache;
+
+public:
+	CWFRPipeline(
+		const MatrixXXd& X, /*!< [in] x coordinates*/
+		const MatrixXXd& Y, /*!< [in] y coordinates*/
+		CWFR::WFR_METHOD method = CWFR::WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options = CWFR::SolverOptions(), /*!< [in] the solver backend*/
+		const PipelineOptions& pipeline_options = PipelineOptions() /*!< [in] the stage sizes*/
+	);
+	virtual ~CWFRPipeline();
+
+	// Disable default constructor and copying
+	CWFRPipeline() = delete;
+	CWFRPipeline(const CWFRPipeline&) = delete;
+	CWFRPipeline& operator=(const CWFRPipeline&) = delete;
+
+	//! Reconstruct the frames, in any order
+	/*!
+	* A frame failing to be read, solved or written is counted and skipped.
+	* \return the throughput and the failures
+	*/
+	PipelineReport run(
+		const std::vector<Frame>& frames /*!< [in] the files of the frames*/
+	);
+
+	//! List the frames of a directory
+	/*!
+	* Every "Sx<name>.bin" file with a matching "Sy<name>.bin" file is a frame,
+	* whose result is "Z<name>.bin" in the output directory.
+	* \return the frames sorted by their file names
+	*/
+	static std::vector<Frame> list_frames(
+		const std::string& directory, /*!< [in] the directory of the slope files*/
+		const std::string& output_directory /*!< [in] the directory of the results*/
+	);
+
+	//! Share the plan cache with other pipelines or CWFR instances
+	void set_plan_cache(
+		std::shared_ptr<CWFRPlanCache> plan_cache /*!< [in] the cache, must not be nullptr*/
+	) { m_plan_cache = std::move(plan_cache); }
+
+	const PipelineOptions& pipeline_options() const { return m_pipeline_options; }
+};
+
+
+#endif // !WFR_PIPELINE_H
@@ -0,0 +1,264 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_plan.h"
+#include "wfr_stopwatch.h"
+
+#include <cstring>
+
+namespace {
+	//! 64-bit FNV-1a over words rather than bytes
+	class Hasher {
+		uint64_t m_h = 14695981039346656037ull;
+	public:
+		void mix(uint64_t w) { m_h = (m_h ^ w) * 1099511628211ull; m_h ^= m_h >> 29; }
+		size_t value() const { return static_cast<size_t>(m_h); }
+	};
+
+	//! Call f(word) for the validity masks of a frame, two bits per pixel and 32 pixels per word
+	/*!
+	* \return false as soon as f returns false
+	*/
+	template <class SlopeView, class F>
+	bool for_each_mask_word(const SlopeView& Sx, const SlopeView& Sy, F&& f)
+	{
+		uint64_t bits = 0;
+		int_t n_bits = 0;
+		for (int_t i = 0; i < Sx.rows(); i++) {
+			for (int_t j = 0; j < Sx.cols(); j++) {
+				bits = (bits << 2) | (std::isfinite(Sx(i, j)) ? 1u : 0u) | (std::isfinite(Sy(i, j)) ? 2u : 0u);
+				if (++n_bits == 32) {
+					if (!f(bits)) return false;
+					bits = 0;
+					n_bits = 0;
+				}
+			}
+		}
+		return f(bits);
+	}
+
+	template <class SlopeView>
+	std::vector<uint64_t> pack_frame(const SlopeView& Sx, const SlopeView& Sy)
+	{
+		std::vector<uint64_t> mask;
+		mask.reserve(static_cast<size_t>(Sx.size() / 32 + 1));
+		for_each_mask_word(Sx, Sy, [&mask](uint64_t word) { mask.push_back(word); return true; });
+		return mask;
+	}
+
+	//! Hash a frame of slopes of any scalar type
+	template <class SlopeView>
+	size_t hash_frame(const SlopeView& Sx, const SlopeView& Sy, size_t geometry_key, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+	{
+		Hasher h;
+		h.mix(static_cast<uint64_t>(geometry_key));
+		h.mix(static_cast<uint64_t>(Sx.rows()));
+		h.mix(static_cast<uint64_t>(Sx.cols()));
+		h.mix(static_cast<uint64_t>(method));
+
+		// the solver options
+		uint64_t tolerance;
+		std::memcpy(&tolerance, &options.tolerance, sizeof(tolerance));
+		h.mix(static_cast<uint64_t>(options.solver));
+		h.mix(tolerance);
+		h.mix(static_cast<uint64_t>(options.max_iterations));
+		h.mix(static_cast<uint64_t>(options.ordering));
+
+		// the validity masks, two bits per pixel
+		for_each_mask_word(Sx, Sy, [&h](uint64_t word) { h.mix(word); return true; });
+
+		return h.value();
+	}
+
+	//! Compare a frame with the packed masks of a plan
+	template <class SlopeView>
+	bool match_frame(const SlopeView& Sx, const SlopeView& Sy, int_t rows, int_t cols, const std::vector<uint64_t>& mask)
+	{
+		if (Sx.rows() != rows || Sx.cols() != cols || Sy.rows() != rows || Sy.cols() != cols || mask.empty()) return false;
+		size_t w = 0;
+		return for_each_mask_word(Sx, Sy, [&](uint64_t word) { return w < mask.size() && mask[w++] == word; }) && w == mask.size();
+	}
+}
+
+CWFRPlan::CWFRPlan(size_t key, CWFR::WFR_METHOD method, CWFRAssembly assembly, const CWFR::SolverOptions& options, int num_threads, std::vector<uint64_t> mask)
+	: m_key(key)
+	, m_method(method)
+	, m_assembly(std::move(assembly))
+	, m_mask(std::move(mask))
+	, m_spacing()
+	, m_solver(CWFRSolver::create(options, m_assembly, true))
+	, m_fill_seconds(0)
+	, m_build_seconds(0)
+	, m_setup_seconds(0)
+{
+	// build the sparse matrix D, unless the backend is matrix-free
+	CWFRStopwatch stopwatch;
+	if (m_solver->needs_D()) {
+		TripletListd D_trps;
+		m_assembly.fill_D(D_trps, num_threads);
+		stopwatch.lap(m_fill_seconds);
+		m_D.resize(num_equations(), num_unknowns());
+		m_D.setFromTriplets(D_trps.begin(), D_trps.end());
+		m_D.makeCompressed();
+		stopwatch.lap(m_build_seconds);
+	}
+
+	// factorize or precondition once for all the frames
+	m_solver->compute(m_assembly, m_D, num_threads);
+	stopwatch.lap(m_setup_seconds);
+}
+
+CWFRPlan::~CWFRPlan()
+{
+}
+
+size_t CWFRPlan::hash(const MatrixViewd& Sx, const MatrixViewd& Sy, const MatrixViewd& X, const MatrixViewd& Y, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+{
+	return hash(Sx, Sy, hash_geometry(X, Y), method, options);
+}
+
+size_t CWFRPlan::hash(const MatrixViewd& Sx, const MatrixViewd& Sy, size_t geometry_key, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+{
+	return hash_frame(Sx, Sy, geometry_key, method, options);
+}
+
+size_t CWFRPlan::hash(const MatrixViewf& Sx, const MatrixViewf& Sy, size_t geometry_key, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+{
+	return hash_frame(Sx, Sy, geometry_key, method, options);
+}
+
+std::vector<uint64_t> CWFRPlan::pack_mask(const MatrixViewd& Sx, const MatrixViewd& Sy)
+{
+	return pack_frame(Sx, Sy);
+}
+
+std::vector<uint64_t> CWFRPlan::pack_mask(const MatrixViewf& Sx, const MatrixViewf& Sy)
+{
+	return pack_frame(Sx, Sy);
+}
+
+bool CWFRPlan::matches(const MatrixViewd& Sx, const MatrixViewd& Sy) const
+{
+	return match_frame(Sx, Sy, rows(), cols(), m_mask);
+}
+
+bool CWFRPlan::matches(const MatrixViewf& Sx, const MatrixViewf& Sy) const
+{
+	return match_frame(Sx, Sy, rows(), cols(), m_mask);
+}
+
+size_t CWFRPlan::hash_geometry(const MatrixViewd& X, const MatrixViewd& Y)
+{
+	Hasher h;
+	h.mix(static_cast<uint64_t>(X.rows()));
+	h.mix(static_cast<uint64_t>(X.cols()));
+	for (const MatrixViewd* P : { &X, &Y }) {
+		for (int_t i = 0; i < P->rows(); i++) {
+			for (int_t j = 0; j < P->cols(); j++) {
+				double v = (*P)(i, j);
+				uint64_t w;
+				std::memcpy(&w, &v, sizeof(w));
+				h.mix(w);
+			}
+		}
+	}
+	return h.value();
+}
+
+void CWFRPlan::assemble_g(const MatrixViewd& Sx, const MatrixViewd& Sy, const MatrixViewd& X, const MatrixViewd& Y, Eigen::Ref<VectorXd> g, int num_threads, CWFR::Workspace* workspace) const
+{
+	m_assembly.fill_g(Sx, Sy, X, Y, m_method, g.data(), num_threads, workspace, &spacing(X, Y));
+}
+
+void CWFRPlan::assemble_g(const MatrixViewf& Sx, const MatrixViewf& Sy, const MatrixViewd& X, const MatrixViewd& Y, Eigen::Ref<VectorXd> g, int num_threads, CWFR::Workspace* workspace) const
+{
+	m_assembly.fill_g(Sx, Sy, X, Y, m_method, g.data(), num_threads, workspace, &spacing(X, Y));
+}
+
+const CWFRAssembly::GridSpacing& CWFRPlan::spacing(const MatrixViewd& X, const MatrixViewd& Y) const
+{
+	std::call_once(m_spacing_flag, [&]() { m_spacing = CWFRAssembly::detect_spacing(X, Y); });
+	return m_spacing;
+}
+
+bool CWFRPlan::solve(const VectorXd& g, VectorXd& z, CWFR::SolverReport& report, const VectorXd* z0) const
+{
+	MatrixXd Z;
+	MatrixXd Z0 = z0 ? MatrixXd(*z0) : MatrixXd();
+	if (!solve(MatrixXd(g), Z, report, z0 ? &Z0 : nullptr)) return false;
+
+	z = Z.col(0);
+	return true;
+}
+
+bool CWFRPlan::solve(CWFR::Workspace& workspace, CWFR::SolverReport& report, bool has_initial_guess) const
+{
+	workspace.z.resize(num_unknowns());
+	if (!m_solver->solve(workspace.g, workspace.z, workspace, report, has_initial_guess ? &workspace.z0 : nullptr)) return false;
+
+	m_assembly.remove_pistons(workspace.z, workspace.pistons);
+	return true;
+}
+
+bool CWFRPlan::solve(const MatrixXd& G, MatrixXd& Z, CWFR::SolverReport& report, const MatrixXd* Z0) const
+{
+	if (!m_solver->solve(G, Z, report, Z0)) return false;
+
+	for (int_t k = 0; k < Z.cols(); k++) {
+		m_assembly.remove_pistons(Z.col(k));
+	}
+	return true;
+}
+
+
+CWFRPlanCache::CWFRPlanCache(size_t capacity)
+	: m_capacity(std::max<size_t>(capacity, 1))
+{
+}
+
+CWFRPlanCache::~CWFRPlanCache()
+{
+}
+
+std::shared_ptr<const CWFRPlan> CWFRPlanCache::find(size_t key, const MatrixViewd& Sx, const MatrixViewd& Sy)
+{
+	return find_any(key, Sx, Sy);
+}
+
+std::shared_ptr<const CWFRPlan> CWFRPlanCache::find(size_t key, const MatrixViewf& Sx, const MatrixViewf& Sy)
+{
+	return find_any(key, Sx, Sy);
+}
+
+template <class SlopeView>
+std::shared_ptr<const CWFRPlan> CWFRPlanCache::find_any(size_t key, const SlopeView& Sx, const SlopeView& Sy)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto it = m_plans.begin(); it != m_plans.end(); ++it) {
+		if ((*it)->key() == key && (*it)->matches(Sx, Sy)) {
+			// move to the front as the most recently used
+			m_plans.splice(m_plans.begin(), m_plans, it);
+			return m_plans.front();
+		}
+	}
+	return nullptr;
+}
+
+void CWFRPlanCache::insert(std::shared_ptr<const CWFRPlan> plan)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_plans.remove_if([&plan](const std::shared_ptr<const CWFRPlan>& p) { return p->key() == plan->key() && p->rows() == plan->rows() && p->cols() == plan->cols() && p->mask() == plan->mask(); });
+	m_plans.push_front(std::move(plan));
+	while (m_plans.size() > m_capacity) m_plans.pop_back();
+}
+
+void CWFRPlanCache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_plans.clear();
+}
+
+size_t CWFRPlanCache::size() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_plans.size();
+}
@@ -0,0 +1,265 @@
+#ifndef WFR_PLAN_H
+#define WFR_PLAN_H
+
+#include "common.h"
+#include "cwfr.h"
+#include "assembly.h"
+#include "solvers.h"
+
+//! This is the reusable part of a reconstruction
+/*!
+* A plan holds everything that only depends on the geometry (X, Y), the
+* validity masks of (Sx, Sy), the method and the solver options: the
+* scanned validity masks, the compressed matrix D and the prepared solver
+* backend, e.g. a factorization of the pinned normal equations
+*					(D^T * D + P) * z = D^T * g
+* A repeated frame then only needs to assemble g and to solve, and the
+* result is shifted to a zero mean per connected aperture.
+* The plan keeps the validity masks it was built for, two bits per pixel,
+* so a cached plan is only reused by a frame of exactly the same masks,
+* whatever its key.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRPlan {
+private:
+	size_t m_key;
+	CWFR::WFR_METHOD m_method;
+	CWFRAssembly m_assembly;
+	std::vector<uint64_t> m_mask; /*!< the finite Sx and Sy of every pixel as two bits, 32 pixels per word*/
+	mutable std::once_flag m_spacing_flag;
+	mutable CWFRAssembly::GridSpacing m_spacing; /*!< the spacings of the geometry, detected by the first assemble_g()*/
+	SparseMatrixXXd m_D;
+	std::unique_ptr<CWFRSolver> m_solver;
+	double m_fill_seconds; /*!< filling the triplets of D*/
+	double m_build_seconds; /*!< building D from its triplets*/
+	double m_setup_seconds; /*!< the setup or the factorization of the backend*/
+
+public:
+	CWFRPlan(
+		size_t key, /*!< [in] the key from hash()*/
+		CWFR::WFR_METHOD method, /*!< [in] method to be used*/
+		CWFRAssembly assembly, /*!< [in] the scanned validity masks*/
+		const CWFR::SolverOptions& options, /*!< [in] the solver backend*/
+		int num_threads = 1, /*!< [in] number of threads filling D*/
+		std::vector<uint64_t> mask = std::vector<uint64_t>() /*!< [in] the masks from pack_mask(), empty for a plan which is not cached*/
+	);
+	virtual ~CWFRPlan();
+
+	// Disable default constructor and copying
+	CWFRPlan() = delete;
+	CWFRPlan(const CWFRPlan&) = delete;
+	CWFRPlan& operator=(const CWFRPlan&) = delete;
+
+	//! Hash the geometry, the validity masks, the method and the solver options
+	/*!
+	* \return the key identifying the plan of a frame
+	*/
+	static size_t hash(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		CWFR::WFR_METHOD method, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options /*!< [in] the solver backend*/
+	);
+
+	//! Hash the validity masks, the method and the solver options with a known geometry hash
+	/*!
+	* This avoids rehashing X and Y for many frames sharing the geometry.
+	* \return the key identifying the plan of a frame
+	*/
+	static size_t hash(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		size_t geometry_key, /*!< [in] the key from hash_geometry()*/
+		CWFR::WFR_METHOD method, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options /*!< [in] the solver backend*/
+	);
+
+	//! Hash the validity masks of float slopes, the same key as for the double ones
+	static size_t hash(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy,/*!< [in] Slopes in y direction*/
+		size_t geometry_key, /*!< [in] the key from hash_geometry()*/
+		CWFR::WFR_METHOD method, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options /*!< [in] the solver backend*/
+	);
+
+	//! Pack the validity masks of a frame, two bits per pixel
+	static std::vector<uint64_t> pack_mask(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy /*!< [in] Slopes in y direction*/
+	);
+
+	//! Pack the validity masks of a frame of float slopes, the same as for the double ones
+	static std::vector<uint64_t> pack_mask(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy /*!< [in] Slopes in y direction*/
+	);
+
+	//! Check if a frame has the size and the validity masks of this plan, without any allocation
+	bool matches(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy /*!< [in] Slopes in y direction*/
+	) const;
+
+	//! Check if a frame of float slopes has the size and the validity masks of this plan
+	bool matches(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy /*!< [in] Slopes in y direction*/
+	) const;
+
+	//! Hash the geometry only
+	static size_t hash_geometry(
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y  /*!< [in] y coordinates*/
+	);
+
+	//! Assemble the rhs vector g of a frame sharing this plan
+	/*!
+	* X and Y are those of the geometry of the plan, whose spacings are
+	* detected by the first call only.
+	*/
+	void assemble_g(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		Eigen::Ref<VectorXd> g, /*!< [out] the rhs vector of num_equations()*/
+		int num_threads = 1, /*!< [in] number of threads, 0 for all the hardware threads*/
+		CWFR::Workspace* workspace = nullptr /*!< [in,out] the row buffers of a single thread, nullptr for local ones*/
+	) const;
+
+	//! Assemble the rhs vector g of a frame of float slopes sharing this plan
+	void assemble_g(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		Eigen::Ref<VectorXd> g, /*!< [out] the rhs vector of num_equations()*/
+		int num_threads = 1, /*!< [in] number of threads, 0 for all the hardware threads*/
+		CWFR::Workspace* workspace = nullptr /*!< [in,out] the row buffers of a single thread, nullptr for local ones*/
+	) const;
+
+	//! Solve D * z = g in the least-squares sense
+	/*!
+	* \return false if the solver backend failed, see the report
+	*/
+	bool solve(
+		const VectorXd& g, /*!< [in] the rhs vector*/
+		VectorXd& z, /*!< [out] the unknowns*/
+		CWFR::SolverReport& report, /*!< [out] the solver statistics*/
+		const VectorXd* z0 = nullptr /*!< [in] the initial guess, nullptr to start from zero*/
+	) const;
+
+	//! Solve D * Z = G for many rhs vectors stacked as the columns of G
+	/*!
+	* \return false if the solver backend failed, see the report
+	*/
+	bool solve(
+		const MatrixXd& G, /*!< [in] the rhs vectors*/
+		MatrixXd& Z, /*!< [out] the unknowns, one column per rhs vector*/
+		CWFR::SolverReport& report, /*!< [out] the solver statistics*/
+		const MatrixXd* Z0 = nullptr /*!< [in] the initial guesses, nullptr to start from zero*/
+	) const;
+
+	//! Solve D * z = g from workspace.g into workspace.z
+	/*!
+	* Once a previous frame of this plan has sized the workspace, a direct
+	* backend of the normal equations, e.g. the SIMPLICIAL_LDLT that
+	* WFR_SOLVER::AUTO picks for a plan, solves without any heap allocation.
+	* \return false if the solver backend failed, see the report
+	*/
+	bool solve(
+		CWFR::Workspace& workspace, /*!< [in,out] g in, z out, and the buffers of the solve*/
+		CWFR::SolverReport& report, /*!< [out] the solver statistics*/
+		bool has_initial_guess = false /*!< [in] true to start from workspace.z0*/
+	) const;
+
+	//! Put the unknowns back to the grid, NaN for the invalid pixels
+	MatrixXXd scatter(const Eigen::Ref<const VectorXd>& z) const { return m_assembly.scatter(z); }
+
+	//! Put the unknowns back to a grid of the caller, NaN for the invalid pixels
+	void scatter(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<MatrixXXd> Z) const { m_assembly.scatter(z, Z); }
+
+	//! Put the unknowns back to a float grid of the caller, NaN for the invalid pixels
+	void scatter(const Eigen::Ref<const VectorXd>& z, Eigen::Ref<MatrixXXf> Z) const { m_assembly.scatter(z, Z); }
+
+	//! Pick the unknowns from a grid, 0 for its non-finite pixels
+	VectorXd gather(const MatrixXXd& Z) const { return m_assembly.gather(Z); }
+
+	//! Pick the unknowns from a grid into z of num_unknowns(), 0 for its non-finite pixels
+	void gather(const MatrixXXd& Z, Eigen::Ref<VectorXd> z) const { m_assembly.gather(Z, z); }
+
+	size_t key() const { return m_key; }
+	CWFR::WFR_METHOD method() const { return m_method; }
+	int_t rows() const { return m_assembly.rows(); }
+	int_t cols() const { return m_assembly.cols(); }
+	const std::vector<uint64_t>& mask() const { return m_mask; }
+	int_t num_unknowns() const { return m_assembly.num_unknowns(); }
+	int_t num_equations() const { return m_assembly.num_equations(); }
+	int_t num_components() const { return m_assembly.num_components(); }
+	const CWFRAssembly& assembly() const { return m_assembly; }
+	const SparseMatrixXXd& D() const { return m_D; } /*!< empty for a matrix-free backend*/
+	const CWFRSolver& solver() const { return *m_solver; }
+	double fill_seconds() const { return m_fill_seconds; }
+	double build_seconds() const { return m_build_seconds; }
+	double setup_seconds() const { return m_setup_seconds; }
+
+private:
+	//! The spacings of X and Y, detected on the first call
+	const CWFRAssembly::GridSpacing& spacing(const MatrixViewd& X, const MatrixViewd& Y) const;
+};
+
+//! This is a thread-safe cache of plans with the least-recently-used eviction
+class WAVEFRONTRECONSTRUCTION_API CWFRPlanCache {
+private:
+	size_t m_capacity;
+	std::list<std::shared_ptr<const CWFRPlan>> m_plans; /*!< the most recent first*/
+	mutable std::mutex m_mutex;
+
+public:
+	explicit CWFRPlanCache(
+		size_t capacity = 8 /*!< [in] the maximum number of plans to keep*/
+	);
+	virtual ~CWFRPlanCache();
+
+	// Disable copying
+	CWFRPlanCache(const CWFRPlanCache&) = delete;
+	CWFRPlanCache& operator=(const CWFRPlanCache&) = delete;
+
+	//! Find the plan with the key and the validity masks of a frame
+	/*!
+	* A plan of the same key but other masks, i.e. a hash collision, is a miss.
+	* \return the plan, or nullptr if it is not cached
+	*/
+	std::shared_ptr<const CWFRPlan> find(
+		size_t key, /*!< [in] the key from CWFRPlan::hash()*/
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy /*!< [in] Slopes in y direction*/
+	);
+
+	//! Find the plan with the key and the validity masks of a frame of float slopes
+	std::shared_ptr<const CWFRPlan> find(
+		size_t key, /*!< [in] the key from CWFRPlan::hash()*/
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy /*!< [in] Slopes in y direction*/
+	);
+
+	//! Insert a plan, evicting the least-recently-used one if the cache is full
+	void insert(std::shared_ptr<const CWFRPlan> plan);
+
+	//! Remove all the plans
+	void clear();
+
+private:
+	template <class SlopeView>
+	std::shared_ptr<const CWFRPlan> find_any(size_t key, const SlopeView& Sx, const SlopeView& Sy);
+
+public:
+
+	size_t size() const;
+	size_t capacity() const { return m_capacity; }
+};
+
+
+#endif // !WFR_PLAN_H
@@ -0,0 +1,179 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_poisson.h"
+#include "parallel.h"
+
+namespace {
+	const double PI = 3.14159265358979323846;
+
+	bool is_power_of_two(int_t n)
+	{
+		return n > 0 && (n & (n - 1)) == 0;
+	}
+}
+
+CWFRDCT::CWFRDCT(int_t n)
+	: m_n(n)
+	, m_fft_n(1)
+{
+	m_twiddles.resize(n);
+	for (int_t k = 0; k < n; k++) m_twiddles[k] = std::polar(1.0, -PI * k / (2.0 * n));
+
+	if (is_power_of_two(n)) {
+		m_fft_n = n;
+	}
+	else {
+		// Bluestein: the chirp, with k^2 reduced modulo 2N to keep the angles accurate
+		while (m_fft_n < 2 * n - 1) m_fft_n *= 2;
+		m_chirp.resize(n);
+		for (int_t k = 0; k < n; k++) m_chirp[k] = std::polar(1.0, -PI * static_cast<double>((k * k) % (2 * n)) / n);
+	}
+
+	m_fft_twiddles.resize(m_fft_n / 2);
+	for (int_t k = 0; k < m_fft_n / 2; k++) m_fft_twiddles[k] = std::polar(1.0, -2.0 * PI * k / m_fft_n);
+
+	if (!m_chirp.empty()) {
+		// the FFT of the symmetric filter conj(chirp(m)), m = -(N-1), ..., N-1
+		m_chirp_fft.assign(m_fft_n, Complex(0));
+		for (int_t k = 0; k < n; k++) {
+			m_chirp_fft[k] = std::conj(m_chirp[k]);
+			if (k > 0) m_chirp_fft[m_fft_n - k] = std::conj(m_chirp[k]);
+		}
+		fft(m_chirp_fft.data(), false);
+	}
+}
+
+CWFRDCT::~CWFRDCT()
+{
+}
+
+void CWFRDCT::forward(double* x, ComplexVector& work) const
+{
+	auto n = m_n;
+	work.resize(n + (m_chirp.empty() ? 0 : m_fft_n));
+	auto* v = work.data();
+
+	// the even samples first, then the odd ones backwards
+	for (int_t k = 0; 2 * k < n; k++) v[k] = x[2 * k];
+	for (int_t k = 0; 2 * k + 1 < n; k++) v[n - 1 - k] = x[2 * k + 1];
+
+	dft(v, false, work);
+	for (int_t k = 0; k < n; k++) x[k] = (v[k] * m_twiddles[k]).real();
+}
+
+void CWFRDCT::inverse(double* x, ComplexVector& work) const
+{
+	auto n = m_n;
+	work.resize(n + (m_chirp.empty() ? 0 : m_fft_n));
+	auto* v = work.data();
+
+	// rebuild the DFT of the reordered samples from the real DCT
+	v[0] = x[0];
+	for (int_t k = 1; k < n; k++) v[k] = std::conj(m_twiddles[k]) * Complex(x[k], -x[n - k]);
+
+	dft(v, true, work);
+	for (int_t k = 0; 2 * k < n; k++) x[2 * k] = v[k].real() / n;
+	for (int_t k = 0; 2 * k + 1 < n; k++) x[2 * k + 1] = v[n - 1 - k].real() / n;
+}
+
+void CWFRDCT::dft(Complex* v, bool is_inverse, ComplexVector& work) const
+{
+	if (m_chirp.empty()) {
+		fft(v, is_inverse);
+		return;
+	}
+
+	// the inverse is the conjugate of the forward DFT of the conjugate
+	auto n = m_n;
+	if (is_inverse) {
+		for (int_t k = 0; k < n; k++) v[k] = std::conj(v[k]);
+	}
+
+	// Bluestein: X(k) = chirp(k) * sum_n (x(n) * chirp(n)) * conj(chirp(k - n))
+	auto* a = work.data() + n;
+	for (int_t k = 0; k < n; k++) a[k] = v[k] * m_chirp[k];
+	std::fill(a + n, a + m_fft_n, Complex(0));
+	fft(a, false);
+	for (int_t k = 0; k < m_fft_n; k++) a[k] *= m_chirp_fft[k];
+	fft(a, true);
+	for (int_t k = 0; k < n; k++) v[k] = a[k] * m_chirp[k] / static_cast<double>(m_fft_n);
+
+	if (is_inverse) {
+		for (int_t k = 0; k < n; k++) v[k] = std::conj(v[k]);
+	}
+}
+
+void CWFRDCT::fft(Complex* v, bool is_inverse) const
+{
+	auto n = m_fft_n;
+
+	// the bit-reversal permutation
+	for (int_t i = 1, j = 0; i < n; i++) {
+		int_t bit = n >> 1;
+		for (; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if (i < j) std::swap(v[i], v[j]);
+	}
+
+	// the butterflies
+	for (int_t len = 2; len <= n; len <<= 1) {
+		auto step = n / len;
+		for (int_t i = 0; i < n; i += len) {
+			for (int_t k = 0; k < len / 2; k++) {
+				auto w = is_inverse ? std::conj(m_fft_twiddles[k * step]) : m_fft_twiddles[k * step];
+				auto t = v[i + k + len / 2] * w;
+				v[i + k + len / 2] = v[i + k] - t;
+				v[i + k] += t;
+			}
+		}
+	}
+}
+
+
+CWFRPoisson::CWFRPoisson(int_t rows, int_t cols, int num_threads)
+	: m_rows(rows)
+	, m_cols(cols)
+	, m_dct_x(cols)
+	, m_dct_y(rows)
+	, m_inv_eigenvalues(cols, rows)
+	, m_num_threads(num_threads)
+{
+	// the eigenvalues of the Kronecker sum, without the piston
+	for (int_t j = 0; j < cols; j++) {
+		for (int_t i = 0; i < rows; i++) {
+			auto eigenvalue = (2 - 2 * std::cos(PI * j / cols)) + (2 - 2 * std::cos(PI * i / rows));
+			m_inv_eigenvalues(j, i) = eigenvalue > 0 ? 1 / eigenvalue : 0;
+		}
+	}
+}
+
+CWFRPoisson::~CWFRPoisson()
+{
+}
+
+void CWFRPoisson::solve(const Eigen::Ref<const VectorXd>& b, Eigen::Ref<VectorXd> z) const
+{
+	// along x, then along y on the transposed grid
+	MatrixXXd B = Eigen::Map<const MatrixXXd>(b.data(), m_rows, m_cols);
+	transform_rows(B, m_dct_x, false);
+	MatrixXXd Bt = B.transpose();
+	transform_rows(Bt, m_dct_y, false);
+
+	Bt.array() *= m_inv_eigenvalues.array();
+
+	transform_rows(Bt, m_dct_y, true);
+	B = Bt.transpose();
+	transform_rows(B, m_dct_x, true);
+	z = Eigen::Map<const VectorXd>(B.data(), B.size());
+}
+
+void CWFRPoisson::transform_rows(MatrixXXd& A, const CWFRDCT& dct, bool is_inverse) const
+{
+	parallel_for(0, A.rows(), m_num_threads, 16, [&](int_t begin, int_t end) {
+		CWFRDCT::ComplexVector work;
+		for (int_t i = begin; i < end; i++) {
+			if (is_inverse) dct.inverse(A.row(i).data(), work);
+			else dct.forward(A.row(i).data(), work);
+		}
+	});
+}
@@ -0,0 +1,168 @@
+#ifndef WFR_POISSON_H
+#define WFR_POISSON_H
+
+#include "common.h"
+#include "wfr_operator.h"
+
+#include <complex>
+
+//! This is the unnormalized DCT-II of a fixed length and its inverse
+/*!
+* The DCT-II
+*		X(k) = sum_n x(n) * cos(pi * k * (2n + 1) / (2N))
+* is computed with one complex FFT of the same length N after the even-odd
+* reordering of x. The FFT is the iterative radix-2 one for a power-of-two
+* N, or the Bluestein chirp-z convolution with a power-of-two FFT for any
+* other N, so every length costs O(N log N).
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRDCT {
+public:
+	typedef std::complex<double> Complex;
+	typedef std::vector<Complex> ComplexVector;
+
+private:
+	int_t m_n;
+	int_t m_fft_n; /*!< the power-of-two length of the FFT*/
+	ComplexVector m_twiddles; /*!< exp(-i * pi * k / (2N))*/
+	ComplexVector m_fft_twiddles; /*!< exp(-2i * pi * k / fft_n)*/
+	ComplexVector m_chirp; /*!< exp(-i * pi * k^2 / N) of Bluestein, empty for a power-of-two N*/
+	ComplexVector m_chirp_fft; /*!< the FFT of the conjugate chirp filter*/
+
+public:
+	explicit CWFRDCT(
+		int_t n /*!< [in] the length of the transform*/
+	);
+	virtual ~CWFRDCT();
+
+	//! x = DCT-II(x)
+	void forward(
+		double* x, /*!< [in, out] the contiguous data*/
+		ComplexVector& work /*!< [in] the scratch buffer, resized on demand*/
+	) const;
+
+	//! x = DCT-II^-1(x)
+	void inverse(
+		double* x, /*!< [in, out] the contiguous data*/
+		ComplexVector& work /*!< [in] the scratch buffer, resized on demand*/
+	) const;
+
+	int_t size() const { return m_n; }
+
+private:
+	//! The complex DFT of length N in place, or its conjugate if is_inverse
+	void dft(Complex* v, bool is_inverse, ComplexVector& work) const;
+
+	//! The power-of-two FFT in place, without any scaling
+	void fft(Complex* v, bool is_inverse) const;
+};
+
+//! This is the DCT solver of the normal equations on a fully valid rectangle
+/*!
+* With every pixel valid, D^T * D is the 5-point Laplacian with the Neumann
+* boundary of the rectangle, which is the Kronecker sum of two path-graph
+* Laplacians, diagonalized by the DCT-II with the eigenvalues
+*		2 - 2 * cos(pi * k / N)
+* So the normal equations are solved exactly in O(n log n) by a DCT of the
+* rows and the columns, a division by the eigenvalues and the inverse DCT.
+* The zero eigenvalue of the piston is skipped, i.e. the result has a zero
+* mean. D only links neighbouring unknowns by -1 and +1, so the solve is
+* exact for the quadrilateral geometry too, whose X and Y only enter g.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRPoisson {
+private:
+	int_t m_rows;
+	int_t m_cols;
+	CWFRDCT m_dct_x;
+	CWFRDCT m_dct_y;
+	MatrixXXd m_inv_eigenvalues; /*!< the transposed, cols x rows*/
+	int m_num_threads;
+
+public:
+	CWFRPoisson(
+		int_t rows, /*!< [in] rows of the grid*/
+		int_t cols, /*!< [in] cols of the grid*/
+		int num_threads = 1 /*!< [in] number of threads, 0 for all the hardware threads*/
+	);
+	virtual ~CWFRPoisson();
+
+	//! Solve (D^T * D) * z = b on the grid, both in the row-major pixel order
+	void solve(
+		const Eigen::Ref<const VectorXd>& b, /*!< [in] the rhs of the normal equations*/
+		Eigen::Ref<VectorXd> z /*!< [out] the solution with a zero mean*/
+	) const;
+
+	int_t rows() const { return m_rows; }
+	int_t cols() const { return m_cols; }
+
+private:
+	//! Transform every row of A forward or backward
+	void transform_rows(MatrixXXd& A, const CWFRDCT& dct, bool is_inverse) const;
+};
+
+//! This is the DCT Poisson preconditioner of Eigen::ConjugateGradient with a CWFROperator
+/*!
+* The residual of the valid pixels is embedded into the full grid with zeros
+* elsewhere, solved with the Laplacian of the full rectangle, and picked back,
+* i.e. the symmetric operator R * L^+ * R^T of the restriction R. It is
+* exact for a fully valid rectangle, and a good guess of the smooth errors
+* of a masked aperture.
+*/
+class CWFRPoissonPreconditioner {
+private:
+	const CWFRAssembly* m_assembly;
+	std::shared_ptr<const CWFRPoisson> m_poisson;
+
+public:
+	typedef int StorageIndex;
+	enum {
+		ColsAtCompileTime = Eigen::Dynamic,
+		MaxColsAtCompileTime = Eigen::Dynamic
+	};
+
+	CWFRPoissonPreconditioner() : m_assembly(nullptr) {}
+
+	void set_poisson(std::shared_ptr<const CWFRPoisson> poisson) { m_poisson = std::move(poisson); }
+
+	CWFRPoissonPreconditioner& analyzePattern(const CWFROperator&) { return *this; }
+
+	CWFRPoissonPreconditioner& factorize(const CWFROperator& op)
+	{
+		m_assembly = &op.assembly();
+		if (!m_poisson) m_poisson = std::make_shared<const CWFRPoisson>(m_assembly->rows(), m_assembly->cols(), op.num_threads());
+		return *this;
+	}
+
+	CWFRPoissonPreconditioner& compute(const CWFROperator& op) { return factorize(op); }
+
+	Eigen::Index rows() const { return m_assembly->num_unknowns(); }
+	Eigen::Index cols() const { return m_assembly->num_unknowns(); }
+
+	template <class Rhs, class Dest>
+	void _solve_impl(const Rhs& b, Dest& x) const
+	{
+		// embed, solve and restrict
+		const auto& ids = m_assembly->ids();
+		VectorXd grid = VectorXd::Zero(ids.size());
+		for (int_t id = 0; id < ids.size(); id++) {
+			if (ids.data()[id] >= 0) grid(id) = b(ids.data()[id]);
+		}
+		VectorXd grid_x(ids.size());
+		m_poisson->solve(grid, grid_x);
+
+		x.resize(b.rows());
+		for (int_t id = 0; id < ids.size(); id++) {
+			if (ids.data()[id] >= 0) x(ids.data()[id]) = grid_x(id);
+		}
+	}
+
+	template <class Rhs>
+	Eigen::Solve<CWFRPoissonPreconditioner, Rhs> solve(const Eigen::MatrixBase<Rhs>& b) const
+	{
+		return Eigen::Solve<CWFRPoissonPreconditioner, Rhs>(*this, b.derived());
+	}
+
+	Eigen::ComputationInfo info() { return Eigen::Success; }
+};
+
+
+#endif // !WFR_POISSON_H
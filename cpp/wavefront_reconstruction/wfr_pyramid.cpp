@@ -0,0 +1,130 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_pyramid.h"
+
+namespace {
+	//! The valid finer pixels a coarse pixel needs at least
+	const int kMinValidPixels = 2;
+
+	//! The lower coarse id and the weight of the upper one of the fine id i
+	void coarse_position(int_t i, int_t n, int_t& k, double& t)
+	{
+		// the center of the fine pixel i is at (i + 0.5) / 2 - 0.5 on the coarse grid
+		auto f = std::min(std::max(0.5 * i - 0.25, 0.0), static_cast<double>(n - 1));
+		k = std::min<int_t>(static_cast<int_t>(f), std::max<int_t>(n - 2, 0));
+		t = f - k;
+	}
+}
+
+
+CWFRPyramid::CWFRPyramid(const MatrixViewd& Sx, const MatrixViewd& Sy, const MatrixViewd& X, const MatrixViewd& Y, int num_levels)
+{
+	build(Sx, Sy, X, Y, num_levels);
+}
+
+CWFRPyramid::CWFRPyramid(const MatrixViewf& Sx, const MatrixViewf& Sy, const MatrixViewd& X, const MatrixViewd& Y, int num_levels)
+{
+	build(Sx, Sy, X, Y, num_levels);
+}
+
+CWFRPyramid::~CWFRPyramid()
+{
+}
+
+template <class SlopeView>
+void CWFRPyramid::build(const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const MatrixViewd& Y, int num_levels)
+{
+	auto rows = Sx.rows(), cols = Sx.cols();
+	for (int level = 0; level < num_levels; level++) {
+		rows = (rows + 1) / 2;
+		cols = (cols + 1) / 2;
+		if (rows < kMinSize || cols < kMinSize) break;
+
+		if (m_levels.empty()) {
+			m_levels.push_back(halve(Sx, Sy, X, Y));
+			continue;
+		}
+		// halve before the push, which may move the finer level
+		const auto& finer = m_levels.back();
+		auto coarse = halve(MatrixViewd(finer.Sx), MatrixViewd(finer.Sy), finer.X, finer.Y);
+		m_levels.push_back(std::move(coarse));
+	}
+}
+
+template <class SlopeView>
+CWFRPyramid::Level CWFRPyramid::halve(const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const MatrixViewd& Y)
+{
+	auto rows = (Sx.rows() + 1) / 2, cols = (Sx.cols() + 1) / 2;
+	auto nan = std::numeric_limits<double>::quiet_NaN();
+	Level coarse;
+	coarse.Sx.resize(rows, cols);
+	coarse.Sy.resize(rows, cols);
+	coarse.X.resize(rows, cols);
+	coarse.Y.resize(rows, cols);
+
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			double sx = 0, sy = 0, x = 0, y = 0, x_all = 0, y_all = 0;
+			int n = 0, n_all = 0;
+			for (auto fi = 2 * i; fi < std::min(2 * i + 2, Sx.rows()); fi++) {
+				for (auto fj = 2 * j; fj < std::min(2 * j + 2, Sx.cols()); fj++) {
+					x_all += X(fi, fj);
+					y_all += Y(fi, fj);
+					n_all++;
+					double sx_f = static_cast<double>(Sx(fi, fj)), sy_f = static_cast<double>(Sy(fi, fj));
+					if (!std::isfinite(sx_f) || !std::isfinite(sy_f)) continue;
+					sx += sx_f;
+					sy += sy_f;
+					x += X(fi, fj);
+					y += Y(fi, fj);
+					n++;
+				}
+			}
+
+			// the corner pixel of a single finer pixel only needs that one
+			if (n >= std::min(kMinValidPixels, n_all)) {
+				coarse.Sx(i, j) = sx / n;
+				coarse.Sy(i, j) = sy / n;
+				coarse.X(i, j) = x / n;
+				coarse.Y(i, j) = y / n;
+			}
+			else {
+				coarse.Sx(i, j) = coarse.Sy(i, j) = nan;
+				coarse.X(i, j) = x_all / n_all;
+				coarse.Y(i, j) = y_all / n_all;
+			}
+		}
+	}
+	return coarse;
+}
+
+MatrixXXd CWFRPyramid::prolongate(const MatrixXXd& Z, int_t rows, int_t cols)
+{
+	MatrixXXd Z_fine(rows, cols);
+	for (int_t i = 0; i < rows; i++) {
+		int_t r;
+		double s;
+		coarse_position(i, Z.rows(), r, s);
+		auto r1 = std::min(r + 1, Z.rows() - 1);
+		for (int_t j = 0; j < cols; j++) {
+			int_t c;
+			double t;
+			coarse_position(j, Z.cols(), c, t);
+			auto c1 = std::min(c + 1, Z.cols() - 1);
+
+			// the bilinear weights of the finite corners only
+			const int_t rs[] = { r, r, r1, r1 };
+			const int_t cs[] = { c, c1, c, c1 };
+			const double ws[] = { (1 - s) * (1 - t), (1 - s) * t, s * (1 - t), s * t };
+			double sum = 0, w_sum = 0;
+			for (int k = 0; k < 4; k++) {
+				auto z = Z(rs[k], cs[k]);
+				if (!std::isfinite(z)) continue;
+				sum += ws[k] * z;
+				w_sum += ws[k];
+			}
+			Z_fine(i, j) = w_sum > 0 ? sum / w_sum : std::numeric_limits<double>::quiet_NaN();
+		}
+	}
+	return Z_fine;
+}
@@ -0,0 +1,83 @@
+#ifndef WFR_PYRAMID_H
+#define WFR_PYRAMID_H
+
+#include "common.h"
+
+//! This is the pyramid of a frame, halved level by level
+/*!
+* The pixel (i, j) of the level l covers the 2^l x 2^l pixels of the frame
+* from (2^l * i, 2^l * j), clipped at the borders. A coarse pixel is valid
+* if at least 2 of its 4 finer pixels are, so a thin gap is not bridged by
+* a single pixel. Its slopes and its coordinates are the means over the
+* valid finer pixels, so the slopes stay at the centroid of the pixels they
+* are averaged from. The coordinates of an invalid pixel are the means over
+* all the finer pixels, which keeps the geometry finite.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRPyramid {
+private:
+	//! The halved frame of a level
+	struct Level {
+		MatrixXXd Sx;
+		MatrixXXd Sy;
+		MatrixXXd X;
+		MatrixXXd Y;
+	};
+
+	std::vector<Level> m_levels; /*!< the levels 1, 2, ..., the frame itself is not copied*/
+
+public:
+	//! Halve the frame num_levels times at most, while both sides keep kMinSize pixels
+	CWFRPyramid(
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		int num_levels /*!< [in] the coarse levels to build at most*/
+	);
+
+	//! Halve a frame of float slopes
+	CWFRPyramid(
+		const MatrixViewf& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewf& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y, /*!< [in] y coordinates*/
+		int num_levels /*!< [in] the coarse levels to build at most*/
+	);
+	virtual ~CWFRPyramid();
+
+	//! The smallest side of a coarse level
+	static const int_t kMinSize = 8;
+
+	//! The number of coarse levels built
+	int num_levels() const { return static_cast<int>(m_levels.size()); }
+
+	//! The slopes and the coordinates of the coarse level 1, ..., num_levels()
+	const MatrixXXd& Sx(int level) const { return m_levels[level - 1].Sx; }
+	const MatrixXXd& Sy(int level) const { return m_levels[level - 1].Sy; }
+	const MatrixXXd& X(int level) const { return m_levels[level - 1].X; }
+	const MatrixXXd& Y(int level) const { return m_levels[level - 1].Y; }
+
+	//! Interpolate the heights of a level to the next finer level bilinearly
+	/*!
+	* The weights are renormalized over the finite coarse pixels, and a fine
+	* pixel without any of them is NaN.
+	* \return the heights of the finer level of rows x cols
+	*/
+	static MatrixXXd prolongate(
+		const MatrixXXd& Z, /*!< [in] the heights of the coarse level*/
+		int_t rows, /*!< [in] the rows of the finer level*/
+		int_t cols /*!< [in] the cols of the finer level*/
+	);
+
+private:
+	//! Build the levels from slopes of any scalar type
+	template <class SlopeView>
+	void build(const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const MatrixViewd& Y, int num_levels);
+
+	//! Halve a level
+	template <class SlopeView>
+	static Level halve(const SlopeView& Sx, const SlopeView& Sy, const MatrixViewd& X, const MatrixViewd& Y);
+};
+
+
+#endif // !WFR_PYRAMID_H
@@ -0,0 +1,193 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_resample.h"
+#include "parallel.h"
+
+namespace {
+	//! The Newton iterations of the inverse bilinear map, and the tolerance of the cell border
+	const int kNewtonIterations = 8;
+	const double kInsideTolerance = 1e-9;
+
+	//! The mesh ids [first, last] of the points within [lo, hi], empty if first > last
+	void mesh_range(double lo, double hi, double min, double step, int_t n, int_t& first, int_t& last)
+	{
+		if (step <= 0) {
+			first = 0;
+			last = n - 1;
+			return;
+		}
+		first = std::max<int_t>(0, static_cast<int_t>(std::ceil((lo - min) / step - kInsideTolerance)));
+		last = std::min<int_t>(n - 1, static_cast<int_t>(std::floor((hi - min) / step + kInsideTolerance)));
+	}
+
+	//! The lower mesh id and the weight of the upper one of the coordinate p
+	void mesh_position(double p, double min, double step, int_t n, int_t& k, double& t)
+	{
+		auto f = step > 0 ? (p - min) / step : 0.0;
+		f = std::min(std::max(f, 0.0), static_cast<double>(n - 1));
+		k = std::min<int_t>(static_cast<int_t>(f), std::max<int_t>(n - 2, 0));
+		t = f - k;
+	}
+}
+
+CWFRResampler::CWFRResampler(const MatrixViewd& X, const MatrixViewd& Y, const MatrixXXb& valid, int num_threads)
+	: m_rows(X.rows())
+	, m_cols(X.cols())
+	, m_x_min(0)
+	, m_y_min(0)
+	, m_x_step(0)
+	, m_y_step(0)
+	, m_cells(MatrixXXi::Constant(X.rows(), X.cols(), -1))
+	, m_u(MatrixXXd::Zero(X.rows(), X.cols()))
+	, m_v(MatrixXXd::Zero(X.rows(), X.cols()))
+	, m_num_threads(num_threads)
+{
+	// the mesh over the bounding box of the valid pixels
+	auto inf = std::numeric_limits<double>::infinity();
+	double x_max = -inf, y_max = -inf;
+	m_x_min = inf;
+	m_y_min = inf;
+	for (int_t i = 0; i < m_rows; i++) {
+		for (int_t j = 0; j < m_cols; j++) {
+			if (!valid(i, j)) continue;
+			m_x_min = std::min(m_x_min, X(i, j));
+			m_y_min = std::min(m_y_min, Y(i, j));
+			x_max = std::max(x_max, X(i, j));
+			y_max = std::max(y_max, Y(i, j));
+		}
+	}
+	if (m_x_min > x_max) {
+		m_x_min = x_max = m_y_min = y_max = 0;
+	}
+	if (m_cols > 1) m_x_step = (x_max - m_x_min) / (m_cols - 1);
+	if (m_rows > 1) m_y_step = (y_max - m_y_min) / (m_rows - 1);
+
+	m_mesh_X.resize(m_rows, m_cols);
+	m_mesh_Y.resize(m_rows, m_cols);
+	for (int_t i = 0; i < m_rows; i++) {
+		for (int_t j = 0; j < m_cols; j++) {
+			m_mesh_X(i, j) = m_x_min + j * m_x_step;
+			m_mesh_Y(i, j) = m_y_min + i * m_y_step;
+		}
+	}
+
+	// bin the valid cells by the mesh rows they cover
+	std::vector<std::vector<int32_t>> bins(m_rows);
+	for (int_t i = 0; i + 1 < m_rows; i++) {
+		for (int_t j = 0; j + 1 < m_cols; j++) {
+			if (!valid(i, j) || !valid(i, j + 1) || !valid(i + 1, j) || !valid(i + 1, j + 1)) continue;
+			auto lo = std::min({ Y(i, j), Y(i, j + 1), Y(i + 1, j), Y(i + 1, j + 1) });
+			auto hi = std::max({ Y(i, j), Y(i, j + 1), Y(i + 1, j), Y(i + 1, j + 1) });
+			int_t first, last;
+			mesh_range(lo, hi, m_y_min, m_y_step, m_rows, first, last);
+			for (int_t r = first; r <= last; r++) bins[r].push_back(static_cast<int32_t>(i * m_cols + j));
+		}
+	}
+
+	// locate the mesh points row by row
+	parallel_for(0, m_rows, m_num_threads, 4, [&](int_t begin, int_t end) {
+		for (int_t r = begin; r < end; r++) {
+			auto y = m_mesh_Y(r, 0);
+			for (auto cell : bins[r]) {
+				auto i = cell / m_cols, j = cell % m_cols;
+				auto lo = std::min({ X(i, j), X(i, j + 1), X(i + 1, j), X(i + 1, j + 1) });
+				auto hi = std::max({ X(i, j), X(i, j + 1), X(i + 1, j), X(i + 1, j + 1) });
+				int_t first, last;
+				mesh_range(lo, hi, m_x_min, m_x_step, m_cols, first, last);
+				for (int_t c = first; c <= last; c++) {
+					if (m_cells(r, c) >= 0) continue;
+					double u, v;
+					if (locate(X, Y, i, j, m_mesh_X(r, c), y, u, v)) {
+						m_cells(r, c) = cell;
+						m_u(r, c) = u;
+						m_v(r, c) = v;
+					}
+				}
+			}
+		}
+	});
+}
+
+CWFRResampler::~CWFRResampler()
+{
+}
+
+bool CWFRResampler::locate(const MatrixViewd& X, const MatrixViewd& Y, int_t i, int_t j, double x, double y, double& u, double& v)
+{
+	// P(u, v) = P00 + u * (P01 - P00) + v * (P10 - P00) + u * v * (P11 - P10 - P01 + P00)
+	double ax = X(i, j + 1) - X(i, j), ay = Y(i, j + 1) - Y(i, j);
+	double bx = X(i + 1, j) - X(i, j), by = Y(i + 1, j) - Y(i, j);
+	double cx = X(i + 1, j + 1) - X(i + 1, j) - ax, cy = Y(i + 1, j + 1) - Y(i + 1, j) - ay;
+	double px = x - X(i, j), py = y - Y(i, j);
+
+	u = 0.5;
+	v = 0.5;
+	for (int k = 0; k < kNewtonIterations; k++) {
+		double fx = ax * u + bx * v + cx * u * v - px;
+		double fy = ay * u + by * v + cy * u * v - py;
+		double j00 = ax + cx * v, j01 = bx + cx * u;
+		double j10 = ay + cy * v, j11 = by + cy * u;
+		double det = j00 * j11 - j01 * j10;
+		if (det == 0) return false;
+		u -= (j11 * fx - j01 * fy) / det;
+		v -= (j00 * fy - j10 * fx) / det;
+	}
+
+	if (!(u >= -kInsideTolerance && u <= 1 + kInsideTolerance && v >= -kInsideTolerance && v <= 1 + kInsideTolerance)) return false;
+	u = std::min(std::max(u, 0.0), 1.0);
+	v = std::min(std::max(v, 0.0), 1.0);
+	return true;
+}
+
+MatrixXXd CWFRResampler::to_mesh(const MatrixViewd& V) const
+{
+	MatrixXXd Vr(m_rows, m_cols);
+	parallel_for(0, m_rows, m_num_threads, 16, [&](int_t begin, int_t end) {
+		for (int_t r = begin; r < end; r++) {
+			for (int_t c = 0; c < m_cols; c++) {
+				auto cell = m_cells(r, c);
+				if (cell < 0) {
+					Vr(r, c) = std::numeric_limits<double>::quiet_NaN();
+					continue;
+				}
+				auto i = cell / m_cols, j = cell % m_cols;
+				auto u = m_u(r, c), v = m_v(r, c);
+				Vr(r, c) = (1 - v) * ((1 - u) * V(i, j) + u * V(i, j + 1)) + v * ((1 - u) * V(i + 1, j) + u * V(i + 1, j + 1));
+			}
+		}
+	});
+	return Vr;
+}
+
+MatrixXXd CWFRResampler::from_mesh(const MatrixViewd& Zr, const MatrixViewd& X, const MatrixViewd& Y, const MatrixXXb& valid) const
+{
+	MatrixXXd Z(X.rows(), X.cols());
+	parallel_for(0, X.rows(), m_num_threads, 16, [&](int_t begin, int_t end) {
+		for (int_t i = begin; i < end; i++) {
+			for (int_t j = 0; j < X.cols(); j++) {
+				Z(i, j) = std::numeric_limits<double>::quiet_NaN();
+				if (!valid(i, j)) continue;
+
+				int_t r, c;
+				double t, s;
+				mesh_position(Y(i, j), m_y_min, m_y_step, m_rows, r, s);
+				mesh_position(X(i, j), m_x_min, m_x_step, m_cols, c, t);
+				auto r1 = std::min(r + 1, m_rows - 1), c1 = std::min(c + 1, m_cols - 1);
+
+				// the bilinear weights of the finite corners only
+				const int_t rs[] = { r, r, r1, r1 };
+				const int_t cs[] = { c, c1, c, c1 };
+				const double ws[] = { (1 - s) * (1 - t), (1 - s) * t, s * (1 - t), s * t };
+				double sum = 0, w_sum = 0;
+				for (int k = 0; k < 4; k++) {
+					auto z = Zr(rs[k], cs[k]);
+					if (!std::isfinite(z)) continue;
+					sum += ws[k] * z;
+					w_sum += ws[k];
+				}
+				if (w_sum > kInsideTolerance) Z(i, j) = sum / w_sum;
+			}
+		}
+	});
+	return Z;
+}
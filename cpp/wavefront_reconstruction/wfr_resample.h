@@ -0,0 +1,72 @@
+#ifndef WFR_RESAMPLE_H
+#define WFR_RESAMPLE_H
+
+#include "common.h"
+
+//! This is the resampling between a quadrilateral grid and a rectangular mesh
+/*!
+* The mesh has the size of the grid and spans the bounding box of its valid
+* pixels, as the mesh of tfli2i.m, hfli2i.m and sli2i.m. Every mesh point is
+* located in a quadrilateral cell of the grid whose 4 corners are valid, by
+* inverting the bilinear map of the cell, and the values are interpolated
+* bilinearly within the cell. The mesh points outside all such cells are NaN.
+* The way back is the bilinear interpolation on the regular mesh.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRResampler {
+private:
+	int_t m_rows;
+	int_t m_cols;
+	MatrixXXd m_mesh_X;
+	MatrixXXd m_mesh_Y;
+	double m_x_min;
+	double m_y_min;
+	double m_x_step;
+	double m_y_step;
+	MatrixXXi m_cells; /*!< the grid id of the top-left corner of the cell of every mesh point, -1 for none*/
+	MatrixXXd m_u; /*!< the bilinear coordinate along the grid rows*/
+	MatrixXXd m_v; /*!< the bilinear coordinate along the grid columns*/
+	int m_num_threads;
+
+public:
+	CWFRResampler(
+		const MatrixViewd& X, /*!< [in] x coordinates of the grid*/
+		const MatrixViewd& Y, /*!< [in] y coordinates of the grid*/
+		const MatrixXXb& valid, /*!< [in] the valid pixels of the grid*/
+		int num_threads = 1 /*!< [in] number of threads, 0 for all the hardware threads*/
+	);
+	virtual ~CWFRResampler();
+
+	//! Interpolate the values of the grid to the mesh
+	/*!
+	* \return the values of the mesh, NaN outside the valid cells
+	*/
+	MatrixXXd to_mesh(
+		const MatrixViewd& V /*!< [in] the values of the grid*/
+	) const;
+
+	//! Interpolate the values of the mesh back to the valid pixels of a grid
+	/*!
+	* The weights are renormalized over the finite neighbours, so the border
+	* of the mesh does not lose the pixels next to it.
+	* \return the values of the grid, NaN for the invalid pixels
+	*/
+	MatrixXXd from_mesh(
+		const MatrixViewd& Zr, /*!< [in] the values of the mesh*/
+		const MatrixViewd& X, /*!< [in] x coordinates of the grid*/
+		const MatrixViewd& Y, /*!< [in] y coordinates of the grid*/
+		const MatrixXXb& valid /*!< [in] the valid pixels of the grid*/
+	) const;
+
+	const MatrixXXd& mesh_X() const { return m_mesh_X; }
+	const MatrixXXd& mesh_Y() const { return m_mesh_Y; }
+
+private:
+	//! Find (u, v) of the point (x, y) in the cell with the top-left corner (i, j)
+	/*!
+	* \return true if the point is inside the cell
+	*/
+	static bool locate(const MatrixViewd& X, const MatrixViewd& Y, int_t i, int_t j, double x, double y, double& u, double& v);
+};
+
+
+#endif // !WFR_RESAMPLE_H
@@ -0,0 +1,62 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_service.h"
+#include "wfr_plan.h"
+
+
+CWFRService::CWFRService(std::shared_ptr<CWFRThreadPool> pool, const CWFR::SolverOptions& options)
+	: m_pool(pool ? std::move(pool) : std::make_shared<CWFRThreadPool>())
+	, m_options(options)
+	, m_plan_cache(std::make_shared<CWFRPlanCache>())
+	, m_cancellation(std::make_shared<Cancellation>())
+{
+}
+
+CWFRService::~CWFRService()
+{
+	cancel_all();
+}
+
+std::future<CWFRService::Result> CWFRService::submit(MatrixXXd Sx, MatrixXXd Sy, MatrixXXd X, MatrixXXd Y, CWFR::WFR_METHOD method, PRIORITY priority, std::shared_ptr<const Cancellation> cancellation)
+{
+	auto promise = std::make_shared<std::promise<Result>>();
+	auto future = promise->get_future();
+	std::shared_ptr<const Cancellation> cancellation_all;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		cancellation_all = m_cancellation;
+	}
+
+	m_pool->submit([promise, cancellation, cancellation_all, plan_cache = m_plan_cache, options = m_options, method,
+		Sx = std::move(Sx), Sy = std::move(Sy), X = std::move(X), Y = std::move(Y)]() mutable {
+		Result result;
+		if (cancellation_all->is_cancelled() || (cancellation && cancellation->is_cancelled())) {
+			result.is_cancelled = true;
+			promise->set_value(std::move(result));
+			return;
+		}
+
+		try {
+			// the chunks of the assembly go to the pool, see parallel_for()
+			CWFR wfr(std::move(Sx), std::move(Sy), std::move(X), std::move(Y));
+			wfr.set_num_threads(0);
+			wfr.set_plan_cache(plan_cache);
+			result.Z = wfr(method, options);
+			result.report = wfr.report();
+			if (!result.report.success()) result.Z.resize(0, 0);
+		}
+		catch (...) {
+			promise->set_exception(std::current_exception());
+			return;
+		}
+		promise->set_value(std::move(result));
+	}, priority);
+	return future;
+}
+
+void CWFRService::cancel_all()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cancellation->cancel();
+	m_cancellation = std::make_shared<Cancellation>();
+}
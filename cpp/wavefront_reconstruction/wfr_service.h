@@ -0,0 +1,94 @@
+#ifndef WFR_SERVICE_H
+#define WFR_SERVICE_H
+
+#include "common.h"
+#include "cwfr.h"
+#include "wfr_thread_pool.h"
+
+#include <future>
+
+class CWFRPlanCache;
+
+//! This is the asynchronous front end of the reconstructions
+/*!
+* Every request is a CWFR instance of its own, run by a worker of a fixed
+* CWFRThreadPool. The assembly of a request runs its parallel_for() chunks
+* on the same pool, so the idle workers help the running requests, while
+* a busy pool runs every request on one thread. Either way, the service
+* runs no more threads than the pool, whatever the number of requests.
+* The requests share a plan cache, so the frames of the same geometry and
+* validity mask only assemble g and solve with the cached factorization.
+* The queued requests capture no reference to the service, which can be
+* destroyed while they are in a pool shared with other services.
+* An exception of a request, e.g. std::bad_alloc, is rethrown by the get()
+* of its future, the workers keep running.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRService {
+public:
+	using PRIORITY = CWFRThreadPool::PRIORITY;
+
+	//! The outcome of a request
+	struct Result {
+		MatrixXXd Z; /*!< the reconstructed wavefront, empty if the request was cancelled or failed*/
+		CWFR::SolverReport report; /*!< the outcome of the solve, success if cancelled*/
+		bool is_cancelled = false; /*!< the request was cancelled before it started*/
+	};
+
+	//! The flag cancelling the requests sharing it
+	class Cancellation {
+	private:
+		std::atomic<bool> m_is_cancelled{ false };
+
+	public:
+		void cancel() { m_is_cancelled = true; }
+		bool is_cancelled() const { return m_is_cancelled; }
+	};
+
+private:
+	std::shared_ptr<CWFRThreadPool> m_pool;
+	CWFR::SolverOptions m_options;
+	std::shared_ptr<CWFRPlanCache> m_plan_cache;
+	std::shared_ptr<Cancellation> m_cancellation; /*!< the flag of the requests submitted since the last cancel_all()*/
+	std::mutex m_mutex;
+
+public:
+	CWFRService(
+		std::shared_ptr<CWFRThreadPool> pool = nullptr, /*!< [in] the pool, nullptr for one of all the hardware threads*/
+		const CWFR::SolverOptions& options = CWFR::SolverOptions() /*!< [in] the solver backend*/
+	);
+	//! Cancel the queued requests, the running ones still deliver their results
+	virtual ~CWFRService();
+
+	// Disable copying
+	CWFRService(const CWFRService&) = delete;
+	CWFRService& operator=(const CWFRService&) = delete;
+
+	//! Queue the reconstruction of a frame
+	/*!
+	* A request cancelled before it starts is skipped, a running one is
+	* completed.
+	* \return the future of the result, see Result
+	*/
+	std::future<Result> submit(
+		MatrixXXd Sx,/*!< [in] Slopes in x direction*/
+		MatrixXXd Sy,/*!< [in] Slopes in y direction*/
+		MatrixXXd X, /*!< [in] x coordinates*/
+		MatrixXXd Y, /*!< [in] y coordinates*/
+		CWFR::WFR_METHOD method = CWFR::WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		PRIORITY priority = PRIORITY::BATCH, /*!< [in] LIVE to start before all the BATCH requests*/
+		std::shared_ptr<const Cancellation> cancellation = nullptr /*!< [in] the flag cancelling the request, nullptr for none*/
+	);
+
+	//! Cancel all the requests submitted so far
+	void cancel_all();
+
+	//! Share the plan cache with other services or CWFR instances
+	void set_plan_cache(
+		std::shared_ptr<CWFRPlanCache> plan_cache /*!< [in] the cache, must not be nullptr*/
+	) { m_plan_cache = std::move(plan_cache); }
+
+	const std::shared_ptr<CWFRThreadPool>& pool() const { return m_pool; }
+};
+
+
+#endif // !WFR_SERVICE_H
@@ -0,0 +1,50 @@
+#ifndef WFR_STOPWATCH_H
+#define WFR_STOPWATCH_H
+
+#include <chrono>
+
+//! This is the stopwatch of the phases of a reconstruction
+/*!
+* Every lap() adds the time since the previous lap to a phase. A disabled
+* stopwatch never reads the clock, so the timing costs nothing unless the
+* stats are asked for.
+*/
+class CWFRStopwatch {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	bool m_is_enabled;
+	Clock::time_point m_start;
+	Clock::time_point m_last;
+
+public:
+	explicit CWFRStopwatch(
+		bool is_enabled = true /*!< [in] false to skip the timing*/
+	)
+		: m_is_enabled(is_enabled)
+	{
+		if (m_is_enabled) m_start = m_last = Clock::now();
+	}
+
+	//! Add the time since the previous lap to the seconds of a phase
+	void lap(
+		double& seconds /*!< [in, out] the seconds of the phase*/
+	)
+	{
+		if (!m_is_enabled) return;
+		auto now = Clock::now();
+		seconds += std::chrono::duration<double>(now - m_last).count();
+		m_last = now;
+	}
+
+	//! The seconds since the start, 0 if disabled
+	double total() const
+	{
+		return m_is_enabled ? std::chrono::duration<double>(Clock::now() - m_start).count() : 0;
+	}
+
+	bool is_enabled() const { return m_is_enabled; }
+};
+
+
+#endif // !WFR_STOPWATCH_H
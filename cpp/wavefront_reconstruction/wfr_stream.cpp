@@ -0,0 +1,65 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_stream.h"
+#include "wfr_plan.h"
+
+
+CWFRStream::CWFRStream(const MatrixXXd& X, const MatrixXXd& Y, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+	: CWFRStream(std::make_shared<const CWFRGeometry>(X, Y), method, options)
+{
+}
+
+CWFRStream::CWFRStream(std::shared_ptr<const CWFRGeometry> geometry, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+	: m_geometry(std::move(geometry))
+	, m_method(method)
+	, m_options(options)
+	, m_plan_cache(std::make_shared<CWFRPlanCache>())
+	, m_num_threads(1)
+	, m_workspace(std::make_shared<CWFR::Workspace>())
+{
+}
+
+CWFRStream::~CWFRStream()
+{
+}
+
+MatrixXXd CWFRStream::operator()(const MatrixViewd& Sx, const MatrixViewd& Sy)
+{
+	CWFR wfr(Sx, Sy, m_geometry);
+	wfr.set_plan_cache(m_plan_cache);
+	wfr.set_num_threads(m_num_threads);
+	wfr.set_initial_guess(m_Z_last);
+
+	MatrixXXd Z = wfr(m_method, m_options);
+	m_report = wfr.report();
+
+	// a failed frame does not seed the next one
+	if (m_report.success()) {
+		m_Z_last = Z;
+	}
+	else {
+		reset();
+	}
+	return Z;
+}
+
+bool CWFRStream::operator()(const MatrixViewd& Sx, const MatrixViewd& Sy, Eigen::Ref<MatrixXXd> Z)
+{
+	CWFR wfr(Sx, Sy, m_geometry);
+	wfr.set_plan_cache(m_plan_cache);
+	wfr.set_workspace(m_workspace);
+	wfr.set_num_threads(m_num_threads);
+	wfr.set_initial_guess(m_Z_last);
+
+	bool is_solved = wfr.reconstruct_into(Z, m_method, m_options);
+	m_report = wfr.report();
+
+	// a failed frame does not seed the next one
+	if (is_solved) {
+		m_Z_last = Z;
+	}
+	else {
+		reset();
+	}
+	return is_solved;
+}
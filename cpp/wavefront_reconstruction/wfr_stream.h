@@ -0,0 +1,87 @@
+#ifndef WFR_STREAM_H
+#define WFR_STREAM_H
+
+#include "common.h"
+#include "cwfr.h"
+
+class CWFRPlanCache;
+
+//! This is the reconstruction of a live stream of frames sharing the geometry
+/*!
+* Consecutive frames of a metrology loop differ very little, so every solve
+* starts from the result of the previous frame, mapped through the valid ids
+* of the new frame. The frames with the same validity mask share a plan from
+* the plan cache, so only g is assembled per frame. The default backend is
+* LSCG, as the direct backends do not benefit from the initial guess.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRStream {
+private:
+	std::shared_ptr<const CWFRGeometry> m_geometry;
+	CWFR::WFR_METHOD m_method;
+	CWFR::SolverOptions m_options;
+	std::shared_ptr<CWFRPlanCache> m_plan_cache;
+	int m_num_threads;
+	MatrixXXd m_Z_last; /*!< the result of the last successful frame*/
+	std::shared_ptr<CWFR::Workspace> m_workspace;
+	CWFR::SolverReport m_report;
+
+public:
+	CWFRStream(
+		const MatrixXXd& X, /*!< [in] x coordinates*/
+		const MatrixXXd& Y, /*!< [in] y coordinates*/
+		CWFR::WFR_METHOD method = CWFR::WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options = CWFR::SolverOptions(CWFR::WFR_SOLVER::LSCG) /*!< [in] the solver backend*/
+	);
+
+	//! Share the geometry with other streams or CWFR instances
+	CWFRStream(
+		std::shared_ptr<const CWFRGeometry> geometry, /*!< [in] the geometry, must not be nullptr*/
+		CWFR::WFR_METHOD method = CWFR::WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options = CWFR::SolverOptions(CWFR::WFR_SOLVER::LSCG) /*!< [in] the solver backend*/
+	);
+	virtual ~CWFRStream();
+
+	// Disable default constructor and copying
+	CWFRStream() = delete;
+	CWFRStream(const CWFRStream&) = delete;
+	CWFRStream& operator=(const CWFRStream&) = delete;
+
+	//! Reconstruct the next frame, seeded with the last result
+	/*!
+	* The slopes are viewed in place, see CWFR.
+	* \return the reconstructed wavefront Z, all zeros if the solve failed
+	*/
+	MatrixXXd operator () (
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy /*!< [in] Slopes in y direction*/
+		);
+
+	//! Reconstruct the next frame into a buffer of the caller, seeded with the last result
+	/*!
+	* The frames reuse the buffers of one workspace, see CWFR::reconstruct_into().
+	* \return false if the solve failed, Z is all zeros then
+	*/
+	bool operator () (
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		Eigen::Ref<MatrixXXd> Z /*!< [out] the reconstructed wavefront, of the size of the slopes*/
+		);
+
+	//! Forget the last result, so the next frame starts from zero
+	void reset() { m_Z_last.resize(0, 0); }
+
+	//! Share the plan cache with other streams or CWFR instances
+	void set_plan_cache(
+		std::shared_ptr<CWFRPlanCache> plan_cache /*!< [in] the cache, must not be nullptr*/
+	) { m_plan_cache = std::move(plan_cache); }
+
+	void set_num_threads(
+		int num_threads /*!< [in] number of threads, 0 for all the hardware threads, 1 for serial*/
+	) { m_num_threads = num_threads; }
+
+	//! The outcome of the last frame
+	const CWFR::SolverReport& report() const { return m_report; }
+};
+
+
+#endif // !WFR_STREAM_H
@@ -0,0 +1,131 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_thread_pool.h"
+#include "parallel.h"
+
+#ifdef EIGEN_USE_MKL_ALL
+#include <mkl.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+	//! The pool and the id of the calling worker
+	thread_local CWFRThreadPool* t_pool = nullptr;
+	thread_local int t_worker = -1;
+}
+
+
+CWFRThreadPool::CWFRThreadPool(int num_threads)
+	: m_num_pending(0)
+	, m_is_stopping(false)
+{
+	num_threads = resolve_num_threads(num_threads);
+	for (int id = 0; id < num_threads; id++) m_workers.push_back(std::make_unique<Worker>());
+	for (int id = 0; id < num_threads; id++) m_workers[id]->thread = std::thread(&CWFRThreadPool::run, this, id);
+}
+
+CWFRThreadPool::~CWFRThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_is_stopping = true;
+	}
+	m_has_task.notify_all();
+	for (auto& worker : m_workers) worker->thread.join();
+}
+
+void CWFRThreadPool::submit(Task task, PRIORITY priority)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queues[static_cast<int>(priority)].push_back(std::move(task));
+		m_num_pending++;
+	}
+	m_has_task.notify_one();
+}
+
+void CWFRThreadPool::push_local(Task task)
+{
+	eigen_assert(t_pool == this);
+	auto& worker = *m_workers[t_worker];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_num_pending++;
+	}
+	m_has_task.notify_one();
+}
+
+CWFRThreadPool* CWFRThreadPool::current()
+{
+	return t_pool;
+}
+
+bool CWFRThreadPool::take(int id, Task& task)
+{
+	auto n = size();
+	bool is_taken = false;
+
+	// the newest task of the own deque, then the oldest one of the others
+	for (int k = 0; k < n && !is_taken; k++) {
+		auto& worker = *m_workers[(id + k) % n];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (worker.tasks.empty()) continue;
+		if (k == 0) {
+			task = std::move(worker.tasks.back());
+			worker.tasks.pop_back();
+		}
+		else {
+			task = std::move(worker.tasks.front());
+			worker.tasks.pop_front();
+		}
+		is_taken = true;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& queue : m_queues) {
+		if (is_taken) break;
+		if (queue.empty()) continue;
+		task = std::move(queue.front());
+		queue.pop_front();
+		is_taken = true;
+	}
+	if (is_taken) m_num_pending--;
+	return is_taken;
+}
+
+void CWFRThreadPool::run(int id)
+{
+	t_pool = this;
+	t_worker = id;
+
+	// the parallelism comes from the pool, not from the libraries below
+#ifdef EIGEN_USE_MKL_ALL
+	mkl_set_num_threads_local(1);
+#endif
+#ifdef _OPENMP
+	omp_set_num_threads(1);
+#endif
+
+	Task task;
+	for (;;) {
+		if (take(id, task)) {
+			// the tasks pass their exceptions on, e.g. to a promise, the rest must not end the worker
+			try {
+				task();
+			}
+			catch (...) {
+			}
+			task = nullptr;
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_has_task.wait(lock, [this] { return m_num_pending > 0 || m_is_stopping; });
+		if (m_num_pending <= 0 && m_is_stopping) return;
+	}
+}
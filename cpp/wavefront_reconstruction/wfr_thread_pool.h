@@ -0,0 +1,89 @@
+#ifndef WFR_THREAD_POOL_H
+#define WFR_THREAD_POOL_H
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+//! This is a fixed pool of work-stealing threads
+/*!
+* Every worker owns a deque of tasks. A worker pushes the chunks of its own
+* parallel_for() to the back of its deque and pops them from there, while
+* the idle workers steal the oldest tasks from the front of the others'
+* deques. The tasks submitted from outside the pool wait in one queue per
+* priority, and a worker only takes them when no deque has any task left,
+* so a running request finishes before a new one starts, and a live request
+* starts before any batch one.
+* The workers run MKL and OpenMP with one thread each, so the pool never
+* runs more threads than it was built with. An exception escaping a task is
+* dropped, the tasks pass theirs on themselves, see parallel_for().
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRThreadPool {
+public:
+	using Task = std::function<void()>;
+
+	enum class PRIORITY {
+		LIVE, /*!< the frames of a live measurement, taken first*/
+		BATCH /*!< the re-processing of recorded frames*/
+	};
+
+private:
+	//! The deque of a worker
+	struct Worker {
+		std::deque<Task> tasks;
+		std::mutex mutex;
+		std::thread thread;
+	};
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::deque<Task> m_queues[2]; /*!< the submitted tasks of every priority*/
+	std::mutex m_mutex;
+	std::condition_variable m_has_task;
+	int_t m_num_pending; /*!< the tasks in all the deques and queues, guarded by m_mutex*/
+	bool m_is_stopping;
+
+public:
+	explicit CWFRThreadPool(
+		int num_threads = 0 /*!< [in] number of threads, 0 for all the hardware threads*/
+	);
+	//! Run the remaining tasks, and join the workers
+	virtual ~CWFRThreadPool();
+
+	// Disable copying
+	CWFRThreadPool(const CWFRThreadPool&) = delete;
+	CWFRThreadPool& operator=(const CWFRThreadPool&) = delete;
+
+	//! Queue a task from any thread
+	void submit(
+		Task task, /*!< [in] the task*/
+		PRIORITY priority = PRIORITY::BATCH /*!< [in] the queue of the task*/
+	);
+
+	//! Push a task to the deque of the calling worker, to be stolen by the idle ones
+	/*!
+	* Must be called from a worker of this pool, see current().
+	*/
+	void push_local(
+		Task task /*!< [in] the task*/
+	);
+
+	int size() const { return static_cast<int>(m_workers.size()); }
+
+	//! The pool of the calling thread
+	/*!
+	* \return the pool, or nullptr if the calling thread is not a worker
+	*/
+	static CWFRThreadPool* current();
+
+private:
+	//! Take a task of the own deque, of another deque, or of the queues in this order
+	bool take(int id, Task& task);
+
+	void run(int id);
+};
+
+
+#endif // !WFR_THREAD_POOL_H
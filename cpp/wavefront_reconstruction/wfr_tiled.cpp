@@ -0,0 +1,260 @@
+#include "pch.h"
+#include "framework.h"
+#include "wfr_tiled.h"
+#include "wfr_plan.h"
+#include "parallel.h"
+
+#include <map>
+
+namespace {
+	//! The tiles along one axis, the cores split evenly and extended by the overlap
+	class Axis {
+	private:
+		int_t m_length;
+		int_t m_overlap;
+		std_veci m_cores; /*!< the first id of every core, then the length*/
+		VectorXd m_weight_sums; /*!< the sum of the weights of all the tiles at every id*/
+
+	public:
+		Axis(int_t length, int_t tile_size, int_t overlap)
+			: m_length(length)
+		{
+			auto n = std::max<int_t>(1, (length + tile_size - 1) / std::max<int_t>(tile_size, 1));
+			for (int_t a = 0; a <= n; a++) m_cores.push_back(a * length / n);
+
+			// the extended tiles only overlap their direct neighbours
+			m_overlap = std::max<int_t>(0, std::min(overlap, length / n / 2));
+
+			m_weight_sums = VectorXd::Zero(length);
+			for (int_t a = 0; a < n; a++) {
+				for (int_t i = begin(a); i < end(a); i++) m_weight_sums(i) += weight(a, i);
+			}
+		}
+
+		int_t size() const { return static_cast<int_t>(m_cores.size()) - 1; }
+		int_t core_begin(int_t a) const { return m_cores[a]; }
+		int_t core_end(int_t a) const { return m_cores[a + 1]; }
+		int_t begin(int_t a) const { return std::max<int_t>(0, m_cores[a] - m_overlap); }
+		int_t end(int_t a) const { return std::min(m_length, m_cores[a + 1] + m_overlap); }
+		double weight_sum(int_t i) const { return m_weight_sums(i); }
+
+		//! 1 in the core, ramping down linearly towards the ends of the extended tile
+		double weight(int_t a, int_t i) const
+		{
+			if (i < core_begin(a)) return (i - begin(a) + 1.0) / (core_begin(a) - begin(a) + 1.0);
+			if (i >= core_end(a)) return (end(a) - i) / (end(a) - core_end(a) + 1.0);
+			return 1.0;
+		}
+	};
+
+	//! The part of a tile solution shared with a neighbour
+	struct Overlap {
+		int_t neighbour;
+		int_t r0;
+		int_t c0;
+		MatrixXXd Z;
+		MatrixXXi labels; /*!< the connected aperture of every pixel in the tile, -1 if invalid*/
+	};
+
+	struct TileResult {
+		int_t num_components = 0;
+		MatrixXXi labels; /*!< the connected aperture of every pixel, numbered as the pistons of the tile*/
+		std::vector<Overlap> overlaps;
+		CWFR::SolverReport report;
+	};
+
+	//! The connected aperture of every pixel, -1 if invalid
+	MatrixXXi component_labels(const CWFRAssembly& assembly)
+	{
+		MatrixXXi labels = assembly.ids();
+		for (int_t id = 0; id < labels.size(); id++) {
+			auto& label = labels.data()[id];
+			if (label >= 0) label = static_cast<int32_t>(assembly.components()[label]);
+		}
+		return labels;
+	}
+}
+
+
+CWFRTiled::CWFRTiled(int_t tile_size, int_t overlap, CWFR::WFR_METHOD method, const CWFR::SolverOptions& options)
+	: m_tile_size(std::max<int_t>(tile_size, 1))
+	, m_overlap(std::max<int_t>(overlap, 0))
+	, m_method(method)
+	, m_options(options)
+	, m_num_threads(1)
+{
+}
+
+CWFRTiled::~CWFRTiled()
+{
+}
+
+MatrixXXd CWFRTiled::operator()(const MatrixViewd& Sx, const MatrixViewd& Sy, const MatrixViewd& X, const MatrixViewd& Y)
+{
+	auto rows = Sx.rows();
+	auto cols = Sx.cols();
+	Axis row_axis(rows, m_tile_size, m_overlap);
+	Axis col_axis(cols, m_tile_size, m_overlap);
+	auto n_tiles = row_axis.size() * col_axis.size();
+
+	// the extended blocks of the tile t, viewed in place
+	auto block = [&](const MatrixViewd& M, int_t t) -> MatrixViewd {
+		auto a = t / col_axis.size(), b = t % col_axis.size();
+		return M.block(row_axis.begin(a), col_axis.begin(b), row_axis.end(a) - row_axis.begin(a), col_axis.end(b) - col_axis.begin(b));
+	};
+
+	// solve the tiles, keep their overlaps and add their weighted solutions
+	MatrixXXd Z = MatrixXXd::Zero(rows, cols);
+	std::vector<TileResult> results(n_tiles);
+	std::mutex mutex;
+	parallel_for(0, n_tiles, m_num_threads, 1, [&](int_t begin, int_t end) {
+		for (int_t t = begin; t < end; t++) {
+			auto a = t / col_axis.size(), b = t % col_axis.size();
+			auto r0 = row_axis.begin(a), c0 = col_axis.begin(b);
+			auto Sx_t = block(Sx, t), Sy_t = block(Sy, t);
+
+			CWFRAssembly assembly(Sx_t, Sy_t, m_options.ordering);
+			if (assembly.num_unknowns() == 0) continue;
+			CWFRPlan plan(0, m_method, std::move(assembly), m_options);
+
+			auto& result = results[t];
+			VectorXd g(plan.num_equations()), z;
+			plan.assemble_g(Sx_t, Sy_t, block(X, t), block(Y, t), g);
+			if (!plan.solve(g, z, result.report)) continue;
+			result.num_components = plan.num_components();
+			MatrixXXd Z_t = plan.scatter(z);
+			result.labels = component_labels(plan.assembly());
+			const auto& labels = result.labels;
+
+			for (int_t na = std::max<int_t>(a - 1, 0); na <= std::min(a + 1, row_axis.size() - 1); na++) {
+				for (int_t nb = std::max<int_t>(b - 1, 0); nb <= std::min(b + 1, col_axis.size() - 1); nb++) {
+					auto i0 = std::max(r0, row_axis.begin(na)), i1 = std::min(row_axis.end(a), row_axis.end(na));
+					auto j0 = std::max(c0, col_axis.begin(nb)), j1 = std::min(col_axis.end(b), col_axis.end(nb));
+					if ((na == a && nb == b) || i1 <= i0 || j1 <= j0) continue;
+					result.overlaps.push_back({ na * col_axis.size() + nb, i0, j0,
+						Z_t.block(i0 - r0, j0 - c0, i1 - i0, j1 - j0), labels.block(i0 - r0, j0 - c0, i1 - i0, j1 - j0) });
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int_t i = 0; i < Z_t.rows(); i++) {
+				for (int_t j = 0; j < Z_t.cols(); j++) {
+					if (labels(i, j) >= 0) Z(r0 + i, c0 + j) += row_axis.weight(a, r0 + i) * col_axis.weight(b, c0 + j) * Z_t(i, j);
+				}
+			}
+		}
+	});
+
+	// the worst of all the tiles
+	m_report = CWFR::SolverReport();
+	m_report.solver = m_options.solver;
+	for (const auto& result : results) m_report.merge(result.report);
+	if (!m_report.success()) return MatrixXXd::Zero(rows, cols);
+
+	// one piston per connected aperture of every tile
+	std_veci offsets(n_tiles + 1, 0);
+	for (int_t t = 0; t < n_tiles; t++) offsets[t + 1] = offsets[t] + results[t].num_components;
+	auto n_nodes = offsets.back();
+
+	std_veci parent(n_nodes);
+	for (int_t k = 0; k < n_nodes; k++) parent[k] = k;
+	auto find = [&parent](int_t k) {
+		while (parent[k] != k) k = parent[k] = parent[parent[k]];
+		return k;
+	};
+
+	// the mismatches of the pixels valid in both tiles of an overlap
+	std::map<std::pair<int_t, int_t>, std::pair<double, double>> links; /*!< the count and the sum of z_a - z_b*/
+	for (int_t t = 0; t < n_tiles; t++) {
+		for (const auto& ov : results[t].overlaps) {
+			if (ov.neighbour < t) continue;
+			for (const auto& other : results[ov.neighbour].overlaps) {
+				if (other.neighbour != t) continue;
+				for (int_t id = 0; id < ov.Z.size(); id++) {
+					auto la = ov.labels.data()[id], lb = other.labels.data()[id];
+					if (la < 0 || lb < 0) continue;
+					auto& link = links[{ offsets[t] + la, offsets[ov.neighbour] + lb }];
+					link.first += 1;
+					link.second += ov.Z.data()[id] - other.Z.data()[id];
+				}
+			}
+		}
+	}
+
+	// the normal equations of the pistons, pinned at the first piston of every connected aperture
+	TripletListd L_trps;
+	VectorXd rhs = VectorXd::Zero(n_nodes);
+	for (const auto& link : links) {
+		auto u = link.first.first, v = link.first.second;
+		auto count = link.second.first, sum = link.second.second;
+		L_trps.emplace_back(u, u, count);
+		L_trps.emplace_back(v, v, count);
+		L_trps.emplace_back(u, v, -count);
+		L_trps.emplace_back(v, u, -count);
+		rhs(u) -= sum;
+		rhs(v) += sum;
+
+		u = find(u);
+		v = find(v);
+		if (u != v) parent[std::max(u, v)] = std::min(u, v);
+	}
+	std_veci roots(n_nodes);
+	for (int_t k = 0; k < n_nodes; k++) {
+		roots[k] = find(k);
+		if (roots[k] == k) L_trps.emplace_back(k, k, 1.0);
+	}
+
+	VectorXd p = VectorXd::Zero(n_nodes);
+	if (n_nodes > 0) {
+		SparseColMatrixXXd L(n_nodes, n_nodes);
+		L.setFromTriplets(L_trps.begin(), L_trps.end());
+		LDLTSolver ldlt(L);
+		p = ldlt.solve(rhs);
+	}
+
+	// add the weighted pistons, and label the cores by their global apertures
+	MatrixXXi apertures = MatrixXXi::Constant(rows, cols, -1);
+	parallel_for(0, n_tiles, m_num_threads, 1, [&](int_t begin, int_t end) {
+		for (int_t t = begin; t < end; t++) {
+			if (results[t].num_components == 0) continue;
+			auto a = t / col_axis.size(), b = t % col_axis.size();
+			auto r0 = row_axis.begin(a), c0 = col_axis.begin(b);
+			const auto& labels = results[t].labels;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int_t i = 0; i < labels.rows(); i++) {
+				for (int_t j = 0; j < labels.cols(); j++) {
+					if (labels(i, j) < 0) continue;
+					auto node = offsets[t] + labels(i, j);
+					Z(r0 + i, c0 + j) += row_axis.weight(a, r0 + i) * col_axis.weight(b, c0 + j) * p(node);
+
+					bool is_core = r0 + i >= row_axis.core_begin(a) && r0 + i < row_axis.core_end(a) &&
+						c0 + j >= col_axis.core_begin(b) && c0 + j < col_axis.core_end(b);
+					if (is_core) apertures(r0 + i, c0 + j) = static_cast<int32_t>(roots[node]);
+				}
+			}
+		}
+	});
+
+	// normalize the blend, and shift every connected aperture to a zero mean
+	VectorXd sums = VectorXd::Zero(n_nodes);
+	VectorXd counts = VectorXd::Zero(n_nodes);
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			if (apertures(i, j) < 0) {
+				Z(i, j) = std::numeric_limits<double>::quiet_NaN();
+				continue;
+			}
+			Z(i, j) /= row_axis.weight_sum(i) * col_axis.weight_sum(j);
+			sums(apertures(i, j)) += Z(i, j);
+			counts(apertures(i, j)) += 1;
+		}
+	}
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			if (apertures(i, j) >= 0) Z(i, j) -= sums(apertures(i, j)) / counts(apertures(i, j));
+		}
+	}
+
+	return Z;
+}
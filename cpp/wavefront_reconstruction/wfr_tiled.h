@@ -0,0 +1,64 @@
+#ifndef WFR_TILED_H
+#define WFR_TILED_H
+
+#include "common.h"
+#include "cwfr.h"
+
+//! This is the tiled reconstruction of grids too large for one system
+/*!
+* The grid is split into a regular grid of core tiles, every one extended
+* by the overlap on each side, and the extended tiles are reconstructed
+* independently, num_threads of them at a time. So the memory of the solves
+* scales with the tile size rather than the grid size. The slopes and the
+* coordinates are viewed in place, e.g. mapped from disk, and only the
+* result and the aperture labels of the tiles are held at full size.
+* The slopes leave one piston per connected aperture of every tile free, so
+* the pistons are reconciled by a small global least-squares solve over the
+* overlaps, one unknown per tile aperture,
+*		min sum_overlaps (z_a + p_a - z_b - p_b)^2
+* The shifted tiles are then blended with weights ramping down linearly
+* across the overlaps, which hides the seams of the local solves, and the
+* result has a zero mean per connected aperture, as the other methods.
+*/
+class WAVEFRONTRECONSTRUCTION_API CWFRTiled {
+private:
+	int_t m_tile_size;
+	int_t m_overlap;
+	CWFR::WFR_METHOD m_method;
+	CWFR::SolverOptions m_options;
+	int m_num_threads;
+	CWFR::SolverReport m_report;
+
+public:
+	CWFRTiled(
+		int_t tile_size = 512, /*!< [in] the rows and cols of a core tile at most*/
+		int_t overlap = 32, /*!< [in] the pixels every tile extends into its neighbours, at most half the tile*/
+		CWFR::WFR_METHOD method = CWFR::WFR_METHOD::HFLI, /*!< [in] method to be used*/
+		const CWFR::SolverOptions& options = CWFR::SolverOptions() /*!< [in] the solver backend of every tile*/
+	);
+	virtual ~CWFRTiled();
+
+	//! Reconstruct the wavefront tile by tile
+	/*!
+	* \return the reconstructed wavefront Z, all zeros if a tile failed, see report()
+	*/
+	MatrixXXd operator () (
+		const MatrixViewd& Sx,/*!< [in] Slopes in x direction*/
+		const MatrixViewd& Sy,/*!< [in] Slopes in y direction*/
+		const MatrixViewd& X, /*!< [in] x coordinates*/
+		const MatrixViewd& Y  /*!< [in] y coordinates*/
+		);
+
+	void set_num_threads(
+		int num_threads /*!< [in] number of tiles solved at a time, 0 for all the hardware threads*/
+	) { m_num_threads = num_threads; }
+
+	//! The outcome of the last reconstruction, the worst of all the tiles
+	const CWFR::SolverReport& report() const { return m_report; }
+
+	int_t tile_size() const { return m_tile_size; }
+	int_t overlap() const { return m_overlap; }
+};
+
+
+#endif // !WFR_TILED_H
@@ -0,0 +1,291 @@
+#include "pch.h"
+#include "common.h"
+#include "cwfr.h"
+#include "assembly.h"
+#include "solvers.h"
+#include "wfr_plan.h"
+
+/*
+* The benchmarks of the phases of a reconstruction on synthetic quadrilateral
+* grids, see Step_01_GenerateSlopesInQuadrilateralGeometry.m.
+* The results are written as JSON unless --benchmark_format is given, e.g.
+*		wfr_benchmark --benchmark_out=results.json --benchmark_filter=Scan
+* On Linux it is built by ../CMakeLists.txt with the library and wfr_test, e.g.
+*		cmake -S .. -B build && cmake --build build --target wfr_benchmark
+*/
+
+namespace {
+	//! The sizes of the phases which do not solve, the solves stop at kMaxSolveSize
+	const int_t kSizes[] = { 128, 512, 2048, 8192 };
+	const int_t kMaxSolveSize = 2048;
+
+	//! The percentages of invalid pixels, a central obscuration
+	const int kNanPercents[] = { 0, 10, 25, 50 };
+
+	//! The tolerance of the iterative backends, the default of Eigen is not always reached
+	const double kTolerance = 1e-10;
+
+	//! The slopes and the coordinates of a synthetic grid
+	struct Grid {
+		int_t size = 0;
+		int nan_percent = -1;
+		MatrixXXd X;
+		MatrixXXd Y;
+		MatrixXXd Sx;
+		MatrixXXd Sy;
+	};
+
+	//! The slopes of the height 0.1 * peaks(x, y) of Step_01
+	void peaks_slopes(double x, double y, double& sx, double& sy)
+	{
+		auto a = std::exp(-x * x - (y + 1) * (y + 1));
+		auto b = std::exp(-x * x - y * y);
+		auto c = std::exp(-(x + 1) * (x + 1) - y * y);
+		auto p = x / 5 - x * x * x - std::pow(y, 5);
+		sx = 0.1 * (-6 * (1 - x) * a - 6 * x * (1 - x) * (1 - x) * a - 10 * (0.2 - 3 * x * x) * b + 20 * x * p * b + 2.0 / 3 * (x + 1) * c);
+		sy = 0.1 * (-6 * (y + 1) * (1 - x) * (1 - x) * a + 50 * std::pow(y, 4) * b + 20 * y * p * b + 2.0 / 3 * y * c);
+	}
+
+	//! Generate a distorted, keystoned and jittered grid of size x size pixels
+	/*!
+	* The grid of the last call is kept, as the benchmarks are registered
+	* grid by grid and the largest grids take seconds to generate.
+	*/
+	const Grid& grid(int_t size, int nan_percent)
+	{
+		static Grid g;
+		if (g.size == size && g.nan_percent == nan_percent) return g;
+
+		g = Grid();
+		g.size = size;
+		g.nan_percent = nan_percent;
+		g.X.resize(size, size);
+		g.Y.resize(size, size);
+		g.Sx.resize(size, size);
+		g.Sy.resize(size, size);
+
+		const double min = -2, max = 2, kd = -1e-2, yt = -4;
+		const double theta = -20 * EIGEN_PI / 180;
+		auto step = (max - min) / (size - 1);
+		std::mt19937 rng(0);
+		std::normal_distribution<double> position_error(0, 5e-2 * step);
+
+		// the obscuration radius, in pixels, of nan_percent of the pixels
+		auto radius = std::sqrt(nan_percent / 100.0 * size * size / EIGEN_PI);
+		auto center = (size - 1) / 2.0;
+
+		for (int_t i = 0; i < size; i++) {
+			for (int_t j = 0; j < size; j++) {
+				auto x0 = min + j * step, y0 = min + i * step;
+
+				// the radial distortion and the keystone of a plane tilted by theta
+				auto r2 = x0 * x0 + y0 * y0;
+				auto xr = x0, yr = y0 * std::cos(theta), zr = y0 * std::sin(theta);
+				auto tz = -yt / std::tan(theta);
+				auto xk = xr / (zr - tz) * -tz;
+				auto yk = (yr - yt) / (zr - tz) * -tz + yt;
+
+				auto x = xk + kd * r2 * x0 + position_error(rng);
+				auto y = yk + kd * r2 * y0 + position_error(rng);
+				g.X(i, j) = x;
+				g.Y(i, j) = y;
+
+				if ((i - center) * (i - center) + (j - center) * (j - center) < radius * radius) {
+					g.Sx(i, j) = g.Sy(i, j) = std::numeric_limits<double>::quiet_NaN();
+				}
+				else {
+					peaks_slopes(x, y, g.Sx(i, j), g.Sy(i, j));
+				}
+			}
+		}
+		return g;
+	}
+
+	//! The counters of the system size, and the pixels per second
+	void set_counters(benchmark::State& state, const CWFRAssembly& assembly)
+	{
+		auto pixels = assembly.rows() * assembly.cols();
+		state.counters["pixels"] = static_cast<double>(pixels);
+		state.counters["unknowns"] = static_cast<double>(assembly.num_unknowns());
+		state.counters["equations"] = static_cast<double>(assembly.num_equations());
+		state.SetItemsProcessed(state.iterations() * pixels);
+	}
+
+	//! Scan the validity masks for the valid ids and the stencil classes
+	void scan(benchmark::State& state, int_t size, int nan_percent)
+	{
+		const auto& g = grid(size, nan_percent);
+		for (auto _ : state) {
+			CWFRAssembly assembly(g.Sx, g.Sy);
+			benchmark::DoNotOptimize(assembly.num_unknowns());
+		}
+		set_counters(state, CWFRAssembly(g.Sx, g.Sy));
+	}
+
+	//! Fill the triplets of D, the same for HFLI and HFLIQ
+	void fill_D(benchmark::State& state, int_t size, int nan_percent)
+	{
+		const auto& g = grid(size, nan_percent);
+		CWFRAssembly assembly(g.Sx, g.Sy);
+		TripletListd D_trps;
+		for (auto _ : state) {
+			assembly.fill_D(D_trps);
+			benchmark::DoNotOptimize(D_trps.data());
+		}
+		set_counters(state, assembly);
+	}
+
+	//! Fill g with the stencils of the method
+	void fill_g(benchmark::State& state, int_t size, int nan_percent, CWFR::WFR_METHOD method)
+	{
+		const auto& g = grid(size, nan_percent);
+		CWFRAssembly assembly(g.Sx, g.Sy);
+		std_vecd g_std(assembly.num_equations());
+		for (auto _ : state) {
+			assembly.fill_g(g.Sx, g.Sy, g.X, g.Y, method, g_std.data());
+			benchmark::DoNotOptimize(g_std.data());
+		}
+		set_counters(state, assembly);
+	}
+
+	//! Build the sparse matrix D from its triplets
+	void build_D(benchmark::State& state, int_t size, int nan_percent)
+	{
+		const auto& g = grid(size, nan_percent);
+		CWFRAssembly assembly(g.Sx, g.Sy);
+		TripletListd D_trps;
+		assembly.fill_D(D_trps);
+		for (auto _ : state) {
+			SparseMatrixXXd D(assembly.num_equations(), assembly.num_unknowns());
+			D.setFromTriplets(D_trps.begin(), D_trps.end());
+			D.makeCompressed();
+			benchmark::DoNotOptimize(D.valuePtr());
+		}
+		set_counters(state, assembly);
+		state.counters["nnz"] = static_cast<double>(D_trps.size());
+	}
+
+	//! Set up the backend and solve one frame, as a single reconstruction does
+	void solve(benchmark::State& state, int_t size, int nan_percent, CWFR::WFR_METHOD method, CWFR::WFR_SOLVER solver)
+	{
+		const auto& g = grid(size, nan_percent);
+		CWFRAssembly assembly(g.Sx, g.Sy);
+		CWFR::SolverOptions options(solver, kTolerance);
+		auto backend = CWFRSolver::create(options, assembly);
+
+		SparseMatrixXXd D;
+		if (backend->needs_D()) {
+			TripletListd D_trps;
+			assembly.fill_D(D_trps);
+			D.resize(assembly.num_equations(), assembly.num_unknowns());
+			D.setFromTriplets(D_trps.begin(), D_trps.end());
+			D.makeCompressed();
+		}
+		VectorXd g_vec(assembly.num_equations());
+		assembly.fill_g(g.Sx, g.Sy, g.X, g.Y, method, g_vec.data());
+
+		CWFR::SolverReport report;
+		MatrixXd z;
+		for (auto _ : state) {
+			backend = CWFRSolver::create(options, assembly);
+			backend->compute(assembly, D, 1);
+			backend->solve(g_vec, z, report);
+			benchmark::DoNotOptimize(z.data());
+		}
+		if (!report.success()) state.SkipWithError(report.message.c_str());
+		set_counters(state, assembly);
+		state.counters["iterations"] = static_cast<double>(report.iterations);
+		state.counters["residual"] = report.residual;
+	}
+
+	//! The whole reconstruction, from the slopes to the wavefront
+	void reconstruct(benchmark::State& state, int_t size, int nan_percent, CWFR::WFR_METHOD method, CWFR::WFR_SOLVER solver)
+	{
+		const auto& g = grid(size, nan_percent);
+		CWFR wfr(g.Sx, g.Sy, g.X, g.Y);
+		for (auto _ : state) {
+			auto Z = wfr(method, CWFR::SolverOptions(solver, kTolerance));
+			benchmark::DoNotOptimize(Z.data());
+		}
+		if (!wfr.report().success()) state.SkipWithError(wfr.report().message.c_str());
+		set_counters(state, CWFRAssembly(g.Sx, g.Sy));
+	}
+
+	//! A frame of a cached plan into a buffer, after the first frame has sized the workspace
+	void steady_state(benchmark::State& state, int_t size, int nan_percent, CWFR::WFR_METHOD method, CWFR::WFR_SOLVER solver)
+	{
+		const auto& g = grid(size, nan_percent);
+		auto geometry = std::make_shared<const CWFRGeometry>(g.X, g.Y);
+		auto plan_cache = std::make_shared<CWFRPlanCache>();
+		auto workspace = std::make_shared<CWFR::Workspace>();
+		CWFR::SolverOptions options(solver, kTolerance);
+		MatrixXXd Z(size, size);
+		auto frame = [&]() {
+			CWFR wfr(g.Sx, g.Sy, geometry);
+			wfr.set_plan_cache(plan_cache);
+			wfr.set_workspace(workspace);
+			wfr.reconstruct_into(Z, method, options);
+			return wfr.report();
+		};
+
+		auto report = frame();
+		for (auto _ : state) {
+			report = frame();
+			benchmark::DoNotOptimize(Z.data());
+		}
+		if (!report.success()) state.SkipWithError(report.message.c_str());
+		set_counters(state, CWFRAssembly(g.Sx, g.Sy));
+	}
+
+	std::string method_name(CWFR::WFR_METHOD method)
+	{
+		return method == CWFR::WFR_METHOD::HFLI ? "HFLI" : "HFLIQ";
+	}
+
+	//! Register the benchmarks grid by grid, so that every grid is generated once
+	void register_benchmarks()
+	{
+		const CWFR::WFR_METHOD methods[] = { CWFR::WFR_METHOD::HFLI, CWFR::WFR_METHOD::HFLIQ };
+		const CWFR::WFR_SOLVER solvers[] = { CWFR::WFR_SOLVER::SIMPLICIAL_LDLT, CWFR::WFR_SOLVER::MULTIGRID_CG };
+
+		for (auto size : kSizes) {
+			for (auto nan_percent : kNanPercents) {
+				auto suffix = "/" + std::to_string(size) + "/nan" + std::to_string(nan_percent);
+				benchmark::RegisterBenchmark(("Scan" + suffix).c_str(), scan, size, nan_percent)->Unit(benchmark::kMillisecond);
+				benchmark::RegisterBenchmark(("FillD" + suffix).c_str(), fill_D, size, nan_percent)->Unit(benchmark::kMillisecond);
+				benchmark::RegisterBenchmark(("BuildD" + suffix).c_str(), build_D, size, nan_percent)->Unit(benchmark::kMillisecond);
+
+				for (auto method : methods) {
+					auto name = method_name(method) + suffix;
+					benchmark::RegisterBenchmark(("FillG/" + name).c_str(), fill_g, size, nan_percent, method)->Unit(benchmark::kMillisecond);
+					if (size > kMaxSolveSize) continue;
+
+					for (auto solver : solvers) {
+						auto solver_name = std::string(CWFRSolver::name(solver)) + "/" + name;
+						benchmark::RegisterBenchmark(("Solve/" + solver_name).c_str(), solve, size, nan_percent, method, solver)->Unit(benchmark::kMillisecond);
+						benchmark::RegisterBenchmark(("Reconstruct/" + solver_name).c_str(), reconstruct, size, nan_percent, method, solver)->Unit(benchmark::kMillisecond);
+						benchmark::RegisterBenchmark(("SteadyState/" + solver_name).c_str(), steady_state, size, nan_percent, method, solver)->Unit(benchmark::kMillisecond);
+					}
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	// JSON unless another format is asked for, to track the regressions between releases
+	std::vector<char*> args(argv, argv + argc);
+	std::string json_format = "--benchmark_format=json";
+	bool has_format = false;
+	for (int k = 1; k < argc; k++) has_format |= std::strncmp(argv[k], "--benchmark_format", 18) == 0;
+	if (!has_format) args.push_back(&json_format[0]);
+	int n_args = static_cast<int>(args.size());
+
+	benchmark::Initialize(&n_args, args.data());
+	if (benchmark::ReportUnrecognizedArguments(n_args, args.data())) return 1;
+	register_benchmarks();
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
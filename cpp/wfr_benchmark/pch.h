@@ -0,0 +1,22 @@
+//
+// pch.h
+//
+
+#pragma once
+
+#include "benchmark/benchmark.h"
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <functional>
+#include <Eigen/Sparse>
+#include <Eigen/Dense>
+#include <Eigen/IterativeLinearSolvers>
+#include <Eigen/SparseQR>
+#include <Eigen/SparseCholesky>
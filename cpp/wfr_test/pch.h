@@ -6,7 +6,18 @@
 
 #include "gtest/gtest.h"
 #include <iostream>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <functional>
 #include <Eigen/Sparse>
 #include <Eigen/Dense>
-#include <Eigen/IterativeLinearSolvers>
\ No newline at end of file
+#include <Eigen/IterativeLinearSolvers>
+#include <Eigen/SparseQR>
+#include <Eigen/SparseCholesky>
\ No newline at end of file
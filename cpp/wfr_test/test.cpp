@@ -1,9 +1,103 @@
 #include "pch.h"
 #include "common.h"
 #include "cwfr.h"
+#include "assembly.h"
+#include "stencils.h"
+#include "wfr_plan.h"
+#include "solvers.h"
+#include "wfr_stream.h"
+#include "wfr_operator.h"
+#include "wfr_multigrid.h"
+#include "wfr_poisson.h"
+#include "wfr_tiled.h"
+#include "wfr_pipeline.h"
+#include "wfr_noise.h"
+#include "wfr_pyramid.h"
+#include "wfr_service.h"
+#include "parallel.h"
 #include "matrix_io.h"
 
-TEST(MatrixIOTest, ReadTheMatrix) {
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+//! The number of calls of the global operator new, which counts them for the tests of the steady state
+/*!
+* operator new[] and the nothrow forms call this one. Eigen allocates with
+* malloc, its buffers are checked by their data pointers. On Windows the
+* library DLL keeps its own operator new, so only the allocations of the
+* headers are counted there.
+*/
+static std::atomic<size_t> g_num_allocations{ 0 };
+
+void* operator new(size_t size)
+{
+	g_num_allocations++;
+	if (void* p = std::malloc(size > 0 ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+// GCC takes the replaced pair for the built-in one, whose memory is not freed by free
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+//! The data of ../../data, loaded once for all the tests of a suite
+/*!
+* The tests only read the data, and copy it to change the slopes.
+* SetUpTestCase() is the name known to the googletest 1.8 package.
+*/
+class DataTest : public ::testing::Test {
+protected:
+	static inline int rows = 0, cols = 0;
+	static inline double* X = nullptr;
+	static inline double* Y = nullptr;
+	static inline double* Z = nullptr;
+	static inline double* Sx = nullptr;
+	static inline double* Sy = nullptr;
+
+	Eigen::Map<const MatrixXXd> Xmap{ X, rows, cols };
+	Eigen::Map<const MatrixXXd> Ymap{ Y, rows, cols };
+	Eigen::Map<const MatrixXXd> Zmap{ Z, rows, cols };
+	Eigen::Map<const MatrixXXd> Sxmap{ Sx, rows, cols };
+	Eigen::Map<const MatrixXXd> Symap{ Sy, rows, cols };
+
+	static void SetUpTestCase()
+	{
+		read_matrix_from_disk("../../data/X.bin", &rows, &cols, &X);
+		read_matrix_from_disk("../../data/Y.bin", &rows, &cols, &Y);
+		read_matrix_from_disk("../../data/Z.bin", &rows, &cols, &Z);
+		read_matrix_from_disk("../../data/Sx.bin", &rows, &cols, &Sx);
+		read_matrix_from_disk("../../data/Sy.bin", &rows, &cols, &Sy);
+	}
+
+	static void TearDownTestCase()
+	{
+		for (auto data : { &X, &Y, &Z, &Sx, &Sy }) {
+			free(*data);
+			*data = nullptr;
+		}
+	}
+};
+
+class MatrixIOTest : public DataTest {};
+class AssemblyTest : public DataTest {};
+class CWFRTest : public DataTest {};
+
+TEST_F(MatrixIOTest, ReadTheMatrix) {
 	const char* file_name = "../../data/X.bin";
 
 	int rows = 0, cols = 0;
@@ -17,7 +111,35 @@ TEST(MatrixIOTest, ReadTheMatrix) {
 	X = nullptr;
 }
 
-TEST(CWFRTest, hfli) {
+TEST_F(AssemblyTest, StencilClasses) {
+	// one NaN in a 5 x 6 grid
+	MatrixXXd S = MatrixXXd::Ones(5, 6);
+	S(2, 3) = NAN;
+
+	CWFRAssembly assembly(S, S);
+
+	EXPECT_EQ(assembly.num_unknowns(), 29);
+	EXPECT_EQ(assembly.ids()(2, 3), -1);
+	EXPECT_EQ(assembly.ids()(2, 4), 15);
+
+	// x, x, NaN, x in the row 2
+	EXPECT_EQ(assembly.class_x()(2, 0), CWFRAssembly::THIRD);
+	EXPECT_EQ(assembly.class_x()(2, 1), CWFRAssembly::THIRD);
+	EXPECT_EQ(assembly.class_x()(2, 2), CWFRAssembly::NONE);
+	EXPECT_EQ(assembly.class_x()(2, 4), CWFRAssembly::THIRD);
+	EXPECT_EQ(assembly.class_x()(1, 1), CWFRAssembly::FIFTH);
+	EXPECT_EQ(assembly.class_x()(1, 4), CWFRAssembly::THIRD);
+
+	// the same along the column 3
+	EXPECT_EQ(assembly.class_y()(0, 3), CWFRAssembly::THIRD);
+	EXPECT_EQ(assembly.class_y()(1, 3), CWFRAssembly::NONE);
+	EXPECT_EQ(assembly.class_y()(1, 2), CWFRAssembly::FIFTH);
+
+	// 5 * 5 - 2 segments in x and 4 * 6 - 2 segments in y
+	EXPECT_EQ(assembly.num_equations(), 23 + 22);
+}
+
+TEST_F(CWFRTest, hfli) {
 
 	int rows = 0, cols = 0;
 
@@ -55,4 +177,957 @@ TEST(CWFRTest, hfli) {
 	free(Z);
 	free(Sx);
 	free(Sy);
-}
\ No newline at end of file
+}
+
+TEST_F(CWFRTest, hfliq_plan_cache) {
+	// the reference without a plan cache
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ);
+
+	// the first call builds the plan and the second one reuses it
+	auto cache = std::make_shared<CWFRPlanCache>();
+	CWFR wfr_cached(Sxmap, Symap, Xmap, Ymap);
+	wfr_cached.set_plan_cache(cache);
+	MatrixXXd Z_first = wfr_cached(CWFR::WFR_METHOD::HFLIQ);
+	MatrixXXd Z_second = wfr_cached(CWFR::WFR_METHOD::HFLIQ);
+
+	EXPECT_EQ(cache->size(), 1);
+	EXPECT_TRUE(Z_first.isApprox(Z_second));
+	// the same up to the piston
+	MatrixXXd Z_diff = Z_first - Z_ref;
+	EXPECT_LT((Z_diff.array() - Z_diff.mean()).abs().maxCoeff(), 1e-9);
+}
+
+TEST_F(CWFRTest, plan_cache_key_collision) {
+	// two frames of different masks forced onto the same key
+	MatrixXXd Sx_hole = Sxmap, Sy_hole = Symap;
+	Sx_hole(rows / 2, cols / 2) = NAN;
+	const size_t key = 42;
+	CWFR::SolverOptions options;
+	auto plan = std::make_shared<const CWFRPlan>(key, CWFR::WFR_METHOD::HFLIQ, CWFRAssembly(Sxmap, Symap, options.ordering), options, 1, CWFRPlan::pack_mask(Sxmap, Symap));
+	auto plan_hole = std::make_shared<const CWFRPlan>(key, CWFR::WFR_METHOD::HFLIQ, CWFRAssembly(Sx_hole, Sy_hole, options.ordering), options, 1, CWFRPlan::pack_mask(Sx_hole, Sy_hole));
+
+	CWFRPlanCache cache;
+	cache.insert(plan);
+	EXPECT_EQ(cache.find(key, Sxmap, Symap), plan);
+	EXPECT_EQ(cache.find(key, Sx_hole, Sy_hole), nullptr);
+	EXPECT_EQ(cache.find(key, MatrixXXd(Sxmap.topRows(rows - 1)), MatrixXXd(Symap.topRows(rows - 1))), nullptr);
+
+	// a colliding plan does not evict the other one
+	cache.insert(plan_hole);
+	EXPECT_EQ(cache.size(), 2);
+	EXPECT_EQ(cache.find(key, Sxmap, Symap), plan);
+	EXPECT_EQ(cache.find(key, Sx_hole, Sy_hole), plan_hole);
+}
+
+TEST_F(CWFRTest, hfliq_batch) {
+	// scaled frames on the same geometry, and one frame with a different mask
+	std::vector<MatrixXXd> Sxs, Sys;
+	for (int k = 1; k <= 4; k++) {
+		Sxs.push_back(Sxmap * k);
+		Sys.push_back(Symap * k);
+	}
+	Sxs[3].block(0, 0, 8, 8).fill(NAN);
+	Sys[3].block(0, 0, 8, 8).fill(NAN);
+
+	auto cache = std::make_shared<CWFRPlanCache>();
+	std::vector<CWFR::SolverReport> reports;
+	auto Zs = CWFR::batch(Sxs, Sys, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, cache, 1, CWFR::SolverOptions(), &reports);
+
+	ASSERT_EQ(Zs.size(), 4);
+	ASSERT_EQ(reports.size(), 4);
+	for (const auto& report : reports) EXPECT_TRUE(report.success()) << report.message;
+	EXPECT_EQ(cache->size(), 2);
+	EXPECT_TRUE(Zs[1].isApprox(2 * Zs[0]));
+	EXPECT_TRUE(Zs[2].isApprox(3 * Zs[0]));
+	EXPECT_TRUE(std::isnan(Zs[3](0, 0)));
+
+	// the same as a single frame with the same cache
+	CWFR wfr(Sxs[3], Sys[3], Xmap, Ymap);
+	wfr.set_plan_cache(cache);
+	MatrixXXd Z_single = wfr(CWFR::WFR_METHOD::HFLIQ);
+	EXPECT_TRUE(Z_single.block(8, 8, rows - 8, cols - 8).isApprox(Zs[3].block(8, 8, rows - 8, cols - 8)));
+
+	// a failed solve is reported for every frame of its group
+	CWFR::batch(Sxs, Sys, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, nullptr, 1, CWFR::SolverOptions(CWFR::WFR_SOLVER::LSCG, 1e-12, 2), &reports);
+	ASSERT_EQ(reports.size(), 4);
+	for (const auto& report : reports) {
+		EXPECT_FALSE(report.success());
+		EXPECT_FALSE(report.message.empty());
+	}
+}
+
+TEST_F(CWFRTest, hfliq_batch_blocks) {
+	// more frames of one mask than are solved at once
+	std::vector<MatrixXXd> Sxs, Sys;
+	for (int k = 1; k <= 20; k++) {
+		Sxs.push_back(Sxmap * k);
+		Sys.push_back(Symap * k);
+	}
+
+	auto cache = std::make_shared<CWFRPlanCache>();
+	auto Zs = CWFR::batch(Sxs, Sys, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, cache);
+
+	ASSERT_EQ(Zs.size(), 20);
+	EXPECT_EQ(cache->size(), 1);
+	for (int k = 1; k < 20; k++) EXPECT_TRUE(Zs[k].isApprox((k + 1) * Zs[0])) << k;
+}
+
+TEST_F(AssemblyTest, ParallelFillIsBitIdentical) {
+	// copy the slopes, with a hole in the slopes
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+	Sxm.block(40, 50, 10, 20).fill(NAN);
+	Sym.block(40, 50, 10, 20).fill(NAN);
+
+	CWFRAssembly assembly(Sxm, Sym);
+
+	// serial
+	TripletListd D_serial;
+	std_vecd g_serial(assembly.num_equations());
+	assembly.fill_D(D_serial, 1);
+	assembly.fill_g(Sxm, Sym, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, g_serial.data(), 1);
+
+	// parallel
+	TripletListd D_parallel;
+	std_vecd g_parallel(assembly.num_equations());
+	assembly.fill_D(D_parallel, 4);
+	assembly.fill_g(Sxm, Sym, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, g_parallel.data(), 4);
+
+	ASSERT_EQ(D_serial.size(), D_parallel.size());
+	for (size_t k = 0; k < D_serial.size(); k++) {
+		EXPECT_EQ(D_serial[k].row(), D_parallel[k].row());
+		EXPECT_EQ(D_serial[k].col(), D_parallel[k].col());
+		EXPECT_EQ(D_serial[k].value(), D_parallel[k].value());
+	}
+	EXPECT_EQ(std::memcmp(g_serial.data(), g_parallel.data(), g_serial.size() * sizeof(double)), 0);
+}
+
+TEST_F(AssemblyTest, UniformGridKernel) {
+	// copy the slopes, with a hole in the slopes and an invalid corner
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+	Sxm.block(40, 50, 10, 20).fill(NAN);
+	Sym.block(40, 50, 10, 20).fill(NAN);
+	Sxm(0, 0) = Sym(0, 0) = NAN;
+
+	// a sheared and rotated affine grid, and the same grid with the unused corner moved off
+	MatrixXXd Xa(rows, cols), Ya(rows, cols);
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < cols; j++) {
+			Xa(i, j) = -1.5 + 0.021 * j + 0.002 * i;
+			Ya(i, j) = 2.0 - 0.001 * j + 0.019 * i;
+		}
+	}
+	MatrixXXd Xc = Xa;
+	Xc(0, 0) += 1;
+
+	UniformSpacing spacing;
+	EXPECT_TRUE(UniformSpacing::detect(Xa, spacing));
+	EXPECT_NEAR(spacing.along_x, 0.021, 1e-15);
+	EXPECT_NEAR(spacing.along_y, 0.002, 1e-15);
+	EXPECT_FALSE(UniformSpacing::detect(Xc, spacing));
+	EXPECT_FALSE(UniformSpacing::detect(Xmap, spacing));
+	EXPECT_TRUE(CWFRAssembly::detect_spacing(Xa, Ya).is_uniform);
+	EXPECT_FALSE(CWFRAssembly::detect_spacing(Xc, Ya).is_uniform);
+
+	// the constant spacings give the same g as the coordinates, up to their rounding,
+	// and the spacings detected once give the same g as those detected by fill_g()
+	CWFRAssembly assembly(Sxm, Sym);
+	auto grid_spacing = CWFRAssembly::detect_spacing(Xa, Ya);
+	std_vecd g_uniform(assembly.num_equations()), g_coordinates(assembly.num_equations()), g_detected(assembly.num_equations());
+	for (auto method : { CWFR::WFR_METHOD::HFLI, CWFR::WFR_METHOD::HFLIQ, CWFR::WFR_METHOD::TFLI, CWFR::WFR_METHOD::TFLIQ, CWFR::WFR_METHOD::SLI, CWFR::WFR_METHOD::SLIQ }) {
+		assembly.fill_g(Sxm, Sym, Xa, Ya, method, g_uniform.data(), 1);
+		assembly.fill_g(Sxm, Sym, Xc, Ya, method, g_coordinates.data(), 1);
+		assembly.fill_g(Sxm, Sym, Xa, Ya, method, g_detected.data(), 1, nullptr, &grid_spacing);
+		auto g_max = VectorMapd(g_coordinates.data(), g_coordinates.size()).cwiseAbs().maxCoeff();
+		EXPECT_LT((VectorMapd(g_uniform.data(), g_uniform.size()) - VectorMapd(g_coordinates.data(), g_coordinates.size())).cwiseAbs().maxCoeff(), 1e-12 * g_max);
+		EXPECT_EQ(g_detected, g_uniform);
+	}
+}
+
+TEST_F(CWFRTest, hfliq_solver_backends) {
+	// a corner of the grid keeps the sparse QR fast
+	MatrixXXd Xc = Xmap.topLeftCorner(32, 32);
+	MatrixXXd Yc = Ymap.topLeftCorner(32, 32);
+	MatrixXXd Sxc = Sxmap.topLeftCorner(32, 32);
+	MatrixXXd Syc = Symap.topLeftCorner(32, 32);
+
+	// the direct backends agree with LSCG at its tolerance
+	CWFR wfr(Sxc, Syc, Xc, Yc);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::LSCG, 1e-12));
+	EXPECT_TRUE(wfr.report().success());
+	EXPECT_GT(wfr.report().iterations, 0);
+	EXPECT_LT(wfr.report().residual, 1e-9);
+
+	for (auto solver : { CWFR::WFR_SOLVER::SPARSE_QR, CWFR::WFR_SOLVER::SIMPLICIAL_LDLT }) {
+		MatrixXXd Z = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(solver));
+		EXPECT_TRUE(wfr.report().success()) << wfr.report().message;
+		EXPECT_EQ(wfr.report().solver, solver);
+		EXPECT_LT((Z - Z_ref).cwiseAbs().maxCoeff(), 1e-9) << CWFRSolver::name(solver);
+	}
+
+	// an iteration budget too small to converge is reported
+	MatrixXXd Z_short = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::LSCG, 1e-12, 2));
+	EXPECT_FALSE(wfr.report().success());
+	EXPECT_FALSE(wfr.report().message.empty());
+	EXPECT_EQ(Z_short.cwiseAbs().maxCoeff(), 0);
+
+#ifndef WFR_USE_CHOLMOD
+	// a backend which is not compiled in is reported
+	wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::CHOLMOD));
+	EXPECT_EQ(wfr.report().info, Eigen::InvalidInput);
+	EXPECT_NE(wfr.report().message.find("WFR_USE_CHOLMOD"), std::string::npos);
+#endif
+}
+
+TEST_F(CWFRTest, hfliq_warm_started_stream) {
+	// two slightly different frames
+	CWFR::SolverOptions options(CWFR::WFR_SOLVER::LSCG, 1e-8);
+	CWFRStream stream(Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, options);
+	stream(Sxmap, Symap);
+	auto cold_iterations = stream.report().iterations;
+
+	MatrixXXd Sx_next = Sxmap * 1.001;
+	MatrixXXd Sy_next = Symap * 1.001;
+	MatrixXXd Z_warm = stream(Sx_next, Sy_next);
+	EXPECT_TRUE(stream.report().success());
+	EXPECT_LT(stream.report().iterations, cold_iterations);
+
+	// the same result as a cold start
+	CWFR wfr(Sx_next, Sy_next, Xmap, Ymap);
+	MatrixXXd Z_cold = wfr(CWFR::WFR_METHOD::HFLIQ, options);
+	EXPECT_LT((Z_warm - Z_cold).cwiseAbs().maxCoeff(), 1e-6);
+}
+
+TEST_F(CWFRTest, hfliq_matrix_free) {
+	// copy the slopes, with a hole in the slopes
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+	Sxm.block(40, 50, 10, 20).fill(NAN);
+	Sym.block(40, 50, 10, 20).fill(NAN);
+
+	// the operator applies the same D as the assembled one
+	CWFRAssembly assembly(Sxm, Sym);
+	TripletListd D_trps;
+	assembly.fill_D(D_trps);
+	SparseMatrixXXd D(assembly.num_equations(), assembly.num_unknowns());
+	D.setFromTriplets(D_trps.begin(), D_trps.end());
+
+	CWFROperator op(assembly, 4);
+	VectorXd z = VectorXd::Random(assembly.num_unknowns());
+	VectorXd g = VectorXd::Random(assembly.num_equations());
+	VectorXd Dz(assembly.num_equations());
+	VectorXd Dtg(assembly.num_unknowns());
+	op.apply_D(z, Dz);
+	op.apply_Dt(g, Dtg);
+	VectorXd DtDz = op * z;
+	EXPECT_LT((Dz - D * z).cwiseAbs().maxCoeff(), 1e-12);
+	EXPECT_LT((Dtg - D.transpose() * g).cwiseAbs().maxCoeff(), 1e-12);
+	EXPECT_LT((DtDz - D.transpose() * (D * z)).cwiseAbs().maxCoeff(), 1e-12);
+
+	// the matrix-free CG agrees with the factorization
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	MatrixXXd Z_ldlt = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	MatrixXXd Z_free = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::MATRIX_FREE_CG, 1e-10));
+	EXPECT_TRUE(wfr.report().success()) << wfr.report().message;
+	EXPECT_LT(wfr.report().residual, 1e-9);
+	EXPECT_LT((Z_free - Z_ldlt).array().isNaN().select(0, Z_free - Z_ldlt).cwiseAbs().maxCoeff(), 1e-8);
+}
+
+TEST_F(CWFRTest, hfliq_multigrid) {
+	// copy the slopes, with a hole and an island in the slopes
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+	Sxm.block(40, 50, 30, 30).fill(NAN);
+	Sym.block(40, 50, 30, 30).fill(NAN);
+	Sxm.block(50, 60, 5, 5) = Sxmap.block(50, 60, 5, 5);
+	Sym.block(50, 60, 5, 5) = Symap.block(50, 60, 5, 5);
+
+	// the hierarchy coarsens the mask down to the factorized level
+	CWFRAssembly assembly(Sxm, Sym);
+	CWFROperator op(assembly);
+	CWFRMultigrid multigrid(op);
+	EXPECT_GT(multigrid.num_levels(), 2);
+	EXPECT_LE(multigrid.level(multigrid.num_levels() - 1).num_unknowns, 1024);
+
+	// both multigrid backends agree with the factorization, also on the pool of the backend
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	MatrixXXd Z_ldlt = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	for (int num_threads : { 1, 3 }) {
+		wfr.set_num_threads(num_threads);
+		for (auto solver : { CWFR::WFR_SOLVER::MULTIGRID, CWFR::WFR_SOLVER::MULTIGRID_CG }) {
+			MatrixXXd Z = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(solver, 1e-10));
+			EXPECT_TRUE(wfr.report().success()) << wfr.report().message;
+			EXPECT_LT(wfr.report().iterations, 30) << CWFRSolver::name(solver);
+			EXPECT_LT((Z - Z_ldlt).array().isNaN().select(0, Z - Z_ldlt).cwiseAbs().maxCoeff(), 1e-8) << CWFRSolver::name(solver) << " " << num_threads;
+		}
+	}
+}
+
+TEST_F(CWFRTest, hfliq_dct) {
+	// copy the slopes
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+
+	// the DCT is exact on the fully valid rectangle, and picked by AUTO
+	ASSERT_TRUE(CWFRAssembly(Sxm, Sym).is_full_rectangle());
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	MatrixXXd Z_ldlt = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	MatrixXXd Z = wfr(CWFR::WFR_METHOD::HFLIQ);
+	EXPECT_EQ(wfr.report().solver, CWFR::WFR_SOLVER::DCT);
+	EXPECT_TRUE(wfr.report().success()) << wfr.report().message;
+	EXPECT_LT((Z - Z_ldlt).cwiseAbs().maxCoeff(), 1e-9);
+
+	// a masked aperture needs the preconditioned CG
+	Sxm.block(40, 50, 30, 30).fill(NAN);
+	Sym.block(40, 50, 30, 30).fill(NAN);
+	CWFR wfr_masked(Sxm, Sym, Xmap, Ymap);
+	Z_ldlt = wfr_masked(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	wfr_masked(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::DCT));
+	EXPECT_FALSE(wfr_masked.report().success());
+	Z = wfr_masked(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::DCT_CG, 1e-12));
+	EXPECT_TRUE(wfr_masked.report().success()) << wfr_masked.report().message;
+	EXPECT_LT((Z - Z_ldlt).array().isNaN().select(0, Z - Z_ldlt).cwiseAbs().maxCoeff(), 1e-8);
+}
+
+TEST_F(CWFRTest, hfliq_tiled) {
+	// copy the slopes, with a hole and an island crossing the tiles
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+	Sxm.block(40, 50, 30, 30).fill(NAN);
+	Sym.block(40, 50, 30, 30).fill(NAN);
+	Sxm.block(50, 60, 5, 5) = Sxmap.block(50, 60, 5, 5);
+	Sym.block(50, 60, 5, 5) = Symap.block(50, 60, 5, 5);
+
+	// the stitched tiles agree with the global solve up to the seams of the local solves
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	MatrixXXd Z_global = wfr(CWFR::WFR_METHOD::HFLIQ);
+	CWFRTiled tiled(48, 8, CWFR::WFR_METHOD::HFLIQ);
+	tiled.set_num_threads(4);
+	MatrixXXd Z = tiled(Sxm, Sym, Xmap, Ymap);
+	EXPECT_TRUE(tiled.report().success()) << tiled.report().message;
+	EXPECT_TRUE((Z.array().isNaN() == Z_global.array().isNaN()).all());
+	EXPECT_LT((Z - Z_global).array().isNaN().select(0, Z - Z_global).cwiseAbs().maxCoeff(), 1e-5);
+
+	// two stripes crossing both tiles, so every tile has two pistons, numbered after any ordering
+	MatrixXXd Sx_stripes = Sxmap.block(0, 0, 32, 96), Sy_stripes = Symap.block(0, 0, 32, 96);
+	Sx_stripes.middleRows(15, 2).fill(NAN);
+	Sy_stripes.middleRows(15, 2).fill(NAN);
+	MatrixXXd X_stripes = Xmap.block(0, 0, 32, 96), Y_stripes = Ymap.block(0, 0, 32, 96);
+	CWFR wfr_stripes(Sx_stripes, Sy_stripes, X_stripes, Y_stripes);
+	MatrixXXd Z_stripes = wfr_stripes(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	for (auto ordering : { CWFR::WFR_ORDERING::NATURAL, CWFR::WFR_ORDERING::RCM, CWFR::WFR_ORDERING::NESTED_DISSECTION }) {
+		CWFRTiled tiled_stripes(48, 8, CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT, 0, 0, ordering));
+		MatrixXXd Z_tiled = tiled_stripes(Sx_stripes, Sy_stripes, X_stripes, Y_stripes);
+		EXPECT_TRUE(tiled_stripes.report().success()) << tiled_stripes.report().message;
+		MatrixXXd Z_diff = Z_tiled - Z_stripes;
+		EXPECT_LT(Z_diff.array().isNaN().select(0, Z_diff).cwiseAbs().maxCoeff(), 1e-5) << static_cast<int>(ordering);
+	}
+}
+
+TEST_F(CWFRTest, hfliq_pipeline) {
+	// a directory of scaled frames, and a stray file which is not a frame
+	auto directory = std::filesystem::temp_directory_path() / "wfr_pipeline_test";
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directories(directory);
+	const int n_frames = 6;
+	for (int k = 0; k < n_frames; k++) {
+		MatrixXXd Sxk = (k + 1) * Sxmap, Syk = (k + 1) * Symap;
+		auto name = std::to_string(k) + ".bin";
+		write_matrix_to_disk((directory / ("Sx" + name)).string().c_str(), rows, cols, Sxk.data());
+		write_matrix_to_disk((directory / ("Sy" + name)).string().c_str(), rows, cols, Syk.data());
+	}
+	write_matrix_to_disk((directory / "Sx_lonely.bin").string().c_str(), rows, cols, Sx);
+
+	auto frames = CWFRPipeline::list_frames(directory.string(), directory.string());
+	ASSERT_EQ(frames.size(), n_frames);
+
+	// the small queues make the stages wait for each other
+	CWFRPipeline pipeline(Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(), CWFRPipeline::PipelineOptions(2, 3, 2, 1, 1));
+	auto report = pipeline.run(frames);
+	EXPECT_EQ(report.frames, n_frames);
+	EXPECT_EQ(report.failed, 0) << report.message;
+	EXPECT_GT(report.frames_per_second, 0);
+
+	// the results are linear in the slopes
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ);
+	for (int k = 0; k < n_frames; k++) {
+		int z_rows = 0, z_cols = 0;
+		double* Z = nullptr;
+		ASSERT_EQ(read_matrix_from_disk(frames[k].z_file.c_str(), &z_rows, &z_cols, &Z), 0);
+		EXPECT_LT((Eigen::Map<MatrixXXd>(Z, z_rows, z_cols) - (k + 1) * Z_ref).cwiseAbs().maxCoeff(), 1e-9);
+		free(Z);
+	}
+
+	// a missing file is counted and skipped
+	frames[0].sx_file += ".missing";
+	report = pipeline.run(frames);
+	EXPECT_EQ(report.frames, n_frames - 1);
+	EXPECT_EQ(report.failed, 1);
+
+	std::filesystem::remove_all(directory);
+}
+
+TEST_F(MatrixIOTest, MapTheMatrix) {
+	// the view over the file matches the read copy
+	CMappedMatrix<double> mapped;
+	ASSERT_EQ(map_matrix_from_disk("../../data/Sx.bin", mapped), 0);
+	EXPECT_EQ(mapped.rows(), rows);
+	EXPECT_EQ(mapped.cols(), cols);
+	auto Sxmap = mapped.map();
+	EXPECT_TRUE((Sxmap.array() == Sxmap.array() || Sxmap.array().isNaN()).all());
+
+	// the mapping moves with its owner
+	CMappedMatrix<double> moved(std::move(mapped));
+	EXPECT_FALSE(mapped.is_open());
+	EXPECT_EQ(moved.data(), Sxmap.data());
+
+	// a truncated file or a different value type does not match the header
+	auto filename = (std::filesystem::temp_directory_path() / "wfr_truncated.bin").string();
+	write_matrix_to_disk(filename.c_str(), rows, cols - 1, Sx);
+	std::filesystem::resize_file(filename, std::filesystem::file_size(filename) - 1);
+	EXPECT_NE(map_matrix_from_disk(filename.c_str(), mapped), 0);
+	EXPECT_FALSE(mapped.is_open());
+	CMappedMatrix<float> as_float;
+	EXPECT_NE(map_matrix_from_disk("../../data/Sx.bin", as_float), 0);
+	EXPECT_NE(map_matrix_from_disk("../../data/missing.bin", mapped), 0);
+
+	std::filesystem::remove(filename);
+}
+
+TEST_F(CWFRTest, hfliq_views) {
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ);
+
+	// the views of the maps share one geometry and its plans
+	auto geometry = std::make_shared<const CWFRGeometry>(Xmap, Ymap);
+	auto plan_cache = std::make_shared<CWFRPlanCache>();
+	for (int k = 0; k < 2; k++) {
+		CWFR view(Sxmap, Symap, geometry);
+		view.set_plan_cache(plan_cache);
+		EXPECT_LT((view(CWFR::WFR_METHOD::HFLIQ) - Z_ref).cwiseAbs().maxCoeff(), 1e-12);
+	}
+	EXPECT_EQ(plan_cache->size(), 1);
+
+	// a block of a larger grid is viewed with its outer stride
+	MatrixXXd Sx_wide = MatrixXXd::Constant(rows, cols + 7, NAN);
+	MatrixXXd Sy_wide = MatrixXXd::Constant(rows, cols + 7, NAN);
+	Sx_wide.middleCols(3, cols) = Sxmap;
+	Sy_wide.middleCols(3, cols) = Symap;
+	CWFR block_view(Sx_wide.middleCols(3, cols), Sy_wide.middleCols(3, cols), geometry);
+	EXPECT_LT((block_view(CWFR::WFR_METHOD::HFLIQ) - Z_ref).cwiseAbs().maxCoeff(), 1e-12);
+}
+
+TEST_F(CWFRTest, hfliq_float) {
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+
+	// the float factorization is refined to the double solution
+	MatrixXXd Z = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::MIXED_LDLT));
+	EXPECT_TRUE(wfr.report().success()) << wfr.report().message;
+	EXPECT_GT(wfr.report().iterations, 1);
+	EXPECT_LT((Z - Z_ref).cwiseAbs().maxCoeff(), 1e-10);
+
+	// no refinement step is reported
+	wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::MIXED_LDLT, 1e-14, 1));
+	EXPECT_FALSE(wfr.report().success());
+	EXPECT_FALSE(wfr.report().message.empty());
+
+	// the float slopes agree at float precision
+	MatrixXXf Sxf = Sxmap.cast<float>();
+	MatrixXXf Syf = Symap.cast<float>();
+	CWFRf wfr_f(Sxf, Syf, Xmap, Ymap);
+	MatrixXXf Zf = wfr_f(CWFR::WFR_METHOD::HFLIQ);
+	EXPECT_TRUE(wfr_f.report().success()) << wfr_f.report().message;
+	EXPECT_LT((Zf.cast<double>() - Z_ref).cwiseAbs().maxCoeff(), 1e-5 * Z_ref.cwiseAbs().maxCoeff());
+
+	// and their views share the geometry and its plans with the double slopes
+	auto geometry = std::make_shared<const CWFRGeometry>(Xmap, Ymap);
+	auto plan_cache = std::make_shared<CWFRPlanCache>();
+	Eigen::Map<MatrixXXf> Sxf_map(Sxf.data(), rows, cols);
+	CWFRf view_f(Sxf_map, Syf, geometry);
+	view_f.set_plan_cache(plan_cache);
+	EXPECT_LT((view_f(CWFR::WFR_METHOD::HFLIQ) - Zf).cwiseAbs().maxCoeff(), 1e-5 * Z_ref.cwiseAbs().maxCoeff());
+	CWFR view(Sxmap, Symap, geometry);
+	view.set_plan_cache(plan_cache);
+	view(CWFR::WFR_METHOD::HFLIQ);
+	EXPECT_EQ(plan_cache->size(), 1);
+}
+
+TEST_F(CWFRTest, hfliq_stats) {
+	// the stats are off by default
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	wfr(CWFR::WFR_METHOD::HFLIQ);
+	EXPECT_EQ(wfr.stats().total_seconds, 0);
+
+	// the hook gets the phases and the size of every reconstruction
+	std::vector<CWFR::ReconstructionStats> exported;
+	wfr.set_stats_hook([&exported](const CWFR::ReconstructionStats& stats) { exported.push_back(stats); });
+	wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	ASSERT_EQ(exported.size(), 1);
+	const auto& stats = exported.back();
+	CWFRAssembly assembly(Sxmap, Symap);
+	EXPECT_EQ(stats.valid_pixels, assembly.num_unknowns());
+	EXPECT_EQ(stats.equations, assembly.num_equations());
+	EXPECT_EQ(stats.third_order + stats.fifth_order, stats.equations);
+	EXPECT_GT(stats.fifth_order, 0);
+	EXPECT_EQ(stats.nnz, 2 * stats.equations);
+	EXPECT_FALSE(stats.is_plan_reused);
+	EXPECT_TRUE(stats.report.success());
+	EXPECT_GT(stats.setup_seconds, 0);
+	EXPECT_GE(stats.total_seconds, stats.scan_seconds + stats.assembly_seconds + stats.build_seconds + stats.setup_seconds + stats.solve_seconds + stats.scatter_seconds);
+
+	// a cached plan skips the setup, and a failure is exported too
+	wfr.set_plan_cache(std::make_shared<CWFRPlanCache>());
+	wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	ASSERT_EQ(exported.size(), 3);
+	EXPECT_FALSE(exported[1].is_plan_reused);
+	EXPECT_TRUE(exported[2].is_plan_reused);
+	EXPECT_EQ(exported[2].setup_seconds, 0);
+	EXPECT_EQ(exported[2].nnz, stats.nnz);
+
+	wfr.set_plan_cache(nullptr);
+	wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::LSCG, 1e-12, 2));
+	ASSERT_EQ(exported.size(), 4);
+	EXPECT_FALSE(exported.back().report.success());
+	EXPECT_EQ(exported.back().report.iterations, 2);
+}
+
+TEST_F(CWFRTest, other_methods) {
+	// the rms error against the known shape, both without their means
+	auto rms_error = [this](const MatrixXXd& Z_calc) {
+		auto is_valid = Z_calc.array().isFinite() && Zmap.array().isFinite();
+		auto n = static_cast<double>(is_valid.count());
+		auto mean_calc = is_valid.select(Z_calc.array(), 0).sum() / n;
+		auto mean_ref = is_valid.select(Zmap.array(), 0).sum() / n;
+		auto diff = is_valid.select(Z_calc.array() - mean_calc - Zmap.array() + mean_ref, 0);
+		return std::sqrt(diff.square().sum() / n);
+	};
+
+	// every method reconstructs the shape, and the resampled ones keep the aperture
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	auto hfliq_error = rms_error(wfr(CWFR::WFR_METHOD::HFLIQ));
+	auto range = Zmap.array().isFinite().select(Zmap.array(), 0).abs().maxCoeff();
+	const CWFR::WFR_METHOD methods[] = {
+		CWFR::WFR_METHOD::TFLI, CWFR::WFR_METHOD::TFLIQ, CWFR::WFR_METHOD::SLI, CWFR::WFR_METHOD::SLIQ,
+		CWFR::WFR_METHOD::TFLI_I, CWFR::WFR_METHOD::HFLI_I, CWFR::WFR_METHOD::SLI_I
+	};
+	for (auto method : methods) {
+		MatrixXXd Z_calc = wfr(method);
+		EXPECT_TRUE(wfr.report().success());
+		EXPECT_LT(rms_error(Z_calc), 0.01 * range);
+		EXPECT_EQ((Z_calc.array().isFinite() && !(Sxmap.array().isFinite() && Symap.array().isFinite())).count(), 0);
+	}
+
+	// the higher-order methods are more accurate than the trapezoidal one
+	auto tfliq_error = rms_error(wfr(CWFR::WFR_METHOD::TFLIQ));
+	EXPECT_LT(hfliq_error, 0.1 * tfliq_error);
+	EXPECT_LT(rms_error(wfr(CWFR::WFR_METHOD::SLIQ)), 0.1 * tfliq_error);
+
+	// the splines are exact for cubic slopes, so SLI is exact for a quartic height
+	const int_t n = 32;
+	MatrixXXd Xq(n, n), Yq(n, n), Zq(n, n), Sxq(n, n), Syq(n, n);
+	for (int_t i = 0; i < n; i++) {
+		for (int_t j = 0; j < n; j++) {
+			Xq(i, j) = -1 + 2.0 * j / (n - 1);
+			Yq(i, j) = -1 + 2.0 * i / (n - 1);
+			Zq(i, j) = std::pow(Xq(i, j), 4) + std::pow(Yq(i, j), 4);
+			Sxq(i, j) = 4 * std::pow(Xq(i, j), 3);
+			Syq(i, j) = 4 * std::pow(Yq(i, j), 3);
+		}
+	}
+	CWFR wfr_quartic(Sxq, Syq, Xq, Yq);
+	MatrixXXd Z_sli = wfr_quartic(CWFR::WFR_METHOD::SLI, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	MatrixXXd Z_tfli = wfr_quartic(CWFR::WFR_METHOD::TFLI, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	Zq.array() -= Zq.mean();
+	EXPECT_LT((Z_sli - Zq).cwiseAbs().maxCoeff(), 1e-10);
+	EXPECT_GT((Z_tfli - Zq).cwiseAbs().maxCoeff(), 1e-4);
+}
+
+TEST_F(CWFRTest, hfliq_components) {
+	// three segments split by the gaps of three columns, and an isolated pixel
+	MatrixXXd Sxm = Sxmap, Sym = Symap;
+	for (auto j : { cols / 3, 2 * cols / 3 }) {
+		Sxm.middleCols(j, 3).setConstant(NAN);
+		Sym.middleCols(j, 3).setConstant(NAN);
+	}
+	Sxm(rows / 2, cols / 3 + 1) = Sym(rows / 2, cols / 3 + 1) = 0.5;
+	CWFRAssembly assembly(Sxm, Sym);
+	EXPECT_EQ(assembly.num_components(), 4);
+
+	// the split systems give the same apertures, each with its own zero mean
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	wfr.set_num_threads(2);
+	wfr.set_split_enabled(false);
+	MatrixXXd Z_whole = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	wfr.set_split_enabled(true);
+	for (auto solver : { CWFR::WFR_SOLVER::SIMPLICIAL_LDLT, CWFR::WFR_SOLVER::LSCG }) {
+		MatrixXXd Z_split = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(solver, 1e-12));
+		EXPECT_TRUE(wfr.report().success());
+		EXPECT_TRUE(((Z_split.array().isFinite()) == (Z_whole.array().isFinite())).all());
+		EXPECT_LT((Z_split - Z_whole).array().isFinite().select(Z_split - Z_whole, 0).cwiseAbs().maxCoeff(), 1e-8);
+	}
+	EXPECT_EQ(Z_whole(rows / 2, cols / 3 + 1), 0);
+}
+
+TEST_F(CWFRTest, hfliq_orderings) {
+	// copy the slopes
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+
+	// a holey aperture
+	for (int_t i = 10; i < rows; i += 25) {
+		for (int_t j = 10; j < cols; j += 25) {
+			Sxm.block(i, j, 6, 6).fill(NAN);
+			Sym.block(i, j, 6, 6).fill(NAN);
+		}
+	}
+
+	// the orderings permute the unknowns, and RCM narrows the band of D^T * D
+	auto bandwidth = [](const CWFRAssembly& assembly) {
+		int_t band = 0;
+		const auto& ids = assembly.ids();
+		for (int_t i = 0; i < assembly.rows(); i++) {
+			for (int_t j = 0; j < assembly.cols(); j++) {
+				if (assembly.class_x()(i, j) != CWFRAssembly::NONE) band = std::max<int_t>(band, std::abs(ids(i, j + 1) - ids(i, j)));
+				if (assembly.class_y()(i, j) != CWFRAssembly::NONE) band = std::max<int_t>(band, std::abs(ids(i + 1, j) - ids(i, j)));
+			}
+		}
+		return band;
+	};
+	CWFRAssembly natural(Sxm, Sym);
+	CWFRAssembly rcm(Sxm, Sym, CWFR::WFR_ORDERING::RCM);
+	EXPECT_EQ(rcm.num_unknowns(), natural.num_unknowns());
+	EXPECT_LT(bandwidth(rcm), bandwidth(natural));
+	std::vector<int_t> ids(rcm.ids().data(), rcm.ids().data() + rcm.ids().size());
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::remove(ids.begin(), ids.end(), -1), ids.end());
+	EXPECT_EQ(std::adjacent_find(ids.begin(), ids.end()), ids.end());
+	EXPECT_EQ(ids.back(), rcm.num_unknowns() - 1);
+
+	// the values are scattered back to their pixels by every backend, with a plan too
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT));
+	for (auto ordering : { CWFR::WFR_ORDERING::RCM, CWFR::WFR_ORDERING::NESTED_DISSECTION }) {
+		for (auto solver : { CWFR::WFR_SOLVER::SIMPLICIAL_LDLT, CWFR::WFR_SOLVER::LSCG, CWFR::WFR_SOLVER::MULTIGRID_CG }) {
+			MatrixXXd Z = wfr(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(solver, 1e-12, 0, ordering));
+			EXPECT_TRUE(wfr.report().success()) << wfr.report().message;
+			EXPECT_LT((Z - Z_ref).array().isNaN().select(0, Z - Z_ref).cwiseAbs().maxCoeff(), 1e-8);
+		}
+		auto plan = wfr.make_plan(CWFR::WFR_METHOD::HFLIQ, CWFR::SolverOptions(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT, 0, 0, ordering));
+		EXPECT_EQ(plan->assembly().ordering(), ordering);
+		VectorXd g(plan->num_equations()), z;
+		CWFR::SolverReport report;
+		plan->assemble_g(Sxm, Sym, Xmap, Ymap, g);
+		ASSERT_TRUE(plan->solve(g, z, report));
+		MatrixXXd Z = plan->scatter(z);
+		EXPECT_LT((Z - Z_ref).array().isNaN().select(0, Z - Z_ref).cwiseAbs().maxCoeff(), 1e-8);
+	}
+}
+
+TEST_F(CWFRTest, hfliq_reconstruct_into) {
+	auto geometry = std::make_shared<const CWFRGeometry>(Xmap, Ymap);
+	CWFR reference(Sxmap, Symap, geometry);
+	MatrixXXd Z_ref = reference(CWFR::WFR_METHOD::HFLIQ);
+
+	// the frames of a cached plan reuse the buffers of one workspace, and the LDLT solves in place
+	CWFR::SolverOptions options(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT);
+	auto plan_cache = std::make_shared<CWFRPlanCache>();
+	auto workspace = std::make_shared<CWFR::Workspace>();
+	MatrixXXd Z_wide = MatrixXXd::Constant(rows, cols + 4, 7);
+	const double* g_data = nullptr;
+	for (int frame = 0; frame < 3; frame++) {
+		CWFR wfr(Sxmap, Symap, geometry);
+		wfr.set_plan_cache(plan_cache);
+		wfr.set_workspace(workspace);
+		ASSERT_TRUE(wfr.reconstruct_into(Z_wide.data() + 2, Z_wide.cols(), CWFR::WFR_METHOD::HFLIQ, options)) << wfr.report().message;
+		EXPECT_LT((Z_wide.middleCols(2, cols) - Z_ref).cwiseAbs().maxCoeff(), 1e-8);
+		if (frame > 0) {
+			EXPECT_EQ(workspace->g.data(), g_data);
+		}
+		g_data = workspace->g.data();
+	}
+	EXPECT_TRUE((Z_wide.leftCols(2).array() == 7).all());
+	EXPECT_TRUE((Z_wide.rightCols(2).array() == 7).all());
+
+	// the float result, and the stream into a buffer
+	CWFRf wfr_float(MatrixXXf(Sxmap.cast<float>()), MatrixXXf(Symap.cast<float>()), Xmap, Ymap);
+	wfr_float.set_plan_cache(std::make_shared<CWFRPlanCache>());
+	MatrixXXf Z_float(rows, cols);
+	ASSERT_TRUE(wfr_float.reconstruct_into(Z_float, CWFR::WFR_METHOD::HFLIQ));
+	EXPECT_LT((Z_float.cast<double>() - Z_ref).cwiseAbs().maxCoeff(), 1e-4);
+
+	CWFRStream stream(geometry, CWFR::WFR_METHOD::HFLIQ);
+	MatrixXXd Z(rows, cols);
+	for (int frame = 0; frame < 2; frame++) {
+		ASSERT_TRUE(stream(Sxmap, Symap, Z)) << stream.report().message;
+		EXPECT_LT((Z - Z_ref).cwiseAbs().maxCoeff(), 1e-6);
+	}
+}
+
+TEST_F(CWFRTest, hfliq_reconstruct_into_no_allocation) {
+	// the first frame builds the plan and sizes the workspace
+	CWFR::SolverOptions options(CWFR::WFR_SOLVER::SIMPLICIAL_LDLT);
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	wfr.set_plan_cache(std::make_shared<CWFRPlanCache>());
+	wfr.set_workspace(std::make_shared<CWFR::Workspace>());
+	MatrixXXd Z(rows, cols);
+	auto num_first = g_num_allocations.load();
+	ASSERT_TRUE(wfr.reconstruct_into(Z, CWFR::WFR_METHOD::HFLIQ, options)) << wfr.report().message;
+	EXPECT_GT(g_num_allocations.load(), num_first);
+
+	// the frames of the steady state do not call operator new
+	for (int frame = 0; frame < 3; frame++) {
+		auto num_allocations = g_num_allocations.load();
+		bool is_done = wfr.reconstruct_into(Z, CWFR::WFR_METHOD::HFLIQ, options);
+		EXPECT_EQ(g_num_allocations.load(), num_allocations) << frame;
+		ASSERT_TRUE(is_done) << wfr.report().message;
+	}
+}
+
+TEST_F(CWFRTest, hfliq_noise_study) {
+	auto geometry = std::make_shared<const CWFRGeometry>(Xmap, Ymap);
+	CWFRNoiseStudy study(Sxmap, Symap, geometry, CWFR::WFR_METHOD::HFLIQ);
+	ASSERT_TRUE(study.report().success()) << study.report().message;
+
+	// the realizations do not depend on the threads, and the error is linear in the noise
+	const double sigma = 1e-3;
+	auto serial = study.run(sigma, 40);
+	study.set_num_threads(3);
+	study.set_batch_size(6);
+	auto parallel = study.run(sigma, 40);
+	auto doubled = study.run(2 * sigma, 40);
+	study.set_num_threads(1);
+	study.set_batch_size(7);
+	auto serial_batched = study.run(sigma, 40);
+	ASSERT_TRUE(study.report().success()) << study.report().message;
+	for (int_t k = 0; k < 40; k++) {
+		EXPECT_DOUBLE_EQ(parallel.rms_errors[k], serial.rms_errors[k]);
+		EXPECT_DOUBLE_EQ(serial_batched.rms_errors[k], serial.rms_errors[k]);
+		EXPECT_NEAR(doubled.rms_errors[k], 2 * serial.rms_errors[k], 1e-6 * serial.rms_errors[k]);
+	}
+	EXPECT_LT((parallel.std - serial.std).cwiseAbs().maxCoeff(), 1e-12 * serial.std.maxCoeff());
+
+	// the randomized variance agrees with the sampled one within the sampling error of 40 realizations
+	MatrixXXd variance = study.estimate_variance(40);
+	auto ratio = serial.std.array().square().sum() / (sigma * sigma * variance.sum());
+	EXPECT_NEAR(ratio, 1.0, 0.3);
+}
+
+TEST_F(CWFRTest, hfliq_pyramid) {
+	// copy the slopes
+	MatrixXXd Sxm = Sxmap;
+	MatrixXXd Sym = Symap;
+
+	// a central obscuration
+	for (int_t i = 0; i < rows; i++) {
+		for (int_t j = 0; j < cols; j++) {
+			auto di = i - rows / 2.0, dj = j - cols / 2.0;
+			if (di * di + dj * dj < 0.04 * rows * cols) Sxm(i, j) = Sym(i, j) = NAN;
+		}
+	}
+
+	// a coarse pixel needs 2 valid finer pixels, and keeps the mean slope
+	CWFRPyramid pyramid(Sxm, Sym, Xmap, Ymap, 3);
+	ASSERT_EQ(pyramid.num_levels(), 3);
+	EXPECT_EQ(pyramid.Sx(3).rows(), (rows + 7) / 8);
+	EXPECT_TRUE(std::isnan(pyramid.Sx(1)(rows / 4, cols / 4)));
+	EXPECT_DOUBLE_EQ(pyramid.Sx(1)(0, 0), (Sxm(0, 0) + Sxm(0, 1) + Sxm(1, 0) + Sxm(1, 1)) / 4);
+
+	CWFR::SolverOptions options(CWFR::WFR_SOLVER::LSCG, 1e-10);
+	CWFR plain(Sxm, Sym, Xmap, Ymap);
+	MatrixXXd Z_ref = plain(CWFR::WFR_METHOD::HFLIQ, options);
+	ASSERT_TRUE(plain.report().success()) << plain.report().message;
+
+	// the previews arrive coarsest first, and seed the finer levels
+	CWFR wfr(Sxm, Sym, Xmap, Ymap);
+	std::vector<int> levels;
+	wfr.set_pyramid(3, [&](int level, const MatrixXXd& Z) {
+		levels.push_back(level);
+		EXPECT_EQ(Z.rows(), pyramid.Sx(level).rows());
+		EXPECT_EQ(Z.cols(), pyramid.Sx(level).cols());
+	});
+	MatrixXXd Z = wfr(CWFR::WFR_METHOD::HFLIQ, options);
+	ASSERT_TRUE(wfr.report().success()) << wfr.report().message;
+	EXPECT_EQ(levels, std::vector<int>({ 3, 2, 1 }));
+	EXPECT_LT(wfr.report().iterations, plain.report().iterations);
+	EXPECT_LT((Z - Z_ref).array().isNaN().select(0, Z - Z_ref).cwiseAbs().maxCoeff(), 1e-8);
+}
+
+TEST_F(CWFRTest, hfliq_service) {
+	CWFR wfr(Sxmap, Symap, Xmap, Ymap);
+	MatrixXXd Z_ref = wfr(CWFR::WFR_METHOD::HFLIQ);
+
+	// the results are linear in the slopes, and a cancelled request is flagged
+	auto pool = std::make_shared<CWFRThreadPool>(3);
+	CWFRService service(pool);
+	auto cancellation = std::make_shared<CWFRService::Cancellation>();
+	cancellation->cancel();
+	const int n_frames = 6;
+	std::vector<std::future<CWFRService::Result>> futures;
+	for (int k = 0; k < n_frames; k++) {
+		auto priority = k % 2 ? CWFRService::PRIORITY::LIVE : CWFRService::PRIORITY::BATCH;
+		futures.push_back(service.submit((k + 1) * Sxmap, (k + 1) * Symap, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, priority));
+	}
+	auto cancelled = service.submit(Sxmap, Symap, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ, CWFRService::PRIORITY::LIVE, cancellation);
+	for (int k = 0; k < n_frames; k++) {
+		auto result = futures[k].get();
+		EXPECT_FALSE(result.is_cancelled);
+		EXPECT_TRUE(result.report.success()) << result.report.message;
+		ASSERT_EQ(result.Z.rows(), rows);
+		EXPECT_LT((result.Z - (k + 1) * Z_ref).cwiseAbs().maxCoeff(), 1e-9);
+	}
+	auto cancelled_result = cancelled.get();
+	EXPECT_TRUE(cancelled_result.is_cancelled);
+	EXPECT_EQ(cancelled_result.Z.size(), 0);
+
+	// a live task jumps ahead of the queued batch ones
+	CWFRThreadPool single(1);
+	std::promise<void> gate, is_done;
+	std::string order;
+	single.submit([is_open = gate.get_future().share()]() { is_open.wait(); });
+	single.submit([&]() { order += 'b'; }, CWFRThreadPool::PRIORITY::BATCH);
+	single.submit([&]() { order += 'l'; }, CWFRThreadPool::PRIORITY::LIVE);
+	single.submit([&]() { is_done.set_value(); }, CWFRThreadPool::PRIORITY::BATCH);
+	gate.set_value();
+	is_done.get_future().wait();
+	EXPECT_EQ(order, "lb");
+
+	// the chunks of a parallel_for in a worker are stolen by the others, never run by more threads than the pool
+	std::atomic<int> active(0), max_active(0);
+	std::atomic<int_t> sum(0);
+	std::promise<void> is_summed;
+	pool->submit([&]() {
+		parallel_for(0, 64, 0, 1, [&](int_t begin, int_t end) {
+			auto n = ++active;
+			for (auto m = max_active.load(); n > m && !max_active.compare_exchange_weak(m, n);) {}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			sum += end - begin;
+			active--;
+		});
+		is_summed.set_value();
+	});
+	is_summed.get_future().wait();
+	EXPECT_EQ(sum, 64);
+	EXPECT_LE(max_active, pool->size());
+
+	// an exception of a chunk reaches the caller after all the chunks, and the workers survive it
+	std::promise<int_t> is_thrown;
+	pool->submit([&]() {
+		std::atomic<int_t> chunks(0);
+		try {
+			parallel_for(0, 16, 3, 1, [&](int_t begin, int_t) {
+				chunks++;
+				if (begin == 5) throw std::runtime_error("chunk 5");
+			});
+		}
+		catch (const std::runtime_error&) {
+			is_thrown.set_value(chunks);
+		}
+	});
+	EXPECT_EQ(is_thrown.get_future().get(), 16);
+	pool->submit([]() { throw std::runtime_error("task"); });
+	EXPECT_TRUE(service.submit(Sxmap, Symap, Xmap, Ymap, CWFR::WFR_METHOD::HFLIQ).get().report.success());
+}
+
+TEST_F(MatrixIOTest, SlopeArchive) {
+	// scaled frames, the odd ones masked by a circular aperture
+	const int n_frames = 5;
+	std::vector<MatrixXXd> Sx_frames, Sy_frames;
+	for (int k = 0; k < n_frames; k++) {
+		Sx_frames.push_back((1 + 0.1 * k) * Sxmap);
+		Sy_frames.push_back((1 + 0.1 * k) * Symap);
+		for (int i = 0; i < rows && k % 2; i++) {
+			for (int j = 0; j < cols; j++) {
+				auto u = i - 0.5 * (rows - 1), v = j - 0.5 * (cols - 1);
+				if (u * u + v * v > 0.25 * rows * cols) Sx_frames[k](i, j) = Sy_frames[k](i, j) = std::numeric_limits<double>::quiet_NaN();
+			}
+		}
+	}
+
+	auto filename = (std::filesystem::temp_directory_path() / "wfr_slope_archive_test.wfra").string();
+	auto same = [](const MatrixXXd& A, const MatrixXXd& B) {
+		return ((A.array() == B.array()) || (A.array().isNaN() && B.array().isNaN())).all();
+	};
+	for (auto dtype : { CSlopeArchive::DTYPE::FLOAT64, CSlopeArchive::DTYPE::FLOAT32 }) {
+		for (auto codec : { CSlopeArchive::CODEC::RAW, CSlopeArchive::CODEC::SHUFFLE_PACKBITS }) {
+			// 2 frames per chunk, the last chunk is not full
+			CSlopeArchiveWriter writer;
+			ASSERT_EQ(writer.open(filename.c_str(), rows, cols, X, Y, dtype, 2, codec), 0);
+			for (int k = 0; k < n_frames; k++) ASSERT_EQ(writer.write_frame(Sx_frames[k].data(), Sy_frames[k].data()), 0);
+			ASSERT_EQ(writer.close(), 0);
+			if (dtype == CSlopeArchive::DTYPE::FLOAT32 && codec == CSlopeArchive::CODEC::SHUFFLE_PACKBITS) {
+				// the frames take less than half of the .bin files, besides the geometry stored once
+				auto geometry_size = 2 * sizeof(double) * rows * cols;
+				EXPECT_LT(std::filesystem::file_size(filename) - geometry_size, n_frames * geometry_size / 2);
+			}
+
+			CSlopeArchiveReader reader(filename.c_str());
+			ASSERT_TRUE(reader.is_open());
+			EXPECT_EQ(reader.num_frames(), n_frames);
+			EXPECT_EQ(reader.dtype(), dtype);
+			EXPECT_TRUE(reader.X() == Xmap && reader.Y() == Ymap);
+
+			// random access, across the chunks and backwards
+			MatrixXXd Sxk(rows, cols), Syk(rows, cols);
+			for (int k : { 4, 1, 2, 0, 3 }) {
+				ASSERT_EQ(reader.read_frame(k, Sxk.data(), Syk.data()), 0);
+				if (dtype == CSlopeArchive::DTYPE::FLOAT64) {
+					EXPECT_TRUE(same(Sxk, Sx_frames[k]) && same(Syk, Sy_frames[k]));
+				}
+				else {
+					EXPECT_TRUE(same(Sxk, Sx_frames[k].cast<float>().cast<double>()) && same(Syk, Sy_frames[k].cast<float>().cast<double>()));
+				}
+			}
+			EXPECT_NE(reader.read_frame(n_frames, Sxk.data(), Syk.data()), 0);
+		}
+	}
+
+	// the float frames go straight into the batch reconstruction
+	CSlopeArchiveReader reader(filename.c_str());
+	std::vector<MatrixXXf> Sx_batch, Sy_batch;
+	ASSERT_EQ(reader.read_frames(0, n_frames, Sx_batch, Sy_batch), 0);
+	auto Z_batch = CWFRf::batch(Sx_batch, Sy_batch, reader.X(), reader.Y(), CWFR::WFR_METHOD::HFLIQ);
+	ASSERT_EQ(Z_batch.size(), n_frames);
+	CWFRf wfr(Sx_batch[2], Sy_batch[2], reader.X(), reader.Y());
+	EXPECT_LT((Z_batch[2] - wfr(CWFR::WFR_METHOD::HFLIQ)).cwiseAbs().maxCoeff(), 1e-5);
+
+	// an archive which is not closed has no index
+	{
+		CSlopeArchiveWriter writer;
+		ASSERT_EQ(writer.open(filename.c_str(), rows, cols, X, Y), 0);
+		writer.write_frame(Sx, Sy);
+		CSlopeArchiveReader unfinished;
+		EXPECT_NE(unfinished.open(filename.c_str()), 0);
+	}
+
+	// a corrupt header or index is rejected, not read out of bounds
+	auto corrupt = [&](std::initializer_list<std::pair<uint64_t, uint32_t>> changes) {
+		CSlopeArchiveWriter writer;
+		writer.open(filename.c_str(), rows, cols, X, Y, CSlopeArchive::DTYPE::FLOAT32, 2, CSlopeArchive::CODEC::SHUFFLE_PACKBITS);
+		for (int k = 0; k < n_frames; k++) writer.write_frame(Sx_frames[k].data(), Sy_frames[k].data());
+		writer.close();
+		std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+		uint64_t index_offset = 0;
+		file.seekg(40);
+		file.read(reinterpret_cast<char*>(&index_offset), sizeof(index_offset));
+		for (auto change : changes) {
+			file.seekp(change.first < 48 ? change.first : index_offset + change.first - 48);
+			file.write(reinterpret_cast<const char*>(&change.second), sizeof(change.second));
+		}
+	};
+	MatrixXXd Sxk(rows, cols), Syk(rows, cols);
+	corrupt({ { 12, 7 } }); // an unknown codec
+	EXPECT_NE(reader.open(filename.c_str()), 0);
+	corrupt({ { 28, 1u << 30 } }); // more chunks than the file holds
+	EXPECT_NE(reader.open(filename.c_str()), 0);
+	corrupt({ { 48 + 24, 1 }, { 48 + 2 * 32 + 24, 2 } }); // a short first chunk, made up for by the last one
+	ASSERT_EQ(reader.open(filename.c_str()), 0);
+	EXPECT_NE(reader.read_frame(1, Sxk.data(), Syk.data()), 0);
+
+	reader.close();
+	std::filesystem::remove(filename);
+}